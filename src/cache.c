@@ -1,49 +1,468 @@
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "cache.h"
+#include "hash.h"
 #include "utils.h"
 
 /*
  * We provide a very simple mechanism for persistence.  It is simple a key-value
- * database, where each key-value pair is a file, where key is the filename and
- * value its contents.
- 
- * Although it is possible, these files are not meant to be edited from an
- * editor.  They do not have a end of line character at the end of the file and
- * editing them can break janechat.
+ * database, whose values are C strings.
+ *
+ * All pairs of a profile are kept in a single append-only file, the log.  It
+ * starts with CACHE_LOG_MAGIC, followed by one record per cache_set() call:
+ *
+ *	+-----------+-----------+-----+-------+
+ *	| keylen    | vallen    | key | value |
+ *	| (uint32)  | (uint32)  |     |       |
+ *	+-----------+-----------+-----+-------+
+ *
+ * The last record of a key wins.  The log is read once, the first time the
+ * cache is used, into an in-memory index (a Hash of key -> struct cache_entry),
+ * so lookups never touch the disk and storing a key is a single write(2).
+ * A record cut short by a crash is dropped when loading.
+ *
+ * Overwritten records are garbage.  When there is more garbage than live data
+ * (and enough of it to be worth it), the log is compacted: live records are
+ * written to a new file, that replaces the log with rename(2), so a crash
+ * leaves either the old or the new one.  If that fails, we keep appending to
+ * the old one, and the next flush tries again.
+ *
+ * Older versions kept each pair in a file of its own, named after the key.
+ * Those files are moved into the log the first time it is created.  Files
+ * opened with cache_open() don't go through the log, so they should live in
+ * subdirectories (e.g. "timeline/room/log").
+ *
+ * Keys that change on every sync (e.g. "next_batch") are stored with
+ * cache_set_lazy() instead, that only updates the index and marks the entry as
+ * dirty.  cache_flush() appends the last value of every dirty entry and waits
+ * for them to reach the disk, so a key changed many times between flushes costs
+ * a single record, and the thread that changes it never waits for the disk.
+ * It is called periodically and when exiting (see main.c).  A crash loses the
+ * changes since the last flush, never the previous value.  Values that can't
+ * be written (e.g. the disk is full), by either function, stay dirty so the
+ * next flush tries again.
+ *
+ * Values are read and written from both the main and the network thread, so
+ * everything is done with cache_lock held, except for waiting for the disk.
  */
 
+#define CACHE_LOG "cache.log"
+#define CACHE_LOG_MAGIC "janechat-cache-1\n"
+
+/* Don't compact logs whose garbage is smaller than this */
+#define CACHE_COMPACT_MIN (64 * 1024)
+
+struct cache_entry {
+	char *key;
+	char *value;
+	size_t len;	/* strlen(value) */
+	bool dirty;	/* Set with cache_set_lazy(), not written yet */
+};
+
+struct cache_record {
+	uint32_t keylen;
+	uint32_t vallen;
+};
+
 static const char *profile = "default";
 
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Hash *entries = NULL;	/* Hash<struct cache_entry>.  See cache_load() */
+static int logfd = -1;
+static size_t live = 0;		/* Bytes of the last record of clean keys */
+static size_t garbage = 0;	/* Bytes of overwritten records */
+static size_t dirty_entries = 0; /* Entries with dirty set */
+
 static char *cache_dir(void);
 static void mkdir_r(const char *);
+static void cache_load(void);
+static bool cache_compact(void);
+
+static size_t record_size(const struct cache_entry *e) {
+	return sizeof(struct cache_record) + strlen(e->key) + e->len;
+}
+
+/* Update the index.  Return the size of the record `key` had, 0 if none. */
+static size_t index_set(const char *key, const char *value, size_t len) {
+	size_t old = 0;
+	struct cache_entry *e = hash_get(entries, key);
+	if (e) {
+		old = record_size(e);
+		free(e->value);
+	} else {
+		e = malloc(sizeof(struct cache_entry));
+		e->key = strdup(key);
+		e->dirty = false;
+		hash_insert(entries, e->key, e);
+	}
+	e->value = malloc(len + 1);
+	memcpy(e->value, value, len);
+	e->value[len] = '\0';
+	e->len = len;
+	return old;
+}
+
+/*
+ * Append a record to `fd`.  Return false on errors, and then nothing was
+ * appended: the records after it can be read.
+ */
+static bool record_write(int fd, const char *key, const char *value, size_t len)
+{
+	struct cache_record r = { strlen(key), len };
+	size_t size = sizeof(r) + r.keylen + len;
+	char *buf = malloc(size);
+	memcpy(buf, &r, sizeof(r));
+	memcpy(buf + sizeof(r), key, r.keylen);
+	memcpy(buf + sizeof(r) + r.keylen, value, len);
+	/* A single write, so a crash cuts short one record at most */
+	ssize_t n = write(fd, buf, size);
+	free(buf);
+	if (n > 0 && n != (ssize_t)size) {
+		/* E.g. the disk is full.  Take what was written back */
+		off_t end = lseek(fd, 0, SEEK_END);
+		if (end == -1 || ftruncate(fd, end - n) != 0)
+			perror("record_write()");
+	}
+	return n == (ssize_t)size;
+}
+
+/*
+ * Mark `e`, whose value is not in the log, as dirty, so cache_flush() writes
+ * it.  `old` is the size of its last record, that is garbage now.
+ */
+static void entry_set_dirty(struct cache_entry *e, size_t old) {
+	if (e->dirty)
+		return; /* Its last record was accounted as garbage already */
+	e->dirty = true;
+	dirty_entries++;
+	garbage += old;
+	live -= old;
+}
 
 void cache_set(const char *key, const char *value) {
-	mkdir_r(cache_dir());
-	
+	size_t len = strlen(value);
+
+	pthread_mutex_lock(&cache_lock);
+	cache_load();
+	struct cache_entry *e = hash_get(entries, key);
+	if (e && e->len == len && memcmp(e->value, value, len) == 0) {
+		pthread_mutex_unlock(&cache_lock);
+		return; /* Nothing changed */
+	}
+
+	bool ok = record_write(logfd, key, value, len);
+	bool was_dirty = e && e->dirty;
+	size_t old = index_set(key, value, len);
+	if (!ok) {
+		/* Keep it in memory and try again in cache_flush() */
+		perror("cache_set()");
+		entry_set_dirty(hash_get(entries, key), old);
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+	if (was_dirty) {
+		/* Its last record was accounted as garbage already */
+		e->dirty = false;
+		dirty_entries--;
+		old = 0;
+	}
+	garbage += old;
+	live += sizeof(struct cache_record) + strlen(key) + len - old;
+	if (garbage > CACHE_COMPACT_MIN && garbage > live)
+		cache_compact();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* Like cache_set(), but the value is written by the next cache_flush(). */
+void cache_set_lazy(const char *key, const char *value) {
+	size_t len = strlen(value);
+
+	pthread_mutex_lock(&cache_lock);
+	cache_load();
+	struct cache_entry *e = hash_get(entries, key);
+	if (e && e->len == len && memcmp(e->value, value, len) == 0) {
+		pthread_mutex_unlock(&cache_lock);
+		return; /* Nothing changed */
+	}
+
+	/*
+	 * The size of the record is accounted when it is written.  Until then
+	 * the index has a value that is not in the log.
+	 */
+	size_t old = index_set(key, value, len);
+	entry_set_dirty(hash_get(entries, key), old);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Write the values stored with cache_set_lazy(), or that cache_set() failed to
+ * write, and wait for the disk.  Those that can't be written are kept dirty,
+ * for the next call.
+ */
+void cache_flush(void) {
+	pthread_mutex_lock(&cache_lock);
+	if (entries && logfd == -1) {
+		/* cache_load() couldn't write the log.  Try again */
+		cache_compact();
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+	if (dirty_entries == 0
+	&& !(garbage > CACHE_COMPACT_MIN && garbage > live)) {
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	const char *key;
+	struct cache_entry *e;
+	size_t i;
+	HASH_FOREACH(entries, key, e, i) {
+		if (!e->dirty)
+			continue;
+		if (!record_write(logfd, key, e->value, e->len)) {
+			perror("cache_flush()");
+			continue;
+		}
+		e->dirty = false;
+		dirty_entries--;
+		live += record_size(e);
+	}
+	if (garbage > CACHE_COMPACT_MIN && garbage > live && cache_compact()) {
+		pthread_mutex_unlock(&cache_lock);
+		return; /* Already synced */
+	}
+
+	/*
+	 * The log may be replaced by a compaction meanwhile, so wait for our own
+	 * descriptor of it.  Records appended to the new log are synced by the
+	 * compaction.
+	 */
+	int fd = dup(logfd);
+	pthread_mutex_unlock(&cache_lock);
+	if (fd == -1 || fdatasync(fd) != 0)
+		perror("cache_flush()"); /* TODO: handle errors correctly */
+	if (fd != -1)
+		close(fd);
+}
+
+/* Store the path of `key` in `path`.  If `create`, make its directory. */
+static void key_path(const char *key, char *path, size_t len, bool create) {
+	snprintf(path, len, "%s/%s", cache_dir(), key);
+	if (create) {
+		char dir[PATH_MAX];
+		snprintf(dir, sizeof(dir), "%s", path);
+		*strrchr(dir, '/') = '\0';
+		mkdir_r(dir);
+	}
+}
+
+/*
+ * Open the file of `key` with fopen(3) `mode`, for values that are too large
+ * or change too often to go through cache_set().  For writing modes, missing
+ * directories are created, so `key` can have slashes (e.g. "timeline/room/log").
+ */
+FILE *cache_open(const char *key, const char *mode) {
+	char path[PATH_MAX];
+	key_path(key, path, sizeof(path), mode[0] != 'r');
+	return fopen(path, mode);
+}
+
+/*
+ * Like cache_open(), but with open(2) `flags`, for files that are kept open.
+ * Return the file descriptor, or -1 on errors.
+ */
+int cache_open_fd(const char *key, int flags) {
 	char path[PATH_MAX];
-	snprintf(path, sizeof(path), "%s/%s", cache_dir(), key);
+	key_path(key, path, sizeof(path), flags & O_CREAT);
+	return open(path, flags, 0600);
+}
 
-	FILE *f = fopen(path, "w");
-	assert(f != NULL); /* TODO: handle this case */
-	fprintf(f, "%s", value);
-	fflush(f);
-	fclose(f);
+/*
+ * Replace the file of `newkey` with the one of `oldkey`, both opened with
+ * cache_open(), atomically (see rename(2)).  Return false on errors.
+ */
+bool cache_rename(const char *oldkey, const char *newkey) {
+	char oldpath[PATH_MAX], newpath[PATH_MAX];
+	snprintf(oldpath, sizeof(oldpath), "%s/%s", cache_dir(), oldkey);
+	snprintf(newpath, sizeof(newpath), "%s/%s", cache_dir(), newkey);
+	return rename(oldpath, newpath) == 0;
 }
 
 char *cache_get_alloc(const char *key) {
-	char path[PATH_MAX];
-	snprintf(path, sizeof(path), "%s/%s", cache_dir(), key);
-	FILE *f = fopen(path, "r");
-	if (!f)
+	char *value = NULL;
+	pthread_mutex_lock(&cache_lock);
+	cache_load();
+	struct cache_entry *e = hash_get(entries, key);
+	if (e)
+		value = strdup(e->value);
+	pthread_mutex_unlock(&cache_lock);
+	return value;
+}
+
+/*
+ * Read the contents of the file at `path` to a buffer allocated with malloc(3).
+ * Its size is stored in *size.  NULL on errors.
+ */
+static char *file_read_alloc(const char *path, size_t *size) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
 		return NULL;
-	char *contents = read_file_alloc(f);
-	fclose(f);
-	return contents;
+	struct stat st;
+	char *buf = NULL;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		buf = malloc(st.st_size + 1);
+		ssize_t n = read(fd, buf, st.st_size);
+		if (n < 0) {
+			free(buf);
+			buf = NULL;
+		} else {
+			buf[n] = '\0';
+			*size = n;
+		}
+	}
+	close(fd);
+	return buf;
+}
+
+/*
+ * Index the records in the `len` bytes of `buf`.  Return how many of them are
+ * whole records.
+ */
+static size_t log_parse(const char *buf, size_t len) {
+	size_t off = 0;
+	while (len - off >= sizeof(struct cache_record)) {
+		struct cache_record r;
+		memcpy(&r, buf + off, sizeof(r));
+		size_t size = sizeof(r) + (size_t)r.keylen + r.vallen;
+		if (r.keylen == 0 || size > len - off)
+			break;
+		char *key = strndup(buf + off + sizeof(r), r.keylen);
+		size_t old = index_set(key, buf + off + sizeof(r) + r.keylen,
+			r.vallen);
+		garbage += old;
+		live += size - old;
+		free(key);
+		off += size;
+	}
+	return off;
+}
+
+/*
+ * Index the files of the file-per-key format, that older versions used, so
+ * they are written to the new log.  If `remove`, remove them instead, once the
+ * log is in place.
+ */
+static void migrate_files(bool remove) {
+	DIR *dir = opendir(cache_dir());
+	if (!dir)
+		return;
+	struct dirent *d;
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.' || strncmp(d->d_name, CACHE_LOG,
+		    strlen(CACHE_LOG)) == 0)
+			continue;
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", cache_dir(), d->d_name);
+		size_t size;
+		char *value = file_read_alloc(path, &size); /* NULL for dirs */
+		if (!value)
+			continue;
+		if (remove)
+			unlink(path);
+		else
+			index_set(d->d_name, value, strlen(value));
+		free(value);
+	}
+	closedir(dir);
+}
+
+/*
+ * Load the log into the index, if not done yet, and leave it open for
+ * appending.  If it has more garbage than live data, compact it.
+ */
+static void cache_load(void) {
+	if (entries)
+		return;
+	entries = hash_new();
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", cache_dir(), CACHE_LOG);
+	size_t len, magic = strlen(CACHE_LOG_MAGIC);
+	char *buf = file_read_alloc(path, &len);
+	if (buf && len >= magic && memcmp(buf, CACHE_LOG_MAGIC, magic) == 0) {
+		size_t end = magic + log_parse(buf + magic, len - magic);
+		free(buf);
+		if (end == len && !(garbage > CACHE_COMPACT_MIN && garbage > live)) {
+			logfd = open(path, O_WRONLY | O_APPEND);
+			if (logfd != -1)
+				return;
+		}
+		/* Cut short or wasteful.  Write it again */
+		if (cache_compact())
+			return;
+		/* Or keep appending to it, after its last whole record */
+		if (truncate(path, end) == 0)
+			logfd = open(path, O_WRONLY | O_APPEND);
+		return;
+	}
+	free(buf);
+
+	mkdir_r(cache_dir());
+	migrate_files(false);
+	/* Keep the old files until their values are in the log */
+	if (cache_compact())
+		migrate_files(true);
+}
+
+/*
+ * Write the live records of the index to a new log and make it the log.  On
+ * errors the old log stays (if any), with the counts and dirty entries as they
+ * were, so a later flush tries again.  Return false then.
+ */
+static bool cache_compact(void) {
+	char path[PATH_MAX], tmp[PATH_MAX + sizeof(".tmp")];
+	snprintf(path, sizeof(path), "%s/%s", cache_dir(), CACHE_LOG);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (fd == -1) {
+		perror("cache_compact()");
+		return false;
+	}
+	bool ok = write(fd, CACHE_LOG_MAGIC, strlen(CACHE_LOG_MAGIC))
+		== (ssize_t)strlen(CACHE_LOG_MAGIC);
+	const char *key;
+	struct cache_entry *e;
+	size_t i, size = 0;
+	HASH_FOREACH(entries, key, e, i) {
+		ok = ok && record_write(fd, key, e->value, e->len);
+		size += record_size(e);
+	}
+	if (!ok || fsync(fd) != 0 || rename(tmp, path) != 0) {
+		perror("cache_compact()");
+		close(fd);
+		unlink(tmp);
+		return false;
+	}
+
+	HASH_FOREACH(entries, key, e, i)
+		e->dirty = false;
+	dirty_entries = 0;
+	live = size;
+	garbage = 0;
+	if (logfd != -1)
+		close(logfd);
+	logfd = fd;
+	return true;
 }
 
 /*
@@ -81,7 +500,7 @@ static void mkdir_r(const char *path) {
 		else
 			assert(0 == 1); /* TODO: what if it is a non-directory? */
 	}
-	
+
 	char parent[PATH_MAX];
 	snprintf(parent, sizeof(parent), "%s", path);
 	char *c = strrchr(parent, '/');
@@ -1,8 +1,16 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdbool.h>
+#include <stdio.h>
+
 void cache_set(const char *key, const char *value);
+void cache_set_lazy(const char *key, const char *value);
+void cache_flush(void);
 char *cache_get_alloc(const char *key);
+FILE *cache_open(const char *key, const char *mode);
+int cache_open_fd(const char *key, int flags);
+bool cache_rename(const char *oldkey, const char *newkey);
 void cache_set_profile(const char *p);
 
 #endif
@@ -7,10 +7,8 @@
 
 struct FileInfo {
 	/*
-	 * TODO: mimetype can assume a relative small number of
-	 * possible values. Would it be better to work with an
-	 * enum or a static read-only string? (e.g. mimetype =
-	 * "image/jpeg"), saving some bytes of memory?
+	 * mimetype can assume a relative small number of possible
+	 * values, so it is interned (see intern.c).
 	 */
 	Str *mimetype;
 
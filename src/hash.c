@@ -1,105 +1,185 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "hash.h"
-#include "list.h"
 #include "str.h"
 
-#define HASH_SIZE 256
+#define HASH_INITSIZE 16 /* Must be a power of two */
 
 /**
- * This file implements a generic hash table.
+ * This file implements a generic hash table, whose keys are strings.
  *
- * This Hash implementation has a total of HASH_SIZE buckets.  Each bucket is
- * the head of a linked list and whever there is a hash collision, the new item
- * is appended to the list.
+ * This Hash implementation uses open addressing with linear probing: all items
+ * are stored in a single array of slots.  An item is stored in the slot its
+ * hash points to or, if that slot is taken, in the next free one.  When looking
+ * for a key we start at the slot its hash points to and walk forward until we
+ * find the key or an empty slot.
  *
- * An illustration on how this hash table exists:
+ * An illustration, where keys A and B have the same hash (1) and C's hash is 2:
  *
- * +-------------+  +---+
- * |      1      |->|   |->NULL
- * +-------------+  +---+
- * +-------------+  +---+  +---+
- * |      2      |->|   |->|   |->NULL
- * +-------------+  +---+  +---+
- *      ...
- * +-------------+
- * | HASH_SIZE-1 |
- * +-------------+
+ *     0       1       2       3       4           max-1
+ * +-------+-------+-------+-------+-------+     +-------+
+ * |       |   A   |   B   |   C   |       | ... |       |
+ * +-------+-------+-------+-------+-------+     +-------+
  *
- * Now, the relationship between data structures in this file:
+ * The number of slots (always a power of two) doubles whenever the table gets
+ * more than 3/4 full, so probe sequences stay short.  Removing an item shifts
+ * the following items of its probe sequence back, so we don't need tombstones.
  *
- * The user passes to `hash_insert()` a `val` (`void *`).  The object (actually,
- * the pointer) is wrapped around a `struct hash_item`.  The sole purpose of
- * this struct is to hold `val` alongside with `key` and we need to make that
- * because there can be hash collisions.  When that happens, we need to traverse
- * the list of `struct hash_item`, comparing the keys to fetch the correct item.
- *
- * So, relationship between data structures, from the container to the
- * contained, can be summarized as: Hash > List > struct list_node (declared in
- * list.h) > struct hash_item > val.
+ * Keys are not copied: the caller must make sure they live as long as the item
+ * is in the table.
  */
 
 struct hash_item {
-	const char *key;
+	const char *key;	/* NULL if the slot is empty */
 	void *val;
+	uint64_t hash;		/* Cached so growing doesn't rehash keys */
 };
 
 struct Hash {
-	List *table[HASH_SIZE];
+	struct hash_item *table;
+	size_t len;	/* Number of items */
+	size_t max;	/* Number of slots */
 };
 
-/* TODO: document why not 
-typedef struct Hash Hash[HASH_SIZE];
-*/
-
-// test comment 2
-
-static size_t hash_calculate_idx(const char *);
+static uint64_t hash_calculate(const char *);
+static void hash_grow(Hash *);
 
 Hash *hash_new(void) {
 	Hash *h = malloc(sizeof(Hash));
-	memset(h->table, 0x0, sizeof(h->table));
+	h->table = calloc(HASH_INITSIZE, sizeof(struct hash_item));
+	h->len = 0;
+	h->max = HASH_INITSIZE;
 	return h;
 }
 
-void hash_insert(Hash *h, const char *key, const void *val) {
-	size_t idx = hash_calculate_idx(key);
-	if (!h->table[idx])
-		h->table[idx] = list_new();
-	List *l = h->table[idx];
-	struct hash_item *iter;
-	LIST_FOREACH(l, iter) {
-		// TODO: overwrite if it happens?
-		if (streq(iter->key, key))
-			return;
+/* Free the table, but not its keys or values. */
+void hash_free(Hash *h) {
+	free(h->table);
+	free(h);
+}
+
+/* Return the slot where `key` is or where it would be inserted. */
+static size_t hash_find_slot(const Hash *h, const char *key, uint64_t hash) {
+	size_t mask = h->max - 1;
+	size_t i = hash & mask;
+	for (;;) {
+		struct hash_item *item = &h->table[i];
+		if (!item->key)
+			return i;
+		if (item->hash == hash && streq(item->key, key))
+			return i;
+		i = (i + 1) & mask;
 	}
-	struct hash_item *item = malloc(sizeof(struct hash_item));
+}
+
+void hash_insert(Hash *h, const char *key, const void *val) {
+	if ((h->len + 1) * 4 > h->max * 3)
+		hash_grow(h);
+	uint64_t hash = hash_calculate(key);
+	struct hash_item *item = &h->table[hash_find_slot(h, key, hash)];
+	// TODO: overwrite if it happens?
+	if (item->key)
+		return;
 	item->key = key;
 	item->val = (void *)val;
-	list_append(l, item);
+	item->hash = hash;
+	h->len++;
 }
 
 void *hash_get(const Hash *h, const char *key) {
-	size_t idx = hash_calculate_idx(key);
-	List *l = h->table[idx];
-	if (!l)
+	struct hash_item *item = &h->table[hash_find_slot(h, key, hash_calculate(key))];
+	if (!item->key)
+		return NULL;
+	return item->val;
+}
+
+/* Remove `key` from the table and return its value (NULL if not found). */
+void *hash_remove(Hash *h, const char *key) {
+	size_t mask = h->max - 1;
+	size_t i = hash_find_slot(h, key, hash_calculate(key));
+	if (!h->table[i].key)
 		return NULL;
-	struct hash_item *item;
-	LIST_FOREACH(l, item) {
-		if (streq(item->key, key))
-			return item->val;
+	void *val = h->table[i].val;
+
+	/*
+	 * Backward shift deletion: move back the items that follow in the same
+	 * probe sequence, so a lookup for them doesn't stop at the hole we are
+	 * leaving.  An item at j can be moved to the hole at i only if its
+	 * ideal slot is not in the cyclic range (i, j].
+	 */
+	size_t j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!h->table[j].key)
+			break;
+		size_t ideal = h->table[j].hash & mask;
+		if (((j - ideal) & mask) >= ((j - i) & mask)) {
+			h->table[i] = h->table[j];
+			i = j;
+		}
+	}
+	h->table[i].key = NULL;
+	h->table[i].val = NULL;
+	h->len--;
+	return val;
+}
+
+size_t hash_len(const Hash *h) {
+	return h->len;
+}
+
+/*
+ * Find the first item at slot `*i` or after.  If found, set `key` and `val`,
+ * make `*i` point to the next slot and return true.  See HASH_FOREACH().
+ */
+bool hash_iter(const Hash *h, size_t *i, const char **key, void **val) {
+	for (; *i < h->max; (*i)++) {
+		struct hash_item *item = &h->table[*i];
+		if (!item->key)
+			continue;
+		*key = item->key;
+		*val = item->val;
+		(*i)++;
+		return true;
 	}
-	return NULL;
+	return false;
 }
 
-static size_t hash_calculate_idx(const char *key) {
-	size_t idx;
-	idx = 0;
-	for (size_t i = 0; i < strlen(key); i++)
-		idx += (unsigned char)key[i];
-	idx %= HASH_SIZE;
-	return idx;
+static void hash_grow(Hash *h) {
+	struct hash_item *old = h->table;
+	size_t oldmax = h->max;
+	h->max *= 2;
+	h->table = calloc(h->max, sizeof(struct hash_item));
+	for (size_t i = 0; i < oldmax; i++) {
+		if (!old[i].key)
+			continue;
+		size_t j = old[i].hash & (h->max - 1);
+		while (h->table[j].key)
+			j = (j + 1) & (h->max - 1);
+		h->table[j] = old[i];
+	}
+	free(old);
 }
 
+/*
+ * 64-bit FNV-1a, followed by MurmurHash3's finalizer so every bit of the key
+ * affects the low bits we use as the slot index.  Matrix IDs share long
+ * prefixes and suffixes (e.g. "!abc:matrix.org"), which a plain byte sum
+ * maps to a handful of buckets.
+ */
+static uint64_t hash_calculate(const char *key) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (const unsigned char *c = (const unsigned char *)key; *c; c++) {
+		h ^= *c;
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
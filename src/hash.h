@@ -1,10 +1,25 @@
 #ifndef JANECHAT_HASH_H
 #define JANECHAT_HASH_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef struct Hash Hash;
 
 Hash *hash_new(void);
+void hash_free(Hash *);
 void hash_insert(Hash *, const char *, const void *);
 void *hash_get(const Hash *, const char *);
+void *hash_remove(Hash *, const char *);
+size_t hash_len(const Hash *);
+bool hash_iter(const Hash *, size_t *, const char **, void **);
+
+/*
+ * Traverse all items of a hash, in no particular order.  At each iteration,
+ * `key` and `val` are set to the current item.  `i` must be a size_t.  Items
+ * must not be inserted or removed while traversing.
+ */
+#define HASH_FOREACH(h, key, val, i) \
+	for (i = 0; hash_iter(h, &i, &key, (void **)&val); )
 
 #endif /* !JANECHAT_HASH_H */
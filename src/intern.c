@@ -0,0 +1,59 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "hash.h"
+#include "intern.h"
+#include "str.h"
+
+/**
+ * String interning.
+ *
+ * Identifiers like room IDs, user IDs and mimetypes are repeated over and over:
+ * every message carries its sender and room ID, but a room with thousands of
+ * messages usually has a handful of senders.  Instead of allocating a new Str
+ * for each of them, we keep a single Str for each distinct value in a pool and
+ * hand out references to it.
+ *
+ * Interned strings must never be modified.  They are never removed from the
+ * pool either (the pool keeps its own reference), which is fine since the set
+ * of identifiers we see is small.  A side effect is that str_buf() of an
+ * interned string can safely be used as a Hash key.
+ *
+ * Both the network thread (decoding events) and the main thread (storing them)
+ * intern strings, so the pool is protected by a mutex.  It is held for a single
+ * hash lookup, so it is hardly ever contended.
+ */
+
+static Hash *pool = NULL;	/* Hash<const char *, Str> */
+static InternStats stats;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return a new reference to the interned copy of `s`. */
+Str *intern_cstr(const char *s) {
+	pthread_mutex_lock(&pool_lock);
+	if (!pool)
+		pool = hash_new();
+	stats.lookups++;
+	Str *ss = hash_get(pool, s);
+	if (ss) {
+		stats.hits++;
+		stats.bytes_saved += sizeof(Str) + str_bytelen(ss) + 1;
+	} else {
+		ss = str_new_cstr_fixed(s);
+		hash_insert(pool, str_buf(ss), ss);
+		stats.strings++;
+		stats.bytes += sizeof(Str) + str_bytelen(ss) + 1;
+	}
+	str_incref(ss);
+	pthread_mutex_unlock(&pool_lock);
+	return ss;
+}
+
+/* Same as intern_cstr(), but for a Str, that is left untouched. */
+Str *intern_str(Str *s) {
+	return intern_cstr(str_buf(s));
+}
+
+const InternStats *intern_stats(void) {
+	return &stats;
+}
@@ -0,0 +1,20 @@
+#ifndef JANECHAT_INTERN_H
+#define JANECHAT_INTERN_H
+
+#include "str.h"
+
+/* Counters about the intern pool, for debugging and tuning. */
+struct InternStats {
+	unsigned long lookups;
+	unsigned long hits;
+	size_t strings;		/* Distinct strings in the pool */
+	size_t bytes;		/* Memory used by them */
+	size_t bytes_saved;	/* Memory not allocated thanks to hits */
+};
+typedef struct InternStats InternStats;
+
+Str *intern_cstr(const char *);
+Str *intern_str(Str *);
+const InternStats *intern_stats(void);
+
+#endif /* !JANECHAT_INTERN_H */
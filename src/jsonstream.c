@@ -0,0 +1,214 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jsonstream.h"
+#include "str.h"
+
+/**
+ * This file implements a streaming splitter for JSON documents too large to be
+ * kept in memory at once (e.g. the response of the initial /sync of accounts
+ * with hundreds of rooms).
+ *
+ * The document is fed in chunks, as they arrive from the network.  The caller
+ * specifies the path of an object (e.g. {"rooms", "join", NULL}) whose members
+ * it wants to receive one by one.  Each time a member value is complete, the
+ * callback is called with its key and its JSON text, which can then be parsed
+ * on its own.  Its buffer is reused for the next member, so at any time we only
+ * keep the largest member in memory, not the whole document.
+ *
+ * Everything else is kept in what we call the skeleton: the original document
+ * with the values of these members replaced by empty containers.  It is
+ * returned by jsonstream_finish() and can be parsed as usual.  For example, if
+ * path is {"a", NULL}, the following document:
+ *
+ *	{"a": {"x": {"y": 1}, "z": [2, 3]}, "b": 4}
+ *
+ * calls the callback for `{"y": 1}` (key x) and `[2, 3]` (key z), and the
+ * skeleton is:
+ *
+ *	{"a": {"x": {}, "z": []}, "b": 4}
+ *
+ * This is not a validating parser.  It only knows enough of JSON (strings,
+ * escapes and nesting) to split the document.  Only object and array member
+ * values are split; scalar ones stay in the skeleton.  Keys are passed as they
+ * appear in the document, without unescaping.
+ */
+
+#define MAX_PATH 8
+
+struct level {
+	bool is_object;
+	bool expect_key;	/* Next string is a key (objects only) */
+	bool in_path;		/* Reached through keys that match path */
+	bool key_matches;	/* Current key matches path at this level */
+};
+
+struct JsonStream {
+	const char **path;
+	size_t pathlen;
+	void (*callback)(const char *, const char *, size_t, void *);
+	void *params;
+
+	Str *skeleton;
+	Str *capture;	/* Text of the member value being split */
+	Str *key;	/* Last key read at a level we track */
+
+	bool in_string;
+	bool in_key;
+	bool escape;
+	size_t depth;		/* Number of open containers */
+	size_t capture_depth;	/* depth of captured value, 0 if none */
+
+	/* levels[d] describes the container at depth d (1-indexed). */
+	struct level levels[MAX_PATH + 2];
+};
+
+JsonStream *jsonstream_new(
+	const char **path,
+	void (*callback)(const char *, const char *, size_t, void *),
+	void *params)
+{
+	JsonStream *js = malloc(sizeof(JsonStream));
+	js->path = path;
+	js->pathlen = 0;
+	while (path[js->pathlen])
+		js->pathlen++;
+	assert(js->pathlen <= MAX_PATH);
+	js->callback = callback;
+	js->params = params;
+	js->skeleton = str_new();
+	js->capture = str_new();
+	js->key = str_new();
+	js->in_string = false;
+	js->in_key = false;
+	js->escape = false;
+	js->depth = 0;
+	js->capture_depth = 0;
+	return js;
+}
+
+/* Is depth `d` one whose keys and commas we need to keep track of? */
+static bool tracked(JsonStream *js, size_t d) {
+	return d >= 1 && d <= js->pathlen + 1 && js->levels[d].in_path;
+}
+
+void jsonstream_feed(JsonStream *js, const char *buf, size_t len) {
+	/*
+	 * Instead of copying byte by byte, we copy runs of bytes to either
+	 * the skeleton or the capture buffer, starting at `run`.
+	 */
+	const char *run = buf;
+	const char *end = buf + len;
+	for (const char *p = buf; p < end; p++) {
+		char c = *p;
+
+		if (js->in_string) {
+			if (js->escape)
+				js->escape = false;
+			else if (c == '\\')
+				js->escape = true;
+			else if (c == '"')
+				js->in_string = false;
+
+			if (!js->in_key)
+				continue;
+			if (js->in_string) {
+				str_append_cstr_bytelen(js->key, p, 1);
+				continue;
+			}
+			/* End of a key we are tracking */
+			js->in_key = false;
+			size_t d = js->depth;
+			if (d <= js->pathlen)
+				js->levels[d].key_matches =
+				 streq(str_buf(js->key), js->path[d-1]);
+			continue;
+		}
+
+		switch (c) {
+		case '"':
+			js->in_string = true;
+			if (js->capture_depth == 0
+			&& tracked(js, js->depth)
+			&& js->levels[js->depth].expect_key) {
+				js->in_key = true;
+				str_reset(js->key);
+			}
+			break;
+		case '{':
+		case '[': {
+			size_t d = js->depth;
+			if (js->capture_depth == 0
+			&& d == js->pathlen + 1
+			&& tracked(js, d)
+			&& js->levels[d].is_object) {
+				/* Start splitting this member value */
+				str_append_cstr_bytelen(js->skeleton, run, p - run);
+				str_append_cstr(js->skeleton,
+					c == '{' ? "{}" : "[]");
+				run = p;
+				js->capture_depth = d + 1;
+			}
+			js->depth++;
+			if (js->capture_depth == 0 && js->depth <= js->pathlen + 1) {
+				struct level *l = &js->levels[js->depth];
+				l->is_object = (c == '{');
+				l->expect_key = l->is_object;
+				l->key_matches = false;
+				if (d == 0)
+					l->in_path = true;
+				else
+					l->in_path = js->levels[d].in_path
+					 && js->levels[d].is_object
+					 && js->levels[d].key_matches;
+			}
+			break;
+		}
+		case '}':
+		case ']':
+			if (js->depth == 0)
+				break; /* Garbage. Let the real parser complain. */
+			if (js->capture_depth == js->depth) {
+				/* End of the member value */
+				str_append_cstr_bytelen(js->capture, run, p - run + 1);
+				run = p + 1;
+				js->capture_depth = 0;
+				js->callback(str_buf(js->key),
+					str_buf(js->capture),
+					str_bytelen(js->capture),
+					js->params);
+				str_reset(js->capture);
+			}
+			js->depth--;
+			break;
+		case ',':
+			if (js->capture_depth == 0 && tracked(js, js->depth)
+			&& js->levels[js->depth].is_object)
+				js->levels[js->depth].expect_key = true;
+			break;
+		case ':':
+			if (js->capture_depth == 0 && tracked(js, js->depth))
+				js->levels[js->depth].expect_key = false;
+			break;
+		}
+	}
+
+	if (js->capture_depth)
+		str_append_cstr_bytelen(js->capture, run, end - run);
+	else
+		str_append_cstr_bytelen(js->skeleton, run, end - run);
+}
+
+/*
+ * Free the stream and return the skeleton, that the caller must str_decref().
+ * A member value that was not complete when the stream finished is discarded.
+ */
+Str *jsonstream_finish(JsonStream *js) {
+	Str *skeleton = js->skeleton;
+	str_decref(js->capture);
+	str_decref(js->key);
+	free(js);
+	return skeleton;
+}
@@ -0,0 +1,16 @@
+#ifndef JANECHAT_JSONSTREAM_H
+#define JANECHAT_JSONSTREAM_H
+
+#include <stddef.h>
+
+#include "str.h"
+
+typedef struct JsonStream JsonStream;
+
+JsonStream *jsonstream_new(const char **path,
+	void (*callback)(const char *key, const char *json, size_t len, void *),
+	void *params);
+void jsonstream_feed(JsonStream *, const char *, size_t);
+Str *jsonstream_finish(JsonStream *);
+
+#endif /* !JANECHAT_JSONSTREAM_H */
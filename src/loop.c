@@ -0,0 +1,196 @@
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "loop.h"
+#include "vector.h"
+
+/**
+ * This file implements the event loop of janechat.
+ *
+ * Everything the program waits for (keystrokes in stdin, libcurl sockets,
+ * libcurl timeouts and the periodic sync) is either a watched file descriptor
+ * or a timer.  loop_run_once() sleeps in a single poll(2) call until one of
+ * them is ready (or the nearest timer expires) and then calls back whoever
+ * registered it.  This way an idle janechat doesn't consume CPU at all.
+ *
+ * We use poll(2) instead of epoll(7) (or kqueue(2) on BSDs) because it is
+ * available on every system we support and we never watch more than a handful
+ * of file descriptors: stdin plus the few connections libcurl keeps open.
+ */
+
+struct watcher {
+	void (*callback)(int, int, void *);
+	void *params;
+};
+
+struct LoopTimer {
+	void (*callback)(void *);
+	void *params;
+	long long deadline;	/* Monotonic time in ms, -1 if disarmed */
+};
+
+/*
+ * pollfds and watchers are parallel arrays, so pollfds can be passed directly
+ * to poll(2).
+ */
+static struct pollfd *pollfds = NULL;
+static struct watcher *watchers = NULL;
+static size_t nfds = 0;
+static size_t maxfds = 0;
+
+static Vector *timers = NULL; /* Vector<LoopTimer> */
+
+/*
+ * Time poll(2) last returned, -1 before the first one.  Input is only read when
+ * we poll again, so the time in between is how long a keystroke may have to
+ * wait: the input stall we keep the maximum of in counters.
+ */
+static long long busy_since = -1;
+static LoopStats counters;
+
+/* Monotonic time in milliseconds.  Only differences are meaningful. */
+long long loop_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Watch `fd` for `events` (LOOP_READ and/or LOOP_WRITE).  If `fd` is already
+ * watched, its events and callback are replaced.
+ */
+void loop_watch_fd(
+	int fd,
+	int events,
+	void (*callback)(int, int, void *),
+	void *params)
+{
+	size_t i;
+	for (i = 0; i < nfds; i++)
+		if (pollfds[i].fd == fd)
+			break;
+	if (i == nfds) {
+		if (nfds == maxfds) {
+			maxfds = maxfds ? maxfds * 2 : 8;
+			pollfds = realloc(pollfds, sizeof(struct pollfd) * maxfds);
+			watchers = realloc(watchers, sizeof(struct watcher) * maxfds);
+		}
+		nfds++;
+	}
+	pollfds[i].fd = fd;
+	pollfds[i].events = events;
+	pollfds[i].revents = 0;
+	watchers[i].callback = callback;
+	watchers[i].params = params;
+}
+
+void loop_unwatch_fd(int fd) {
+	for (size_t i = 0; i < nfds; i++) {
+		if (pollfds[i].fd != fd)
+			continue;
+		/* Order doesn't matter.  Move the last one to this slot. */
+		nfds--;
+		pollfds[i] = pollfds[nfds];
+		watchers[i] = watchers[nfds];
+		return;
+	}
+}
+
+/* Create a new timer.  It starts disarmed. */
+LoopTimer *loop_timer_new(void (*callback)(void *), void *params) {
+	if (!timers)
+		timers = vector_new();
+	LoopTimer *t = malloc(sizeof(LoopTimer));
+	t->callback = callback;
+	t->params = params;
+	t->deadline = -1;
+	vector_append(timers, t);
+	return t;
+}
+
+/*
+ * Arm timer `t` to fire once in `ms` milliseconds.  A negative value disarms
+ * it.  Periodic timers just call loop_timer_set() again from their callbacks.
+ */
+void loop_timer_set(LoopTimer *t, long ms) {
+	if (ms < 0)
+		t->deadline = -1;
+	else
+		t->deadline = loop_now() + ms;
+}
+
+/* Block until something happens and dispatch it. */
+void loop_run_once(void) {
+	long long now = loop_now();
+	long long timeout = -1;
+	LoopTimer *t;
+	size_t i;
+
+	if (busy_since >= 0 && now - busy_since > counters.stall_max)
+		counters.stall_max = now - busy_since;
+
+	if (timers) {
+		VECTOR_FOREACH(timers, t, i) {
+			if (t->deadline < 0)
+				continue;
+			long long left = t->deadline - now;
+			if (left < 0)
+				left = 0;
+			if (timeout == -1 || left < timeout)
+				timeout = left;
+		}
+	}
+	if (timeout > INT_MAX)
+		timeout = INT_MAX;
+
+	int res = poll(pollfds, nfds, (int)timeout);
+	busy_since = loop_now();
+	counters.iterations++;
+	if (res == -1) {
+		/* E.g. SIGWINCH.  Let the caller loop again. */
+		if (errno == EINTR)
+			return;
+		perror("poll()");
+		abort(); /* TODO */
+	}
+
+	if (res > 0) {
+		/*
+		 * Callbacks can watch and unwatch file descriptors (libcurl does
+		 * that all the time), changing pollfds under our feet, so first
+		 * take a snapshot of what is ready.
+		 */
+		struct pollfd ready[nfds];
+		size_t nready = 0;
+		for (i = 0; i < nfds; i++)
+			if (pollfds[i].revents)
+				ready[nready++] = pollfds[i];
+		for (i = 0; i < nready; i++) {
+			for (size_t j = 0; j < nfds; j++) {
+				if (pollfds[j].fd != ready[i].fd)
+					continue;
+				watchers[j].callback(ready[i].fd,
+					ready[i].revents, watchers[j].params);
+				break;
+			}
+		}
+	}
+
+	if (!timers)
+		return;
+	now = loop_now();
+	VECTOR_FOREACH(timers, t, i) {
+		if (t->deadline < 0 || t->deadline > now)
+			continue;
+		t->deadline = -1;
+		t->callback(t->params);
+	}
+}
+
+const LoopStats *loop_stats(void) {
+	return &counters;
+}
@@ -0,0 +1,28 @@
+#ifndef JANECHAT_LOOP_H
+#define JANECHAT_LOOP_H
+
+#include <poll.h>
+
+/* Events a fd watcher can be interested in.  Same values as poll(2) ones. */
+#define LOOP_READ POLLIN
+#define LOOP_WRITE POLLOUT
+
+typedef struct LoopTimer LoopTimer;
+
+/* Counters about the event loop, for debugging and tuning. */
+struct LoopStats {
+	unsigned long iterations;
+	long long stall_max;	/* Max ms between two polls */
+};
+typedef struct LoopStats LoopStats;
+
+void loop_watch_fd(int fd, int events, void (*)(int fd, int revents, void *),
+	void *);
+void loop_unwatch_fd(int fd);
+LoopTimer *loop_timer_new(void (*)(void *), void *);
+void loop_timer_set(LoopTimer *, long ms);
+void loop_run_once(void);
+long long loop_now(void);
+const LoopStats *loop_stats(void);
+
+#endif /* !JANECHAT_LOOP_H */
@@ -11,28 +11,99 @@
 #include "hash.h"
 #include "cache.h"
 #include "common.h"
+#include "intern.h"
+#include "loop.h"
 #include "matrix.h"
+#include "msglog.h"
 #include "rooms.h"
 #include "ui.h"
 #include "ui-cli.h"
 #include "ui-curses.h"
+#include "users.h"
 #include "utils.h"
 
+/* How often we check if we need to start a new /sync long-poll request. */
+#define SYNC_INTERVAL_MS 2000
+
+/* How often values stored with cache_set_lazy() are written to disk. */
+#define CACHE_FLUSH_INTERVAL_MS 5000
+
+/* How often rooms and users are saved, if they changed (see state_save()). */
+#define STATE_SAVE_INTERVAL_MS 60000
+
+/* Cache key of the next_batch that the saved rooms and users are as of */
+#define STATE_SINCE_KEY "state_since"
+
+/* Cache key of the transaction IDs in echoes, separated by spaces */
+#define ECHOES_KEY "echoes"
+
 bool do_matrix_send_token(void);
 void do_matrix_login(void);
 void handle_matrix_event(MatrixEvent ev);
 void handle_ui_event(UiEvent ev);
+void handle_stdin(int fd, int revents, void *params);
+void handle_sync_timer(void *params);
+void handle_cache_flush_timer(void *params);
+void handle_state_timer(void *params);
+void state_save(void);
+void print_stats(void);
+void batch_begin(void);
+void batch_end(void);
+void batch_add(Room *room, size_t unread);
+void echoes_load(void);
+void echoes_store(void);
+void echo_add(Str *txnid);
+bool echo_has(Str *txnid);
+bool echo_take(Str *txnid);
+
+LoopTimer *sync_timer;
+LoopTimer *cache_flush_timer;
+LoopTimer *state_timer;
+
+/*
+ * Rooms and users are saved (see rooms_save()) so the next run can skip the
+ * initial sync and resume from state_since, the next_batch of the last sync
+ * whose events were applied.  state_since is stored after the snapshot, so it
+ * is never ahead of it.  At worst, the next run gets again some of the events
+ * that built the snapshot, which are applied twice without harm.  Messages,
+ * that are in the timelines as soon as they arrive, are not appended twice
+ * (see msglog_append()).
+ */
+Str *state_since = NULL;
+bool state_changed = false;
+
+/*
+ * Messages received during a sync are not shown one by one: they are summarized
+ * in batch and the UI is told about them once, at the end of the sync.
+ */
+bool batch_open = false;
+UiBatch batch;
+size_t batch_max = 0;
+
+/*
+ * Transaction IDs of the messages we sent that are shown (see
+ * EVENT_MSG_PENDING) but were not echoed by a sync yet.  When they are, they
+ * are not appended again.  Shown messages are in the timelines, that outlive
+ * this run, so they are stored too (see echoes_store()): the messages of the
+ * outbox that a new run sends again, and echoes of what it sent before, are
+ * not appended again either.
+ */
+Str **echoes = NULL;
+size_t echoes_len = 0;
+size_t echoes_max = 0;
 
 struct ui_hooks {
 	void (*setup)();
 	void (*init)();
 	void (*iter)();
 	void (*msg_new)(Room *room, Msg msg);
+	void (*msgs_batch)(const UiBatch *batch);
 	void (*room_new)(Str *roomid);
 } ui_hooks;
 
 void usage(void) {
-	fputs("usage: janechat [-f cli|curses]", stderr);
+	fputs("usage: janechat [-2s] [-f cli|curses] [-m messages] "
+		"[-M kilobytes] [-p profile]", stderr);
 	exit(2);
 }
 
@@ -42,12 +113,20 @@ int main(int argc, char *argv[]) {
 		UI_CURSES,
 	} ui_frontend = UI_CURSES;
 
+	/* Per room message window.  Older messages are spilled to the disk. */
+	long int max_msgs = MSGLOG_DEFAULT_MAX_MSGS;
+	long int max_kbytes = MSGLOG_DEFAULT_MAX_BYTES / 1024;
+
 	/* Option processing */
 	int c;
 	extern char *optarg;
 	extern int optind;
-	while ((c = getopt(argc, argv, "f:p:")) != -1) {
+	while ((c = getopt(argc, argv, "2f:m:M:p:s")) != -1) {
 		switch (c) {
+		case '2':
+			/* Multiplex all requests over one HTTP/2 connection */
+			matrix_set_http2(true);
+			break;
 		case 'f':
 			if (streq(optarg, "cli"))
 				ui_frontend = UI_CLI;
@@ -56,6 +135,14 @@ int main(int argc, char *argv[]) {
 			else
 				usage();
 			break;
+		case 'm':
+			if (!str2li(optarg, &max_msgs) || max_msgs < 0)
+				usage();
+			break;
+		case 'M':
+			if (!str2li(optarg, &max_kbytes) || max_kbytes < 0)
+				usage();
+			break;
 		case 'p':
 			/*
 			 * TODO: we need to canonize optarg to avoid path
@@ -63,6 +150,10 @@ int main(int argc, char *argv[]) {
 			 */
 			cache_set_profile(optarg);
 			break;
+		case 's':
+			/* Print internal counters to stderr when exiting */
+			atexit(print_stats);
+			break;
 		default:
 			usage();
 		}
@@ -70,6 +161,11 @@ int main(int argc, char *argv[]) {
 	argc -= optind;
 	if (argc != 0)
 		usage();
+	msglog_set_limits(max_msgs, (size_t)max_kbytes * 1024);
+	/* Don't lose what is waiting for the next flush.  In reverse order */
+	atexit(cache_flush);
+	atexit(users_flush);
+	atexit(state_save);
 
 	ui_set_event_handler(handle_ui_event);
 
@@ -79,6 +175,7 @@ int main(int argc, char *argv[]) {
 		ui_hooks = (struct ui_hooks){
 			.iter = ui_cli_iter,
 			.msg_new = ui_cli_msg_new,
+			.msgs_batch = ui_cli_msgs_batch,
 		};
 		break;
 	case UI_CURSES:
@@ -87,6 +184,7 @@ int main(int argc, char *argv[]) {
 			.init = ui_curses_init,
 			.iter = ui_curses_iter,
 			.msg_new = ui_curses_msg_new,
+			.msgs_batch = ui_curses_msgs_batch,
 			.room_new = ui_curses_room_new,
 		};
 		break;
@@ -107,37 +205,123 @@ int main(int argc, char *argv[]) {
 		matrix_set_server(server);
 	}
 
-	puts("Performing initial sync...");
-	if (!matrix_initial_sync()) {
-		fprintf(stderr,
-			"Error when performing initial sync. Exit.");
-		exit(1);
+	char *since = cache_get_alloc(STATE_SINCE_KEY);
+	if (since && rooms_load()) {
+		/* Pick up where the last run left, with what it knew */
+		Room *room;
+		size_t i;
+		ROOMS_FOREACH(room, i)
+			if (ui_hooks.room_new)
+				ui_hooks.room_new(room->id);
+		state_since = str_new_cstr(since);
+		matrix_sync_from(since);
+	} else {
+		puts("Performing initial sync...");
+		if (!matrix_initial_sync()) {
+			fprintf(stderr,
+				"Error when performing initial sync. Exit.");
+			exit(1);
+		}
+		puts("Done.");
 	}
-	puts("Done.");
+	free(since);
 
 	if (ui_hooks.init)
 		ui_hooks.init();
 
-	for (;;) {
-		switch (select_matrix_stdin()) {
-		case SELECTSTATUS_STDINREADY:
-			ui_hooks.iter();
-			break;
-		case SELECTSTATUS_MATRIXRESUME:
-			matrix_resume();
-			break;
-		}
-		static time_t past = 0, now = 0;
-		now = time(0);
-		if (now > past + 1) {
-			matrix_sync();
-			past = now;
-		}
-	}
+	/* Show and send what the last run could not send */
+	echoes_load();
+	matrix_resend_pending();
+
+	/* From now on, the network is handled by a thread of its own */
+	matrix_start_thread();
+
+	loop_watch_fd(STDIN_FILENO, LOOP_READ, handle_stdin, NULL);
+	sync_timer = loop_timer_new(handle_sync_timer, NULL);
+	loop_timer_set(sync_timer, 0);
+	cache_flush_timer = loop_timer_new(handle_cache_flush_timer, NULL);
+	loop_timer_set(cache_flush_timer, CACHE_FLUSH_INTERVAL_MS);
+	state_timer = loop_timer_new(handle_state_timer, NULL);
+	loop_timer_set(state_timer, STATE_SAVE_INTERVAL_MS);
+
+	for (;;)
+		loop_run_once();
 	
 	return 0;
 }
 
+void handle_stdin(int fd, int revents, void *params) {
+	(void)fd;
+	(void)revents;
+	(void)params;
+	ui_hooks.iter();
+}
+
+void handle_sync_timer(void *params) {
+	(void)params;
+	/* matrix_sync() does nothing if there is a sync in progress. */
+	matrix_sync();
+	loop_timer_set(sync_timer, SYNC_INTERVAL_MS);
+}
+
+void handle_cache_flush_timer(void *params) {
+	(void)params;
+	users_flush();
+	cache_flush();
+	loop_timer_set(cache_flush_timer, CACHE_FLUSH_INTERVAL_MS);
+}
+
+void handle_state_timer(void *params) {
+	(void)params;
+	state_save();
+	loop_timer_set(state_timer, STATE_SAVE_INTERVAL_MS);
+}
+
+/* Save rooms and users, if they changed, and where to resume syncing from. */
+void state_save(void) {
+	if (!state_since)
+		return;
+	if (state_changed) {
+		if (!rooms_save())
+			return;
+		state_changed = false;
+	}
+	cache_set_lazy(STATE_SINCE_KEY, str_buf(state_since));
+}
+
+void print_stats(void) {
+	const MatrixStats *ms = matrix_stats();
+	fprintf(stderr, "transfers: %lu completed in %lu wakeups "
+		"(avg queue depth %.2f, max %d, budget exhausted %lu times)\n",
+		ms->completions, ms->wakeups,
+		ms->wakeups ? (double)ms->queue_depth_sum / ms->wakeups : 0.0,
+		ms->queue_depth_max, ms->budget_exhausted);
+	fprintf(stderr, "sync dispatch: %lu slices, %lu preempted, "
+		"max %zu rooms queued, transfer paused %lu times\n",
+		ms->dispatch_slices, ms->dispatch_preempted,
+		ms->dispatch_queue_max, ms->sync_pauses);
+	fprintf(stderr, "network thread: %lu events posted, "
+		"waited %lu times for room in the ring\n",
+		ms->events_posted, ms->events_ring_full);
+	fprintf(stderr, "curl handles: %lu created, %lu reused, "
+		"connections evicted %lu times (%lu requests replayed)\n",
+		ms->handles_created, ms->handles_reused,
+		ms->connections_evicted, ms->transfers_replayed);
+	fprintf(stderr, "outbox: %lu failed attempts to send messages\n",
+		ms->messages_retried);
+
+	const LoopStats *ls = loop_stats();
+	fprintf(stderr, "event loop: %lu iterations, max input stall %lld ms\n",
+		ls->iterations, ls->stall_max);
+
+	const InternStats *is = intern_stats();
+	fprintf(stderr, "interned strings: %zu (%zu bytes), "
+		"%lu/%lu lookups hit (%.1f%%), %zu bytes saved\n",
+		is->strings, is->bytes, is->hits, is->lookups,
+		is->lookups ? 100.0 * is->hits / is->lookups : 0.0,
+		is->bytes_saved);
+}
+
 bool do_matrix_send_token(void) {
 	char *token = cache_get_alloc("access_token");
 	if (!token)
@@ -199,6 +383,7 @@ void do_matrix_login(void) {
 }
 
 void process_room_create(Str *id, bool is_space) {
+	state_changed = true;
 	Room *room = room_new(id, is_space);
 	if (ui_hooks.room_new)
 		ui_hooks.room_new(id);
@@ -214,19 +399,127 @@ void process_room_create(Str *id, bool is_space) {
 void process_room_info(Str *roomid, Str *sender, Str *name) {
 	Room *room = room_byid(roomid);
 	room_set_info(room, sender, name);
+	state_changed = true;
 }
 
-void process_room_join(Str *roomid, Str *senderid, Str *sendername) {
+void process_room_join(Str *roomid, Str *senderid, Str *sendername,
+	Str *senderavatar)
+{
 	Room *room = room_byid(roomid);
 	assert(room);
 	room_append_user(room, senderid);
-	user_add(senderid, sendername);
+	user_add(senderid, sendername, senderavatar);
+	state_changed = true;
 }
 
-void process_msg(Str *roomid, Msg msg) {
+void batch_begin(void) {
+	batch_open = true;
+	batch.len = 0;
+	batch.msgs = 0;
+}
+
+void batch_end(void) {
+	batch_open = false;
+	if (batch.len > 0)
+		ui_hooks.msgs_batch(&batch);
+}
+
+/* Account for the last message of room, that increased unread_msgs by unread */
+void batch_add(Room *room, size_t unread) {
+	struct UiBatchRoom *r = NULL;
+
+	/* The messages of a room come together, so it is usually the last one */
+	for (size_t i = batch.len; i > 0; i--)
+		if (batch.rooms[i - 1].room == room) {
+			r = &batch.rooms[i - 1];
+			break;
+		}
+
+	if (!r) {
+		if (batch.len == batch_max) {
+			batch_max = batch_max ? batch_max * 2 : 16;
+			batch.rooms = realloc(batch.rooms,
+				batch_max * sizeof(*batch.rooms));
+		}
+		r = &batch.rooms[batch.len++];
+		r->room = room;
+		r->first = msglog_len(room->msgs) - 1;
+		r->count = 0;
+		r->unread = 0;
+	}
+	r->count++;
+	r->unread += unread;
+	batch.msgs++;
+}
+
+/* Read the echoes stored by the last run. */
+void echoes_load(void) {
+	char *value = cache_get_alloc(ECHOES_KEY);
+	if (!value)
+		return;
+	char *saveptr;
+	for (char *id = strtok_r(value, " ", &saveptr); id;
+	     id = strtok_r(NULL, " ", &saveptr)) {
+		Str *txnid = str_new_cstr(id);
+		echo_add(txnid);
+		str_decref(txnid);
+	}
+	free(value);
+}
+
+/*
+ * Write echoes right away, as the messages they are about were written to the
+ * timelines.
+ */
+void echoes_store(void) {
+	Str *value = str_new();
+	for (size_t i = 0; i < echoes_len; i++) {
+		if (i > 0)
+			str_append_cstr(value, " ");
+		str_append_str(value, echoes[i]);
+	}
+	cache_set(ECHOES_KEY, str_buf(value));
+	str_decref(value);
+}
+
+void echo_add(Str *txnid) {
+	if (echoes_len == echoes_max) {
+		echoes_max = echoes_max ? echoes_max * 2 : 8;
+		echoes = realloc(echoes, echoes_max * sizeof(*echoes));
+	}
+	echoes[echoes_len++] = str_dup(txnid);
+}
+
+/* Return whether txnid is pending. */
+bool echo_has(Str *txnid) {
+	for (size_t i = 0; i < echoes_len; i++)
+		if (str_sc_eq(echoes[i], str_buf(txnid)))
+			return true;
+	return false;
+}
+
+/* Forget txnid, if it was pending.  Return whether it was. */
+bool echo_take(Str *txnid) {
+	for (size_t i = 0; i < echoes_len; i++)
+		if (str_sc_eq(echoes[i], str_buf(txnid))) {
+			str_decref(echoes[i]);
+			echoes[i] = echoes[--echoes_len];
+			echoes_store();
+			return true;
+		}
+	return false;
+}
+
+/* Append msg, whose event ID is eventid (NULL if none), unless it was already. */
+void process_msg(Str *roomid, Msg msg, Str *eventid) {
 	Room *room = room_byid(roomid);
-	room_append_msg(room, msg);
-	ui_hooks.msg_new(room, msg);
+	size_t unread = room->unread_msgs;
+	if (!room_append_msg(room, msg, eventid))
+		return;
+	if (batch_open)
+		batch_add(room, room->unread_msgs - unread);
+	else
+		ui_hooks.msg_new(room, msg);
 }
 
 void open_file(FileInfo fileinfo) {
@@ -265,14 +558,34 @@ void handle_matrix_event(MatrixEvent ev) {
 		if (!room)
 			return;
 		room->notify = ev.roomnotifystatus.enabled;
+		state_changed = true;
 		}
 		break;
 	case EVENT_ROOM_JOIN:
-		process_room_join(ev.roomjoin.roomid,
-			ev.roomjoin.senderid, ev.roomjoin.sendername);
+		process_room_join(ev.roomjoin.roomid, ev.roomjoin.senderid,
+			ev.roomjoin.sendername, ev.roomjoin.senderavatar);
 		break;
 	case EVENT_MSG:
-		process_msg(ev.msg.roomid, ev.msg.msg);
+		/* Our own messages are already shown */
+		if (ev.msg.txnid && echo_take(ev.msg.txnid))
+			break;
+		process_msg(ev.msg.roomid, ev.msg.msg, ev.msg.eventid);
+		break;
+	case EVENT_MSG_PENDING:
+		/* Outbox entries of rooms we left */
+		if (!room_byid(ev.msg.roomid))
+			break;
+		/* Sent again by a new run: it is in the timeline already */
+		if (echo_has(ev.msg.txnid))
+			break;
+		echo_add(ev.msg.txnid);
+		process_msg(ev.msg.roomid, ev.msg.msg, NULL);
+		echoes_store();
+		break;
+	case EVENT_MSG_FAILED:
+		echo_take(ev.msg.txnid);
+		if (room_byid(ev.msg.roomid))
+			process_msg(ev.msg.roomid, ev.msg.msg, NULL);
 		break;
 	case EVENT_MATRIX_ERROR:
 		printf("%s\n", str_buf(ev.error.error));
@@ -281,6 +594,23 @@ void handle_matrix_event(MatrixEvent ev) {
 	case EVENT_CONN_ERROR:
 		//puts("Connection error.\n");
 		break;
+	case EVENT_SYNC_BEGIN:
+		batch_begin();
+		break;
+	case EVENT_SYNC_END:
+		batch_end();
+		if (ev.syncend.next_batch) {
+			str_decref(state_since);
+			state_since = str_dup(ev.syncend.next_batch);
+			/*
+			 * Messages are in the timelines already.  If there
+			 * is no snapshot to write, move on right away, so the
+			 * next run doesn't download them again.
+			 */
+			if (!state_changed)
+				state_save();
+		}
+		break;
 	case EVENT_FILE: {
 		Str *filepath = str_new_uri_extract_path(ev.file.fileinfo.uri);
 		Str *cmd = str_new();;
@@ -354,6 +684,7 @@ void handle_ui_event(UiEvent ev) {
 			str_buf(ev.roomrename.name));
 		Room *room = room_byid(ev.roomrename.roomid);
 		room_set_displayname(room, ev.roomrename.name);
+		state_changed = true;
 		break;
 	}
 }
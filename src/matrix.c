@@ -8,10 +8,13 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <curl/curl.h>
@@ -19,9 +22,15 @@
 
 #include "cache.h"
 #include "../config.h"
+#include "hash.h"
+#include "intern.h"
+#include "jsonstream.h"
 #include "list.h"
+#include "loop.h"
+#include "ring.h"
 #include "str.h"
 #include "matrix.h"
+#include "outbox.h"
 #include "utils.h"
 
 #define DEBUG_REQUEST 0
@@ -50,35 +59,145 @@
 /* Used for all opened sockets, hence for all enpoints. */
 #define SOCKET_TIMEOUT_MS 60000
 
+/* Max number of idle easy handles kept for reuse.  See handle_get(). */
+#define HANDLE_POOL_LEN 8
+
+/* Max number of finished transfers handled by matrix_resume() at once. */
+#define MAX_COMPLETIONS_PER_WAKEUP 8
+
+/* Max time spent dispatching sync events before checking stdin again. */
+#define DISPATCH_SLICE_MS 5
+
+/*
+ * Max bytes of room JSON in the dispatch queue before the sync transfer is
+ * paused, and how low they must get for it to go on.  See dispatch_push().
+ */
+#define DISPATCH_QUEUE_MAX_BYTES (4 * 1024 * 1024)
+#define DISPATCH_QUEUE_RESUME_BYTES (DISPATCH_QUEUE_MAX_BYTES / 2)
+
+/* Slots of the rings between the network thread and the main thread */
+#define EVENTS_RING_LEN 4096
+#define REQUESTS_RING_LEN 256
+
+/* How long to wait before retrying to push to a full ring */
+#define RING_RETRY_MS 1
+
+enum HTTPMethod {
+	HTTP_GET,
+	HTTP_POST,
+	HTTP_PUT,
+};
+
 enum callback_info_type {
 	CALLBACK_INFO_TYPE_SYNC,
 	CALLBACK_INFO_TYPE_OTHER,
 } type;
 
+/* The share object of a generation of easy handles.  See handle_get(). */
+struct handle_share {
+	CURLSH *share;
+	int users;	/* Handles using it, pooled or not */
+};
+
 struct callback_info {
 	void (*callback)(const char *, size_t, void *);
+	struct handle_share *share;
 	Str *data;
+	JsonStream *stream;	/* Used instead of data for sync requests */
 	void *params;
 	enum callback_info_type type;
+
+	/* What is needed to replay the request.  See transfer_replay() */
+	enum HTTPMethod method;
+	Str *url;
+	char *json;
+	CURL *handle;
+	bool replayed;
+	struct callback_info *prev, *next; /* In the inflight list */
 };
 
-enum HTTPMethod {
-	HTTP_GET,
-	HTTP_POST,
-	HTTP_PUT,
+/*
+ * An entry of the dispatch queue: either a room of .rooms.join or, if roomid is
+ * NULL, a callback to call with what was left of the sync response.  See
+ * dispatch_run().
+ */
+struct dispatch_job {
+	char *roomid;
+	char *json;		/* Room JSON, until it is decoded into room */
+	size_t len;
+	json_t *room;
+	int phase;		/* What events of room we are dispatching */
+	size_t next;		/* Next event of that phase */
+
+	void (*callback)(const char *, size_t, void *);
+	Str *data;
+	void *params;
+};
+
+/* The last timeline event of a room dispatched.  See dispatched_skip(). */
+struct dispatched_room {
+	char *eventid;
+	char roomid[];	/* Its key in dispatched */
+};
+
+/*
+ * What the main thread asks the network thread to do.  The Str objects are
+ * owned by the request.
+ */
+struct matrix_request {
+	enum {
+		REQUEST_SYNC,
+		REQUEST_SEND_MESSAGE,
+		REQUEST_ROOM_NOTIFY_STATUS,
+		REQUEST_FILE,
+	} type;
+	Str *roomid;
+	Str *text;
+	Str *txnid;
+	bool enabled;
+	FileInfo fileinfo;
 };
 
 char *next_batch = NULL;
 const char *token = NULL;
+char *user_id = NULL;		/* See user_id_get() */
+char *sync_filter_id = NULL;	/* NULL if filters are sent inline */
+char *initial_sync_filter_id = NULL;
+bool sync_filter_dropped = false; /* See sync_filter_rejected() */
 const char *matrix_server = NULL;
 static void (*event_handler_callback)(MatrixEvent) = NULL;
 
 CURLM *mhandle = NULL;
-fd_set fdread;
-fd_set fdwrite;
-fd_set fdexcep;
-int maxfd = -1;
+bool http2 = false;	/* See matrix_set_http2() */
+struct callback_info *inflight = NULL; /* Transfers in mhandle */
+CURL *handle_pool[HANDLE_POOL_LEN];
+size_t handle_pool_len = 0;
+struct handle_share *current_share = NULL;
+LoopTimer *curl_timer = NULL;
+LoopTimer *resume_timer = NULL;
+LoopTimer *dispatch_timer = NULL;
+LoopTimer *outbox_timer = NULL;
+bool outbox_sending = false;	/* The head of the outbox is in flight */
+List *dispatch_queue = NULL; /* List<struct dispatch_job> */
+size_t dispatch_len = 0;
+size_t dispatch_bytes = 0;	/* Room JSON in dispatch_queue */
+CURL *sync_paused = NULL;	/* The sync transfer, if it is paused */
 bool insync = false;
+bool insyncbatch = false; /* Between EVENT_SYNC_BEGIN and EVENT_SYNC_END */
+Hash *dispatched = NULL; /* Hash<char *roomid, struct dispatched_room> */
+char *dispatched_since = NULL; /* The since of the sync it is about */
+MatrixStats stats;
+
+/* Network thread.  See matrix_start_thread(). */
+bool threaded = false;
+pthread_t thread;
+Ring *events_ring = NULL;	/* Ring<MatrixEvent>, to the main thread */
+Ring *requests_ring = NULL; /* Ring<struct matrix_request>, to the thread */
+List *requests_backlog = NULL; /* List<struct matrix_request> */
+LoopTimer *events_timer = NULL;
+LoopTimer *requests_timer = NULL;
+int wakeup_fds[2] = { -1, -1 };
+bool wakeup_pending = false;
 
 /*
  * -1 -> initial state
@@ -87,6 +206,21 @@ bool insync = false;
  */
 int still_running = -1;
 
+static void matrix_resume(void);
+static JsonStream *sync_stream_new(void);
+static void resume_timer_expired(void *);
+static void outbox_timer_expired(void *);
+static void dispatch_run(long long);
+static void dispatch_timer_expired(void *);
+static void emit_event(MatrixEvent);
+static void post_request(struct matrix_request);
+static void send_message(const Str *, const Str *, const Str *);
+static void outbox_flush(void);
+static void set_room_notifystatus(const Str *, bool);
+static void request_file(FileInfo);
+static void sync_start(void);
+static bool sync_filter_rejected(json_t *);
+
 void matrix_set_event_handler(void (*callback)(MatrixEvent)) {
 	event_handler_callback = callback;
 }
@@ -100,71 +234,109 @@ send_callback(void *contents, size_t size, size_t nmemb, void *userp)
 	return size * nmemb;
 }
 
-Str * matrix_send_sync_alloc(
-	enum HTTPMethod method,
-	const char *path,
-	const char *json)
+/*
+ * Callback used for libcurl to feed web content to a JsonStream, in blocking
+ * requests.  Nothing else can drain the dispatch queue meanwhile, so it is done
+ * here when it is full.
+ */
+static size_t
+stream_callback(void *contents, size_t size, size_t nmemb, void *userp)
 {
-	Str *url = str_new();
-	str_append_cstr(url, TOCSTR(MATRIX_PROTOCOL_SCHEMA));
-	str_append_cstr(url, "://");
-	assert(matrix_server != NULL);
-	str_append_cstr(url, matrix_server);
-	str_append_cstr(url, ":");
-	str_append_cstr(url, TOCSTR(MATRIX_SERVER_PORT));
-	str_append_cstr(url, path);
-	CURL *handle = curl_easy_init();
-	assert(handle);
-	CURLcode res;
-	Str *aux = str_new();
-	curl_easy_setopt(handle, CURLOPT_URL, str_buf(url));
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, send_callback);
-	curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)aux);
+	JsonStream *js = (JsonStream *)userp;
+	if (dispatch_bytes >= DISPATCH_QUEUE_MAX_BYTES)
+		dispatch_run(-1);
+	jsonstream_feed(js, contents, size*nmemb);
+	return size * nmemb;
+}
 
-	/*
-	 * TODO: disable SSL certificate verification so it works for our
-	 * internal servers
-	 */
-	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, 0);
-	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
+/*
+ * Callback used for libcurl to feed a sync response to its JsonStream.  The
+ * transfer is paused if the dispatch queue is full.  See dispatch_push().
+ */
+static size_t
+sync_callback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	struct callback_info *c = (struct callback_info *)userp;
+	if (dispatch_bytes >= DISPATCH_QUEUE_MAX_BYTES) {
+		sync_paused = c->handle;
+		stats.sync_pauses++;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	jsonstream_feed(c->stream, contents, size*nmemb);
+	return size * nmemb;
+}
 
-	switch (method) {
-	case HTTP_POST:
-		/*
-		 * TODO: According to
-		 * https://curl.se/libcurl/c/curl_easy_setopt.html, we cannot
-		 * handle strings longer than 8 MB.  Should we validate the
-		 * string length?
-		 */
-		curl_easy_setopt(handle, CURLOPT_POST, 1L);
-		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, (long)strlen(json));
-		curl_easy_setopt(handle, CURLOPT_COPYPOSTFIELDS, json);
+/*
+ * The following functions glue libcurl multi interface to our event loop (see
+ * loop.c).  libcurl tells us which sockets it wants to be watched (and for
+ * what) and when it wants to be waked up to handle timeouts.  We tell libcurl
+ * when a socket is ready or the timeout expired by calling
+ * curl_multi_socket_action().  This way we only wake up when there is
+ * something to do.
+ */
+
+static void curl_socket_ready(int fd, int revents, void *params) {
+	(void)params;
+	int flags = 0;
+	if (revents & POLLIN)
+		flags |= CURL_CSELECT_IN;
+	if (revents & POLLOUT)
+		flags |= CURL_CSELECT_OUT;
+	if (revents & (POLLERR | POLLHUP | POLLNVAL))
+		flags |= CURL_CSELECT_ERR;
+	curl_multi_socket_action(mhandle, fd, flags, &still_running);
+	matrix_resume();
+}
+
+static void curl_timer_expired(void *params) {
+	(void)params;
+	curl_multi_socket_action(mhandle, CURL_SOCKET_TIMEOUT, 0,
+		&still_running);
+	matrix_resume();
+}
+
+/* CURLMOPT_SOCKETFUNCTION callback */
+static int handle_curl_socket(
+	CURL *handle,
+	curl_socket_t s,
+	int what,
+	void *userp,
+	void *socketp)
+{
+	(void)handle;
+	(void)userp;
+	(void)socketp;
+	switch (what) {
+	case CURL_POLL_IN:
+		loop_watch_fd(s, LOOP_READ, curl_socket_ready, NULL);
 		break;
-	default:
+	case CURL_POLL_OUT:
+		loop_watch_fd(s, LOOP_WRITE, curl_socket_ready, NULL);
+		break;
+	case CURL_POLL_INOUT:
+		loop_watch_fd(s, LOOP_READ | LOOP_WRITE, curl_socket_ready,
+			NULL);
+		break;
+	case CURL_POLL_REMOVE:
+		loop_unwatch_fd(s);
 		break;
 	}
+	return 0;
+}
 
-	res = curl_easy_perform(handle);
-	if (res != CURLE_OK) {
-		fprintf(stderr, "curl error: %s\n", curl_easy_strerror(res));
-		return NULL;
-	}
-	curl_easy_cleanup(handle);
-	str_decref(url);
-	return aux;
+/*
+ * CURLMOPT_TIMERFUNCTION callback.  libcurl forbids calling
+ * curl_multi_socket_action() from here, so even a zero timeout is handled by
+ * the event loop in its next iteration.
+ */
+static int handle_curl_timer(CURLM *multi, long timeout_ms, void *userp) {
+	(void)multi;
+	(void)userp;
+	loop_timer_set(curl_timer, timeout_ms);
+	return 0;
 }
 
-static void matrix_send_async(
-	enum HTTPMethod method,
-	const char *path,
-	enum callback_info_type type,
-	const char *json,
-	void (*callback)(const char *, size_t, void *),
-	void *callback_params)
-{
-	struct callback_info *c = malloc(sizeof(struct callback_info));
-	c->callback = callback;
-	c->type = type;
+static void curl_init(void) {
 	static bool curl_initialized = false;
 	if (!curl_initialized) {
 		 /* TODO: we should enable only what we need */
@@ -175,33 +347,96 @@ static void matrix_send_async(
 		 * program?
 		 */
 	}
+}
 
-	CURL *handle = NULL;
+/*
+ * Easy handles are not thrown away when a transfer finishes: they go back to
+ * handle_pool with the options common to every request already set, and all of
+ * them point to the same share object, which keeps the DNS cache, TLS sessions
+ * and open connections.  This way, most requests skip the TCP and TLS
+ * handshakes.
+ *
+ * Connections can die without us noticing (e.g. if the IP address or the
+ * routing table changes), and reusing them makes every transfer fail, even
+ * future ones.  See the following thread in the curl-library mailing list:
+ * https://curl.se/mail/lib-2022-01/0088.html.  We used to force HTTP 1.1
+ * and a new connection per request because of that.  Now, when a transfer
+ * fails in a way that suggests a dead connection, handle_release() retires the
+ * current share object (and the pooled handles using it), so new requests
+ * start with fresh connections.  The old one is freed when the last transfer
+ * using it finishes.
+ *
+ * Only one thread at a time performs transfers (see matrix_start_thread()), so
+ * neither the pool nor the share object need locks.
+ */
 
-	if (!mhandle)
-		mhandle = curl_multi_init();
+static struct handle_share *handle_share_new(void) {
+	struct handle_share *s = malloc(sizeof(struct handle_share));
+	s->share = curl_share_init();
+	curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	/* Since Curl 7.57.0 */
+	curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+	s->users = 0;
+	return s;
+}
 
-	handle = curl_easy_init();
-	Str *aux = str_new();
+static void handle_share_decref(struct handle_share *s) {
+	if (--s->users > 0 || s == current_share)
+		return;
+	curl_share_cleanup(s->share);
+	free(s);
+}
 
-	c->data = aux;
-	c->params = callback_params;
-	
-	Str *url = str_new();
-	
-	str_append_cstr(url, TOCSTR(MATRIX_PROTOCOL_SCHEMA));
-	str_append_cstr(url, "://");
-	assert(matrix_server != NULL);
-	str_append_cstr(url, matrix_server);
-	str_append_cstr(url, ":");
-	str_append_cstr(url, TOCSTR(MATRIX_SERVER_PORT));
-	str_append_cstr(url, path);
+/* Return whether a transfer failed with `result` may have hit a dead connection */
+static bool connection_lost(CURLcode result) {
+	switch (result) {
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SSL_CONNECT_ERROR:
+		return true;
+	default:
+		return false;
+	}
+}
 
-#if DEBUG_REQUEST
-	printf("DEBUG_REQUEST: url: %s\n", str_buf(url));
-	if (json)
-		printf("DEBUG_REQUEST: json: %s\n", json);
-#endif
+/*
+ * Return an easy handle ready for a new request, taken from the pool if
+ * possible, and set *share to the share object it uses.  Callers set the
+ * request specific options (URL, write callback, method) and give it back with
+ * handle_release().
+ */
+static CURL *handle_get(struct handle_share **share) {
+	CURL *handle;
+
+	curl_init();
+	if (!current_share)
+		current_share = handle_share_new();
+	*share = current_share;
+
+	if (handle_pool_len > 0) {
+		stats.handles_reused++;
+		handle = handle_pool[--handle_pool_len];
+		/* Undo what a previous request could have set */
+		curl_easy_setopt(handle, CURLOPT_HTTPGET, 1L);
+		curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, NULL);
+		curl_easy_setopt(handle, CURLOPT_FRESH_CONNECT, 0L);
+		curl_easy_setopt(handle, CURLOPT_FORBID_REUSE, 0L);
+		return handle;
+	}
+
+	stats.handles_created++;
+	handle = curl_easy_init();
+	assert(handle);
+	current_share->users++;
+	curl_easy_setopt(handle, CURLOPT_SHARE, current_share->share);
 
 #ifdef CURLOPT_PROTOCOLS_STR
 	/* Since Curl 7.85.0 */
@@ -214,17 +449,16 @@ static void matrix_send_async(
 	/* Deprecated from 7.85.0 on */
 	curl_easy_setopt(handle, CURLOPT_PROTOCOLS, MATRIX_CURL_PROTO);
 #endif
-	
+
 	/*
 	 * TODO: libcurl timeouts with SIGALRM, so we need to caught this signal
 	 * so the program doesn't abort.
 	 */
 	curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, SOCKET_TIMEOUT_MS);
 	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 60L);
-	curl_easy_setopt(handle, CURLOPT_URL, str_buf(url));
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, send_callback);
-	curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)aux);
-	curl_easy_setopt(handle, CURLOPT_PRIVATE, (void *)c);
+
+	/* Let the kernel notice connections that died while idle */
+	curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
 
 	/*
 	 * TODO: disable SSL certificate verification so it works for our
@@ -234,23 +468,82 @@ static void matrix_send_async(
 	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
 
 	/*
-	 * TODO: libcurl by default uses HTTP 2 if possible. For the multi
-	 * interface that we are using here, it tries to keep the same
-	 * connection for different requests (for different easy handlers),
-	 * which is a feature HTTP 2 support. But it fails if connection changes
-	 * (e.g. if IP and/or routing table changes), affecting every easy
-	 * handlers, even future ones, since libcurl tries to reuse connections,
-	 * which are now dead. The solution found is to force libcurl to use
-	 * HTTP 1.1 that creates a new connection for every request. It is less
-	 * efficient, but works.
-	 *
-	 * For more info, see the following thread in the curl-library
-	 * mailing list: https://curl.se/mail/lib-2022-01/0088.html
+	 * With HTTP 2, every request is multiplexed over a single connection,
+	 * so a dead connection takes all of them down at once.  Unless asked
+	 * to (see matrix_set_http2()), stay with HTTP 1.1, whose connections
+	 * are still reused through the share object.
 	 */
-        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+	if (http2) {
+		curl_easy_setopt(handle, CURLOPT_HTTP_VERSION,
+			CURL_HTTP_VERSION_2TLS);
+		/* Wait for the connection in use instead of opening another */
+		curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+	} else
+		curl_easy_setopt(handle, CURLOPT_HTTP_VERSION,
+			CURL_HTTP_VERSION_1_1);
+	return handle;
+}
+
+/*
+ * Give back a handle from handle_get() whose transfer finished with `result`.
+ * It must not be in the multi handle anymore.
+ */
+static void handle_release(CURL *handle, struct handle_share *share,
+	CURLcode result)
+{
+	if (connection_lost(result) && share == current_share) {
+		/* Don't let anyone else reuse its connections */
+		stats.connections_evicted++;
+		current_share = NULL;
+		while (handle_pool_len > 0) {
+			curl_easy_cleanup(handle_pool[--handle_pool_len]);
+			share->users--;
+		}
+	}
+
+	if (share == current_share && handle_pool_len < HANDLE_POOL_LEN) {
+		handle_pool[handle_pool_len++] = handle;
+		return;
+	}
+	curl_easy_cleanup(handle);
+	handle_share_decref(share);
+}
+
+/*
+ * Perform a blocking request.  If `stream` is not NULL, the response is fed to
+ * it and what is returned is its skeleton (see jsonstream.c).
+ */
+Str * matrix_send_sync_alloc(
+	enum HTTPMethod method,
+	const char *path,
+	const char *json,
+	JsonStream *stream)
+{
+	Str *url = str_new();
+	str_append_cstr(url, TOCSTR(MATRIX_PROTOCOL_SCHEMA));
+	str_append_cstr(url, "://");
+	assert(matrix_server != NULL);
+	str_append_cstr(url, matrix_server);
+	str_append_cstr(url, ":");
+	str_append_cstr(url, TOCSTR(MATRIX_SERVER_PORT));
+	str_append_cstr(url, path);
+	struct handle_share *share;
+	CURL *handle = handle_get(&share);
+	CURLcode res;
+	Str *aux = NULL;
+	curl_easy_setopt(handle, CURLOPT_URL, str_buf(url));
+	/* Initial syncs can take long.  Wait as much as it takes */
+	curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, 0L);
+	if (stream) {
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, stream_callback);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)stream);
+	} else {
+		aux = str_new();
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, send_callback);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)aux);
+	}
 
 	switch (method) {
-	case HTTP_PUT:
 	case HTTP_POST:
 		/*
 		 * TODO: According to
@@ -261,7 +554,88 @@ static void matrix_send_async(
 		curl_easy_setopt(handle, CURLOPT_POST, 1L);
 		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, (long)strlen(json));
 		curl_easy_setopt(handle, CURLOPT_COPYPOSTFIELDS, json);
-		if (method == HTTP_PUT) {
+		break;
+	default:
+		break;
+	}
+
+	res = curl_easy_perform(handle);
+	handle_release(handle, share, res);
+	str_decref(url);
+	if (stream)
+		aux = jsonstream_finish(stream);
+	if (res != CURLE_OK) {
+		fprintf(stderr, "curl error: %s\n", curl_easy_strerror(res));
+		str_decref(aux);
+		return NULL;
+	}
+	return aux;
+}
+
+static void multi_init(void) {
+	curl_init();
+	mhandle = curl_multi_init();
+	if (http2)
+		curl_multi_setopt(mhandle, CURLMOPT_PIPELINING,
+			CURLPIPE_MULTIPLEX);
+	if (threaded)
+		return; /* See network_thread() */
+	curl_timer = loop_timer_new(curl_timer_expired, NULL);
+	resume_timer = loop_timer_new(resume_timer_expired, NULL);
+	outbox_timer = loop_timer_new(outbox_timer_expired, NULL);
+	curl_multi_setopt(mhandle, CURLMOPT_SOCKETFUNCTION,
+		handle_curl_socket);
+	curl_multi_setopt(mhandle, CURLMOPT_TIMERFUNCTION,
+		handle_curl_timer);
+}
+
+/*
+ * Start (or restart) the transfer of `c`, with a handle from handle_get().  If
+ * `fresh`, a new connection is used for it.
+ */
+static void transfer_start(struct callback_info *c, bool fresh) {
+	CURL *handle = handle_get(&c->share);
+	c->handle = handle;
+
+	/*
+	 * Sync responses can be huge, so they are decoded as they arrive,
+	 * instead of being accumulated in c->data.
+	 */
+	if (c->type == CALLBACK_INFO_TYPE_SYNC) {
+		c->stream = sync_stream_new();
+		c->data = NULL;
+	} else {
+		c->stream = NULL;
+		c->data = str_new();
+	}
+
+	curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, SOCKET_TIMEOUT_MS);
+	curl_easy_setopt(handle, CURLOPT_URL, str_buf(c->url));
+	if (c->stream) {
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, sync_callback);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)c);
+	} else {
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, send_callback);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)c->data);
+	}
+	curl_easy_setopt(handle, CURLOPT_PRIVATE, (void *)c);
+	if (fresh)
+		curl_easy_setopt(handle, CURLOPT_FRESH_CONNECT, 1L);
+
+	switch (c->method) {
+	case HTTP_PUT:
+	case HTTP_POST:
+		/*
+		 * TODO: According to
+		 * https://curl.se/libcurl/c/curl_easy_setopt.html, we cannot
+		 * handle strings longer than 8 MB.  Should we validate the
+		 * string length?
+		 */
+		curl_easy_setopt(handle, CURLOPT_POST, 1L);
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE,
+			(long)strlen(c->json));
+		curl_easy_setopt(handle, CURLOPT_COPYPOSTFIELDS, c->json);
+		if (c->method == HTTP_PUT) {
 			curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, "PUT");
 		}
 		break;
@@ -269,9 +643,120 @@ static void matrix_send_async(
 		break;
 	}
 
+	c->prev = NULL;
+	c->next = inflight;
+	if (inflight)
+		inflight->prev = c;
+	inflight = c;
+
+	/*
+	 * No need to call curl_multi_perform() here: adding a handle makes
+	 * libcurl set a timer through handle_curl_timer() and the transfer
+	 * starts in the next event loop iteration.
+	 */
 	curl_multi_add_handle(mhandle, handle);
-	str_decref(url);
-	curl_multi_perform(mhandle, &still_running);
+}
+
+/* Take the transfer of `c` out of mhandle and give its handle back. */
+static void transfer_stop(struct callback_info *c, CURLcode result) {
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		inflight = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	if (sync_paused == c->handle)
+		sync_paused = NULL;
+	curl_multi_remove_handle(mhandle, c->handle);
+	handle_release(c->handle, c->share, result);
+	c->handle = NULL;
+}
+
+/*
+ * Return whether the transfer of `c` can be started again from scratch:
+ * nothing came from the server yet (we may have dispatched part of a sync
+ * response already) and, for POST, nothing was sent either, since the server
+ * could have handled it.  Each request is only replayed once.
+ */
+static bool transfer_replayable(struct callback_info *c) {
+	curl_off_t downloaded = 0;
+	long sent = 0;
+	if (c->replayed)
+		return false;
+	curl_easy_getinfo(c->handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+	curl_easy_getinfo(c->handle, CURLINFO_REQUEST_SIZE, &sent);
+	return downloaded == 0 && (c->method != HTTP_POST || sent == 0);
+}
+
+/*
+ * Start again a transfer stopped because of a dead connection, on a fresh one.
+ * What it received so far is thrown away.
+ */
+static void transfer_replay(struct callback_info *c) {
+	if (c->stream)
+		str_decref(jsonstream_finish(c->stream));
+	str_decref(c->data);
+	c->replayed = true;
+	stats.transfers_replayed++;
+	transfer_start(c, true);
+}
+
+/*
+ * Called when the transfer of `failed`, using the share object `dead`, failed
+ * with a connection level `result`.  With HTTP 2, the
+ * other transfers in flight are multiplexed over the same connection, and
+ * would wait for it until they time out.  Stop them now, without letting
+ * their connection be reused, and replay the ones we can.
+ */
+static void transfers_recover(struct handle_share *dead,
+	struct callback_info *failed, CURLcode result)
+{
+	struct callback_info *c, *next;
+	for (c = inflight; c; c = next) {
+		next = c->next;
+		if (c == failed || c->share != dead || !transfer_replayable(c))
+			continue;
+		curl_easy_setopt(c->handle, CURLOPT_FORBID_REUSE, 1L);
+		transfer_stop(c, result);
+		transfer_replay(c);
+	}
+}
+
+static void matrix_send_async(
+	enum HTTPMethod method,
+	const char *path,
+	enum callback_info_type type,
+	const char *json,
+	void (*callback)(const char *, size_t, void *),
+	void *callback_params)
+{
+	struct callback_info *c = malloc(sizeof(struct callback_info));
+	c->callback = callback;
+	c->type = type;
+	c->params = callback_params;
+	c->method = method;
+	c->json = json ? strdup(json) : NULL;
+	c->replayed = false;
+
+	if (!mhandle)
+		multi_init();
+
+	c->url = str_new();
+	str_append_cstr(c->url, TOCSTR(MATRIX_PROTOCOL_SCHEMA));
+	str_append_cstr(c->url, "://");
+	assert(matrix_server != NULL);
+	str_append_cstr(c->url, matrix_server);
+	str_append_cstr(c->url, ":");
+	str_append_cstr(c->url, TOCSTR(MATRIX_SERVER_PORT));
+	str_append_cstr(c->url, path);
+
+#if DEBUG_REQUEST
+	printf("DEBUG_REQUEST: url: %s\n", str_buf(c->url));
+	if (json)
+		printf("DEBUG_REQUEST: json: %s\n", json);
+#endif
+
+	transfer_start(c, false);
 }
 
 /*
@@ -344,26 +829,186 @@ static json_t *str2json_alloc(const char *s) {
 	return j;
 }
 
+/*
+ * Tell the event handler about a message of ours that was not acknowledged by
+ * the server yet (EVENT_MSG_PENDING), so it can be shown right away.  It is
+ * called directly: only from the main thread.
+ */
+static void msg_pending(const Str *roomid, const Str *txnid, const Str *text) {
+	Str sender;
+	MatrixEvent event;
+	event.type = EVENT_MSG_PENDING;
+	event.msg.roomid = (Str *)roomid;
+	event.msg.txnid = (Str *)txnid;
+	event.msg.eventid = NULL;
+	event.msg.msg.type = MSGTYPE_TEXT;
+	event.msg.msg.sender = str_view(&sender, user_id ? user_id : "(me)");
+	event.msg.msg.text.content = (Str *)text;
+	event_handler_callback(event);
+}
+
+/*
+ * Send a text message.  It is shown at once (see msg_pending()) and kept in
+ * the outbox until the server acknowledges it, so it is not lost on network
+ * errors or if janechat exits before.
+ */
 void matrix_send_message(const Str *roomid, const Str *msg) {
+	Str *txnid = outbox_txnid_new();
+	msg_pending(roomid, txnid, msg);
+	if (threaded) {
+		post_request((struct matrix_request){
+			.type = REQUEST_SEND_MESSAGE,
+			.roomid = str_dup(roomid),
+			.text = str_dup(msg),
+			.txnid = txnid,
+		});
+		return;
+	}
+	send_message(roomid, msg, txnid);
+	str_decref(txnid);
+}
+
+static void send_message(const Str *roomid, const Str *msg, const Str *txnid) {
+	outbox_push(txnid, roomid, msg);
+	outbox_flush();
+}
+
+/*
+ * Show the messages that previous runs could not send, as if they were just
+ * sent, and send them again.  Call it once, when the UI is ready and before
+ * matrix_start_thread().
+ */
+void matrix_resend_pending(void) {
+	OutboxEntry *e;
+	outbox_load();
+	OUTBOX_FOREACH(e)
+		msg_pending(e->roomid, e->txnid, e->text);
+	outbox_flush();
+}
+
+/*
+ * Tell the event handler that the message at the head of the outbox was
+ * refused by the server with `error`.  It gets a notice to show in its place.
+ */
+static void msg_failed(OutboxEntry *e, const char *error) {
+	Str sender;
+	MatrixEvent event;
+	event.type = EVENT_MSG_FAILED;
+	event.msg.roomid = e->roomid;
+	event.msg.txnid = e->txnid;
+	event.msg.eventid = NULL;
+	event.msg.msg.type = MSGTYPE_TEXT;
+	event.msg.msg.sender = str_view(&sender, user_id ? user_id : "(me)");
+	event.msg.msg.text.content = str_new_cstr("==== message not sent: ");
+	str_append_cstr(event.msg.msg.text.content, error);
+	str_append_cstr(event.msg.msg.text.content, " ====");
+	emit_event(event);
+	str_decref(event.msg.msg.text.content);
+}
+
+/* Callback of the request sent by outbox_flush(). */
+static void outbox_sent(const char *output, size_t sz, void *params) {
+	(void)sz;
+	(void)params;
+	OutboxEntry *e = outbox_head();
+	json_t *root = output ? str2json_alloc(output) : NULL;
+	json_t *errorcode = json_object_get(root, "errcode");
+	const char *error = json_string_value(errorcode);
+
+	outbox_sending = false;
+	if (json_object_get(root, "event_id")) {
+		outbox_pop();
+	} else if (error && !streq(error, "M_LIMIT_EXCEEDED")
+	&& !streq(error, "M_UNKNOWN")) {
+		/* Trying again won't help */
+		msg_failed(e, error);
+		outbox_pop();
+	} else {
+		/* Network errors, 5xx and rate limiting */
+		stats.messages_retried++;
+		long long now = loop_now();
+		outbox_backoff(e, now);
+		json_t *retry = json_object_get(root, "retry_after_ms");
+		if (retry && json_integer_value(retry) > e->next_try - now)
+			e->next_try = now + json_integer_value(retry);
+	}
+	json_decref(root);
+	outbox_flush();
+}
+
+/*
+ * Send the message at the head of the outbox, unless it is in flight already or
+ * must wait after a failed attempt.  Messages are sent one at a time, so they
+ * arrive in order.  See outbox.c.
+ */
+static void outbox_flush(void) {
+	OutboxEntry *e = outbox_head();
+	if (!e || outbox_sending)
+		return;
+
+	long long now = loop_now();
+	if (e->next_try > now) {
+		/* Otherwise, network_thread() wakes up in time */
+		if (!threaded)
+			loop_timer_set(outbox_timer, e->next_try - now);
+		return;
+	}
+
+	char *roomid = curl_easy_escape(NULL, str_buf(e->roomid), 0);
+	char *txnid = curl_easy_escape(NULL, str_buf(e->txnid), 0);
 	Str *url = str_new();
-	str_append_cstr(url, "/_matrix/client/r0/rooms/");
-	str_append_cstr(url, str_buf(roomid));
-	str_append_cstr(url, "/send/m.room.message?access_token=");
+	str_append_cstr(url, "/_matrix/client/v3/rooms/");
+	str_append_cstr(url, roomid);
+	str_append_cstr(url, "/send/m.room.message/");
+	str_append_cstr(url, txnid);
+	str_append_cstr(url, "?access_token=");
 	str_append_cstr(url, token);
+	curl_free(roomid);
+	curl_free(txnid);
 	json_t *root = json_object_build(
 		"msgtype", json_string("m.text"),
-		"body", json_string(str_buf(msg)),
+		"body", json_string(str_buf(e->text)),
 		NULL
 	);
 	const char *s = json2str_alloc(root);
 	json_decref(root);
-	matrix_send_async(HTTP_POST, str_buf(url), CALLBACK_INFO_TYPE_OTHER,
-		s, NULL, NULL);
+	outbox_sending = true;
+	matrix_send_async(HTTP_PUT, str_buf(url), CALLBACK_INFO_TYPE_OTHER,
+		s, outbox_sent, NULL);
 	free((void *)s);
 	str_decref(url);
 }
 
+/*
+ * Milliseconds until the head of the outbox must be sent again, for
+ * network_thread().  -1 if nothing is waiting.
+ */
+static long outbox_timeout(void) {
+	OutboxEntry *e = outbox_head();
+	if (!e || outbox_sending)
+		return -1;
+	long long ms = e->next_try - loop_now();
+	return ms > 0 ? ms : 0;
+}
+
+static void outbox_timer_expired(void *params) {
+	(void)params;
+	outbox_flush();
+}
+
 void matrix_set_room_notifystatus(const Str *roomid, bool enabled) {
+	if (threaded) {
+		post_request((struct matrix_request){
+			.type = REQUEST_ROOM_NOTIFY_STATUS,
+			.roomid = str_dup(roomid),
+			.enabled = enabled,
+		});
+		return;
+	}
+	set_room_notifystatus(roomid, enabled);
+}
+
+static void set_room_notifystatus(const Str *roomid, bool enabled) {
 	Str *url = str_new();
 	str_append_cstr(url, "/_matrix/client/v3/pushrules/global/room/");
 	str_append_str(url, roomid);
@@ -388,16 +1033,43 @@ void matrix_set_room_notifystatus(const Str *roomid, bool enabled) {
 }
 
 void matrix_receive_file(const char *output, size_t sz, void *p) {
+	FileInfo *fileinfo = p;
+	if (!output) {
+		str_decref(fileinfo->mimetype);
+		str_decref(fileinfo->uri);
+		free(fileinfo);
+		return;
+	}
 	MatrixEvent event;
 	event.type = EVENT_FILE;
-	event.file.fileinfo = *((FileInfo *)p);
+	event.file.fileinfo = *fileinfo;
 	event.file.payload = output;
 	event.file.size = sz;
-	event_handler_callback(event);
-	free(p);
+	emit_event(event);
+	str_decref(fileinfo->mimetype);
+	str_decref(fileinfo->uri);
+	free(fileinfo);
 }
 
+/*
+ * fileinfo usually belongs to a message, that can be dropped from memory (see
+ * msglog.c) before the file arrives, so we keep our own copy.
+ */
 void matrix_request_file(FileInfo fileinfo) {
+	FileInfo copy;
+	copy.mimetype = fileinfo.mimetype ? intern_str(fileinfo.mimetype) : NULL;
+	copy.uri = str_dup(fileinfo.uri);
+	if (threaded)
+		post_request((struct matrix_request){
+			.type = REQUEST_FILE,
+			.fileinfo = copy,
+		});
+	else
+		request_file(copy);
+}
+
+/* Takes ownership of fileinfo */
+static void request_file(FileInfo fileinfo) {
 	Str *server = str_new_uri_extract_server(fileinfo.uri);
 	Str *path = str_new_uri_extract_path(fileinfo.uri);
 	Str *url = str_new_cstr("/_matrix/media/v3/download/");
@@ -417,36 +1089,54 @@ void matrix_set_server(char *s) {
 	matrix_server = s;
 }
 
+/*
+ * Use HTTP 2 and multiplex every request (syncs, messages and files) over a
+ * single connection, so requests sent during a long-poll don't wait for a new
+ * connection.  Must be called before any request is made.
+ */
+void matrix_set_http2(bool enabled) {
+	http2 = enabled;
+}
+
 void matrix_set_token(char *tok) {
 	token = tok;
 }
 
+/*
+ * The events we emit borrow their strings from the decoded response (see
+ * str_view()), so dispatching them doesn't allocate.  Upper layers copy what
+ * they keep.
+ */
+
 static void process_direct_event(const char *sender, json_t *roomid) {
+	Str id;
+	str_view(&id, json_string_value(roomid));
+	Str senderid;
+	str_view(&senderid, sender);
 	MatrixEvent event;
 	event.type = EVENT_ROOM_INFO;
-	event.roominfo.id = str_new_cstr_fixed(json_string_value(roomid));
-	event.roominfo.sender = str_new_cstr_fixed(sender);
+	event.roominfo.id = &id;
+	event.roominfo.sender = &senderid;
 	event.roominfo.name = NULL;
-	event_handler_callback(event);
-	str_decref(event.roominfo.id);
-	str_decref(event.roominfo.name);
+	emit_event(event);
 }
 
 static void process_room_event(json_t *item, const char *roomid) {
 	json_t *type = json_object_get(item, "type");
 	assert(type != NULL);
+	Str id;
+	str_view(&id, roomid);
 	if (streq(json_string_value(type), "m.room.name")) {
 		json_t *nam = json_path(item, "content", "name", NULL);
 		assert(nam != NULL);
-		const char *name = json_string_value(nam);
+		Str name;
+		str_view(&name, json_string_value(nam));
 		MatrixEvent event;
 		event.type = EVENT_ROOM_INFO;
-		event.roominfo.id = str_new_cstr_fixed(roomid);
-		event.roominfo.name = str_new_cstr(name);
+		event.roominfo.id = &id;
+		event.roominfo.name = &name;
 		event.roominfo.sender = NULL;
-		event_handler_callback(event);
-		str_decref(event.roominfo.id);
-		str_decref(event.roominfo.name);
+		emit_event(event);
 	} else if (streq(json_string_value(type), "m.room.create")) {
 		MatrixEvent event;
 		event.type = EVENT_ROOM_CREATE;
@@ -455,9 +1145,8 @@ static void process_room_event(json_t *item, const char *roomid) {
 		if (content_type && streq(json_string_value(content_type),
 				"m.space"))
 			event.roomcreate.is_space = true;
-		event.roomcreate.id = str_new_cstr_fixed(roomid);
-		event_handler_callback(event);
-		str_decref(event.roomcreate.id);
+		event.roomcreate.id = &id;
+		emit_event(event);
 	} else if (streq(json_string_value(type), "m.room.member")) {
 		json_t *membership = json_path(item, "content", "membership", NULL);
 		assert(membership != NULL);
@@ -465,11 +1154,13 @@ static void process_room_event(json_t *item, const char *roomid) {
 			return;
 		json_t *sender = json_object_get(item, "sender");
 		assert(sender != NULL);
+		Str senderid;
+		str_view(&senderid, json_string_value(sender));
+		Str sendername;
 		MatrixEvent event;
 		event.type = EVENT_ROOM_JOIN;
-		event.roomjoin.roomid = str_new_cstr_fixed(roomid);
-		event.roomjoin.senderid =
-			str_new_cstr_fixed(json_string_value(sender));
+		event.roomjoin.roomid = &id;
+		event.roomjoin.senderid = &senderid;
 		json_t *name = json_path(item, "content", "displayname", NULL);
 		/* TODO: See: https://spec.matrix.org/latest/client-server-api/#calculating-the-display-name-for-a-user */
 		if (name) {
@@ -480,58 +1171,19 @@ static void process_room_event(json_t *item, const char *roomid) {
 			 * the core dump file generated when it happens again.
 			 */
 			assert(json_is_string(name));
-			event.roomjoin.sendername =
-				str_new_cstr_fixed(json_string_value(name));
+			event.roomjoin.sendername = str_view(&sendername,
+				json_string_value(name));
 		} else
 			event.roomjoin.sendername = NULL;
-		event_handler_callback(event);
-		str_decref(event.roomjoin.roomid);
-		str_decref(event.roomjoin.senderid);
-		str_decref(event.roomjoin.sendername);
+		Str senderavatar;
+		json_t *avatar = json_path(item, "content", "avatar_url", NULL);
+		event.roomjoin.senderavatar = json_is_string(avatar)
+			? str_view(&senderavatar, json_string_value(avatar))
+			: NULL;
+		emit_event(event);
 	}
 }
 
-enum SelectStatus select_matrix_stdin(void) {
-	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 100;
-	
-	/* TODO: use curl_multi_timeout()? */
-
-	FD_ZERO(&fdread);
-	FD_ZERO(&fdwrite);
-	FD_ZERO(&fdexcep);
-
-	/* TODO: place it in a better place */
-	FD_SET(0 /* TODO: stdin */, &fdread);
-		
-	curl_multi_fdset(
-		mhandle,
-		&fdread,
-		&fdwrite,
-		&fdexcep,
-		&maxfd);
-	/* TODO: why (maxfd + 2) ?*/
-	int res = select(maxfd + 2, &fdread, &fdwrite, &fdexcep, &timeout);
-	switch (res) {
-	case -1:
-		if (errno == EINTR)
-			return SELECTSTATUS_MATRIXRESUME;
-		perror("select()");
-		abort(); /* TODO */
-		break;
-	case 0:
-		if (still_running)
-			return SELECTSTATUS_MATRIXRESUME;
-		break;
-	default: /* res > 0 */
-		if (FD_ISSET(0, &fdread))
-			return SELECTSTATUS_STDINREADY;
-		break;
-	}
-	return SELECTSTATUS_MATRIXRESUME;
-}
-
 static void process_timeline_event(json_t *item, const char *roomid) {
 	json_t *type = json_object_get(item, "type");
 	if (!type)
@@ -570,10 +1222,24 @@ static void process_timeline_event(json_t *item, const char *roomid) {
 		json_t *body = json_object_get(content, "body");
 		assert(body != NULL);
 
+		Str id;
+		str_view(&id, roomid);
+		Str senderid;
+		str_view(&senderid, json_string_value(sender));
 		MatrixEvent event;
 		event.type = EVENT_MSG;
-		event.msg.roomid = str_new_cstr_fixed(roomid);
-		event.msg.msg.sender = str_new_cstr_fixed(json_string_value(sender));
+		event.msg.roomid = &id;
+		event.msg.msg.sender = &senderid;
+
+		/* Only set for what we sent.  See matrix_send_message() */
+		json_t *txn = json_path(item, "unsigned", "transaction_id", NULL);
+		Str txnid;
+		event.msg.txnid = txn ? str_view(&txnid, json_string_value(txn))
+			: NULL;
+		Str eventid;
+		json_t *eid = json_object_get(item, "event_id");
+		event.msg.eventid = json_is_string(eid)
+			? str_view(&eventid, json_string_value(eid)) : NULL;
 
 		if (streq(json_string_value(msgtype), "m.image")
 		|| streq(json_string_value(msgtype), "m.audio")
@@ -585,7 +1251,9 @@ static void process_timeline_event(json_t *item, const char *roomid) {
 				json_path(content, "info", "mimetype", NULL));
 			if (!m)
 				m = "(unknown mimetype)";
-			event.msg.msg.fileinfo.mimetype = str_new_cstr_fixed(m);
+			Str mimetype;
+			str_view(&mimetype, m);
+			event.msg.msg.fileinfo.mimetype = &mimetype;
 
 			/*
 			 * TODO: I once got a error about NULL pointer when
@@ -594,51 +1262,61 @@ static void process_timeline_event(json_t *item, const char *roomid) {
 			 */
 			assert(json_object_get(content, "url"));
 			assert(json_string_value(json_object_get(content, "url")));
-			event.msg.msg.fileinfo.uri = str_new_cstr_fixed(
+			Str uri;
+			str_view(&uri,
 				json_string_value(json_object_get(content, "url")));
-			assert(event.msg.msg.fileinfo.uri);
-			event_handler_callback(event);
-			str_decref(event.msg.roomid);
-			str_decref(event.msg.msg.sender);
-			str_decref(event.msg.msg.fileinfo.uri);
+			event.msg.msg.fileinfo.uri = &uri;
+			emit_event(event);
 			return;
 		}
 
-		event.msg.msg.text.content = str_new();
 		event.msg.msg.type = MSGTYPE_TEXT;
 		if (streq(json_string_value(msgtype), "m.text")
 		|| streq(json_string_value(msgtype), "m.notice")) {
-			str_append_cstr(event.msg.msg.text.content,
-				json_string_value(body));
+			Str text;
+			str_view(&text, json_string_value(body));
+			event.msg.msg.text.content = &text;
+			emit_event(event);
 		} else {
+			/* Rare enough to be allocated */
+			event.msg.msg.text.content = str_new();
 			str_append_cstr(event.msg.msg.text.content, "==== ");
 			str_append_cstr(event.msg.msg.text.content, json_string_value(msgtype));
 			str_append_cstr(event.msg.msg.text.content, " ====");
+			emit_event(event);
+			str_decref(event.msg.msg.text.content);
 		}
-		event_handler_callback(event);
-		str_decref(event.msg.roomid);
-		str_decref(event.msg.msg.sender);
-		str_decref(event.msg.msg.text.content);
 	} else if (streq(json_string_value(type), "m.room.name")) {
+		Str id;
+		str_view(&id, roomid);
+		Str name;
+		str_view(&name,
+			json_string_value(json_object_get(content, "name")));
 		MatrixEvent event;
 		event.type = EVENT_ROOM_INFO;
-		event.roominfo.name = str_new_cstr(
-			json_string_value(json_object_get(content, "name")));
-		event.roominfo.id = str_new_cstr(roomid);
+		event.roominfo.name = &name;
+		event.roominfo.id = &id;
 		event.roominfo.sender = NULL;
-		event_handler_callback(event);
-		str_decref(event.roominfo.name);
-		str_decref(event.roominfo.id);
+		emit_event(event);
 	} else if (streq(json_string_value(type), "m.room.encrypted")) {
+		Str id;
+		str_view(&id, roomid);
+		Str senderid;
+		str_view(&senderid, json_string_value(sender));
+		Str text;
+		str_view(&text, "== encrypted message ==");
 		MatrixEvent event;
 		event.type = EVENT_MSG;
-		event.msg.roomid = str_new_cstr_fixed(roomid);
-		event.msg.msg.sender = str_new_cstr_fixed(json_string_value(sender));
-		event.msg.msg.text.content = str_new_cstr_fixed("== encrypted message ==");
-		event_handler_callback(event);
-		str_decref(event.msg.roomid);
-		str_decref(event.msg.msg.sender);
-		str_decref(event.msg.msg.text.content);
+		event.msg.roomid = &id;
+		event.msg.txnid = NULL;
+		Str eventid;
+		json_t *eid = json_object_get(item, "event_id");
+		event.msg.eventid = json_is_string(eid)
+			? str_view(&eventid, json_string_value(eid)) : NULL;
+		event.msg.msg.sender = &senderid;
+		event.msg.msg.type = MSGTYPE_TEXT;
+		event.msg.msg.text.content = &text;
+		emit_event(event);
 	}
 }
 
@@ -647,7 +1325,7 @@ static void process_error(json_t *root) {
 	event.type = EVENT_MATRIX_ERROR;
 	event.error.errorcode = str_new_cstr_fixed(json_string_value(json_object_get(root, "errcode")));
 	event.error.error = str_new_cstr_fixed(json_string_value(json_object_get(root, "error")));
-	event_handler_callback(event);
+	emit_event(event);
 	str_decref(event.error.errorcode);
 	str_decref(event.error.error);
 }
@@ -683,57 +1361,290 @@ static void process_push_rules(json_t *rule) {
 		const char *roomid =json_string_value(
 			json_object_get(rule, "rule_id"));
 
+		Str id;
+		str_view(&id, roomid);
 		event.type = EVENT_ROOM_NOTIFY_STATUS;
-		event.roomnotifystatus.roomid = str_new_cstr_fixed(roomid);
-		event_handler_callback(event);
-		str_decref(event.roomnotifystatus.roomid);
+		event.roomnotifystatus.roomid = &id;
+		emit_event(event);
+		return;
+	}
+}
+
+/*
+ * A sync whose transfer fails after some of its rooms were dispatched leaves
+ * next_batch as it was, so the next sync asks for the same events again.  To
+ * dispatch each of them once, the last timeline event dispatched of each room
+ * is kept in dispatched until a sync from dispatched_since succeeds, and the
+ * timeline of a room is dispatched from the event after it.  If that event is
+ * not in the timeline (the server sent a later, limited one), it is dispatched
+ * whole.  State events are not skipped: dispatching them again is harmless.
+ */
+static void dispatched_reset(const char *since) {
+	if (dispatched) {
+		const char *roomid;
+		struct dispatched_room *d;
+		size_t i;
+		HASH_FOREACH(dispatched, roomid, d, i) {
+			free(d->eventid);
+			free(d);
+		}
+		hash_free(dispatched);
+		dispatched = NULL;
+	}
+	free(dispatched_since);
+	dispatched_since = since ? strdup(since) : NULL;
+}
+
+static void dispatched_set(const char *roomid, json_t *event) {
+	const char *eventid = json_string_value(
+		json_object_get(event, "event_id"));
+	if (!eventid)
 		return;
+	if (!dispatched)
+		dispatched = hash_new();
+	struct dispatched_room *d = hash_get(dispatched, roomid);
+	if (!d) {
+		d = malloc(sizeof(struct dispatched_room) + strlen(roomid) + 1);
+		strcpy(d->roomid, roomid);
+		hash_insert(dispatched, d->roomid, d);
+	} else
+		free(d->eventid);
+	d->eventid = strdup(eventid);
+}
+
+/* Index of the first event of `events`, the timeline of roomid, to dispatch. */
+static size_t dispatched_skip(const char *roomid, json_t *events) {
+	struct dispatched_room *d = dispatched
+		? hash_get(dispatched, roomid) : NULL;
+	if (!d)
+		return 0;
+	for (size_t i = json_array_size(events); i > 0; i--) {
+		const char *eventid = json_string_value(json_object_get(
+			json_array_get(events, i - 1), "event_id"));
+		if (eventid && streq(eventid, d->eventid))
+			return i;
+	}
+	return 0;
+}
+
+/*
+ * Dispatch the next event of a room of .rooms.join.  Return false if there is
+ * none left.
+ *
+ * m.room.create events come in room state events list, which is unsorted.  But
+ * when passing EVENT_ROOM_CREATE events to upper layers, we have to pass it
+ * before other events that alter the room state (because the room object need
+ * already to be created in order to receive these other events), so the state
+ * events are traversed twice: first looking for events of this type (phase 0)
+ * and then for the rest of them (phase 1).  Timeline events come last (phase
+ * 2).
+ */
+static bool process_room_join_step(struct dispatch_job *j) {
+	for (; j->phase < 3; j->phase++, j->next = 0) {
+		json_t *events = json_path(j->room,
+			j->phase == 2 ? "timeline" : "state", "events", NULL);
+		assert(events != NULL);
+		if (j->phase == 2 && j->next == 0)
+			j->next = dispatched_skip(j->roomid, events);
+		while (j->next < json_array_size(events)) {
+			json_t *event = json_array_get(events, j->next++);
+			assert(event != NULL);
+			if (j->phase == 2) {
+				process_timeline_event(event, j->roomid);
+				dispatched_set(j->roomid, event);
+				return true;
+			}
+			json_t *type = json_object_get(event, "type");
+			bool create = streq(json_string_value(type),
+				"m.room.create");
+			if (create == (j->phase == 0)) {
+				process_room_event(event, j->roomid);
+				return true;
+			}
+		}
 	}
+	return false;
+}
+
+/*
+ * The events of a sync response are sent to the upper layers as a batch,
+ * between EVENT_SYNC_BEGIN and EVENT_SYNC_END, so they can update the UI once
+ * per sync instead of once per event.  The batch begins with the first event
+ * we dispatch, which may be while the response is still being received, and
+ * ends when the response was completely processed or the transfer failed.
+ */
+static void sync_batch_begin(void) {
+	if (insyncbatch)
+		return;
+	insyncbatch = true;
+	MatrixEvent event;
+	event.type = EVENT_SYNC_BEGIN;
+	emit_event(event);
+}
+
+/* `since` is the next_batch of the response, NULL if it was not processed. */
+static void sync_batch_end(const char *since) {
+	if (!insyncbatch)
+		return;
+	insyncbatch = false;
+	MatrixEvent event;
+	event.type = EVENT_SYNC_END;
+	Str view;
+	event.syncend.next_batch = since ? str_view(&view, since) : NULL;
+	emit_event(event);
+}
+
+/*
+ * Dispatching a large sync response (e.g. the first one after the computer
+ * resumes from sleep) can take seconds, so it is not done all at once: what
+ * has to be dispatched is placed in dispatch_queue and dispatch_run() works on
+ * it for at most DISPATCH_SLICE_MS at a time, from dispatch_timer.  Between
+ * slices, the event loop gets the chance to handle stdin.
+ *
+ * The queue holds the rooms of .rooms.join, as they are received, and finally
+ * the callback of the request with the skeleton of the response, so events are
+ * dispatched in the same order as before.  insync is only cleared by that
+ * callback, so there is a single sync in the queue at a time.
+ *
+ * Once the network thread is running (see matrix_start_thread()), it runs the
+ * whole queue itself, and it is the main thread that applies the resulting
+ * events in slices (see events_run()).
+ *
+ * Rooms are copied to the queue, so if dispatching falls behind the download,
+ * the queue would grow up to the whole response.  Instead, once it holds
+ * DISPATCH_QUEUE_MAX_BYTES of room JSON, the sync transfer is paused (see
+ * sync_callback()) until dispatch_run() brings it down to
+ * DISPATCH_QUEUE_RESUME_BYTES.
+ */
+static void dispatch_push(struct dispatch_job *j) {
+	if (!dispatch_queue)
+		dispatch_queue = list_new();
+	list_append(dispatch_queue, j);
+	dispatch_len++;
+	dispatch_bytes += j->len;
+	if (dispatch_len > stats.dispatch_queue_max)
+		stats.dispatch_queue_max = dispatch_len;
+	if (threaded)
+		return; /* network_thread() runs it */
+	if (!dispatch_timer)
+		dispatch_timer = loop_timer_new(dispatch_timer_expired, NULL);
+	loop_timer_set(dispatch_timer, 0);
 }
 
-static void process_rooms_join(json_t *root) {
-	const char *roomid;
-	json_t *item;
+static void dispatch_push_callback(
+	void (*callback)(const char *, size_t, void *),
+	Str *data,
+	void *params)
+{
+	struct dispatch_job *j = calloc(1, sizeof(struct dispatch_job));
+	j->callback = callback;
+	j->data = str_incref(data);
+	j->params = params;
+	dispatch_push(j);
+}
 
-	/*
-	 * m.room.create events come in room state events list, which is
-	 * unsorted.  But when passing EVENT_ROOM_CREATE events to upper layers,
-	 * we have to pass it before other events that alter the room state
-	 * (because the room object need already to be created in order to
-	 * receive these other events), so we look for events of this type first.
-	 */
-	json_object_foreach(root, roomid, item) {
-		json_t *events;
-		events = json_path(item, "state", "events", NULL);
-		size_t i;
-		json_t *event;
-		json_array_foreach(events, i, event) {
-			json_t *type = json_object_get(event, "type");
-			if (streq(json_string_value(type), "m.room.create"))
-				process_room_event(event, roomid);
+/* Dispatch the next event of job j.  Return false if it is done. */
+static bool dispatch_step(struct dispatch_job *j) {
+	if (!j->roomid) {
+		j->callback(str_buf(j->data), str_bytelen(j->data), j->params);
+		return false;
+	}
+	if (!j->room) {
+		json_error_t error;
+		j->room = json_loadb(j->json, j->len, 0, &error);
+		free(j->json);
+		j->json = NULL;
+		if (!j->room) {
+			printf("Error when parsing JSON line %d: %s\n",
+				error.line, error.text);
+			return false;
 		}
+		sync_batch_begin();
+		return true;
 	}
+	return process_room_join_step(j);
+}
 
-	json_object_foreach(root, roomid, item)
-	{
-		json_t *events;
-		events = json_path(item, "state", "events", NULL);
-		assert(events != NULL);
-		size_t i;
-		json_t *event;
-		json_array_foreach(events, i, event) {
-			json_t *type = json_object_get(event, "type");
-			if (!streq(json_string_value(type), "m.room.create"))
-				process_room_event(event, roomid);
+/*
+ * Work on the dispatch queue for at most `budget` ms (without limit if it is
+ * negative).  If there is work left, dispatch_timer is armed to go on in the
+ * next event loop iteration.
+ */
+static void dispatch_run(long long budget) {
+	long long start = loop_now();
+	struct dispatch_job *j;
+
+	if (!dispatch_queue || !dispatch_queue->head)
+		return;
+	if (budget >= 0)
+		stats.dispatch_slices++;
+	while (dispatch_queue->head) {
+		if (budget >= 0 && loop_now() - start >= budget) {
+			stats.dispatch_preempted++;
+			loop_timer_set(dispatch_timer, 0);
+			return;
 		}
-		events = json_path(item, "timeline", "events", NULL);
-		assert(events != NULL);
-		json_array_foreach(events, i, item) {
-			assert(item != NULL);
-			process_timeline_event(item, roomid);
+		j = dispatch_queue->head->val;
+		if (dispatch_step(j))
+			continue;
+		list_pop_head(dispatch_queue);
+		dispatch_len--;
+		dispatch_bytes -= j->len;
+		free(j->roomid);
+		free(j->json);
+		if (j->room)
+			json_decref(j->room);
+		str_decref(j->data);
+		free(j);
+		if (sync_paused
+		&& dispatch_bytes <= DISPATCH_QUEUE_RESUME_BYTES) {
+			/* May feed the stream, and push rooms, right now */
+			CURL *handle = sync_paused;
+			sync_paused = NULL;
+			curl_easy_pause(handle, CURLPAUSE_CONT);
 		}
 	}
+}
 
+static void dispatch_timer_expired(void *params) {
+	(void)params;
+	dispatch_run(DISPATCH_SLICE_MS);
+}
+
+/*
+ * JsonStream callback, called for each member of .rooms.join as soon as it is
+ * completely received.  It is queued to be decoded and dispatched while the
+ * rest of the sync response is still being downloaded, up to a limit (see
+ * dispatch_push()).  If the transfer then fails, the next sync skips what was
+ * dispatched (see dispatched_skip()).
+ */
+static void process_sync_room(
+	const char *roomid,
+	const char *json,
+	size_t len,
+	void *params)
+{
+	(void)params;
+	struct dispatch_job *j = calloc(1, sizeof(struct dispatch_job));
+	j->roomid = strdup(roomid);
+	j->json = malloc(len);
+	memcpy(j->json, json, len);
+	j->len = len;
+	dispatch_push(j);
+}
+
+/* Called through the dispatch queue if a sync request failed. */
+static void process_sync_failure(const char *output, size_t sz, void *params) {
+	(void)output;
+	(void)sz;
+	(void)params;
+	insync = false;
+	sync_batch_end(NULL);
+}
+
+static JsonStream *sync_stream_new(void) {
+	static const char *path[] = { "rooms", "join", NULL };
+	return jsonstream_new(path, process_sync_room, NULL);
 }
 
 static void process_rooms_invite(json_t *root) {
@@ -779,16 +1690,22 @@ static void process_sync_response(const char *output, size_t sz, void *params) {
 	if (!root)
 		abort();
 
+	sync_batch_begin();
+
 	json_t *errorcode = json_object_get(root, "errcode");
 	if (errorcode) {
-		process_error(root);
+		if (!sync_filter_rejected(errorcode))
+			process_error(root);
 		json_decref(root);
+		sync_batch_end(NULL);
 		return;
 	}
 
-	json_t *rooms_join = json_path(root, "rooms", "join", NULL);
-	if (rooms_join)
-		process_rooms_join(rooms_join);
+	/*
+	 * .rooms.join was already processed while the response was being
+	 * received (see process_sync_room()).  Here, output is what was left of
+	 * the response.
+	 */
 
 	json_t *events = json_path(root, "account_data", "events", NULL);
 	if (events) {
@@ -835,12 +1752,11 @@ static void process_sync_response(const char *output, size_t sz, void *params) {
 	json_t *n = json_object_get(root, "next_batch");
 	assert(n != NULL);
 	next_batch = strdup(json_string_value(n));
-	/*
-	 * TODO: it is better to store next_batch when exiting gracefully from
-	 * janechat.
-	 */
-	cache_set("next_batch", next_batch);
+	/* Written to disk by cache_flush(), not to hold the sync on it */
+	cache_set_lazy("next_batch", next_batch);
+	dispatched_reset(next_batch);
 	json_decref(root);
+	sync_batch_end(next_batch);
 }
 
 /*
@@ -855,7 +1771,7 @@ static void process_sync_response(const char *output, size_t sz, void *params) {
  * string.
  */
 #define SYNC_REQUEST_FILTER(timeline_arg) \
-	"filter={" \
+	"{" \
 		"\"room\":{" \
 			"\"account_data\":{\"not_types\":[\"*\"]}," \
 			"\"ephemeral\":{\"not_types\":[\"*\"]}," \
@@ -884,20 +1800,165 @@ static void process_sync_response(const char *output, size_t sz, void *params) {
 		"}" \
 	"}"
 
+/*
+ * Rather than sending the filters above in every /sync URL, they are uploaded
+ * once per profile and only their IDs are sent.  The IDs are kept with
+ * cache_set() under these keys: bump their suffix whenever the filters change,
+ * so IDs of old filters are not reused.
+ */
+#define SYNC_FILTER_KEY "sync_filter.1"
+#define INITIAL_SYNC_FILTER_KEY "initial_sync_filter.1"
+
+/*
+ * Return the user ID the access token belongs to, which is needed to upload
+ * filters and to show our messages before the server echoes them.  NULL on
+ * errors.  Only from the main thread before matrix_start_thread(), or from the
+ * network thread once it is set.
+ */
+static const char *user_id_get(void) {
+	if (user_id)
+		return user_id;
+	user_id = cache_get_alloc("user_id");
+	if (user_id)
+		return user_id;
+
+	Str *url = str_new();
+	str_append_cstr(url, "/_matrix/client/v3/account/whoami");
+	str_append_cstr(url, "?access_token=");
+	str_append_cstr(url, token);
+	Str *res = matrix_send_sync_alloc(HTTP_GET, str_buf(url), NULL, NULL);
+	str_decref(url);
+	if (!res)
+		return NULL;
+	json_t *root = str2json_alloc(str_buf(res));
+	str_decref(res);
+	json_t *userid = json_object_get(root, "user_id");
+	if (userid && json_is_string(userid)) {
+		user_id = strdup(json_string_value(userid));
+		cache_set("user_id", user_id);
+	}
+	json_decref(root);
+	return user_id;
+}
+
+/* Upload `filter` and return its ID, or NULL if the server rejected it. */
+static char *filter_upload_alloc(const char *userid, const char *filter) {
+	char *escaped = curl_easy_escape(NULL, userid, 0);
+	Str *url = str_new();
+	str_append_cstr(url, "/_matrix/client/v3/user/");
+	str_append_cstr(url, escaped);
+	str_append_cstr(url, "/filter");
+	str_append_cstr(url, "?access_token=");
+	str_append_cstr(url, token);
+	curl_free(escaped);
+	Str *res = matrix_send_sync_alloc(HTTP_POST, str_buf(url), filter, NULL);
+	str_decref(url);
+	if (!res)
+		return NULL;
+	json_t *root = str2json_alloc(str_buf(res));
+	str_decref(res);
+	char *id = NULL;
+	json_t *filterid = json_object_get(root, "filter_id");
+	if (filterid && json_is_string(filterid))
+		id = strdup(json_string_value(filterid));
+	json_decref(root);
+	return id;
+}
+
+/*
+ * Set sync_filter_id and initial_sync_filter_id, uploading the filters if
+ * they are not cached yet.  An empty cached ID means the filter was rejected
+ * before (see sync_filter_rejected()), so we try again.  On failure, IDs are
+ * left NULL and filters are sent inline.
+ */
+static void sync_filters_init(void) {
+	static const struct {
+		const char *key;
+		const char *filter;
+		char **id;
+	} filters[] = {
+		{ SYNC_FILTER_KEY, SYNC_REQUEST_FILTER(""), &sync_filter_id },
+		{ INITIAL_SYNC_FILTER_KEY, SYNC_REQUEST_FILTER("\"limit\":0,"),
+			&initial_sync_filter_id },
+	};
+	for (size_t i = 0; i < sizeof(filters) / sizeof(*filters); i++) {
+		char *id = cache_get_alloc(filters[i].key);
+		if (id && *id == '\0') {
+			free(id);
+			id = NULL;
+		}
+		if (!id) {
+			if (!user_id_get())
+				return;
+			id = filter_upload_alloc(user_id, filters[i].filter);
+			if (!id)
+				continue;
+			cache_set(filters[i].key, id);
+		}
+		free(*filters[i].id);
+		*filters[i].id = id;
+	}
+}
+
+/*
+ * Append the filter= parameter of a /sync URL: the uploaded filter `id` or,
+ * if it is NULL, the URL-encoded `filter` itself.
+ */
+static void append_sync_filter(Str *url, const char *id, const char *filter) {
+	str_append_cstr(url, "filter=");
+	char *escaped = curl_easy_escape(NULL, id ? id : filter, 0);
+	str_append_cstr(url, escaped);
+	curl_free(escaped);
+}
+
+/*
+ * Called with the errcode of a /sync response.  If it may be about the
+ * filter ID we sent (e.g. it was deleted from the server), forget the IDs, so
+ * later syncs send filters inline, and return true.
+ */
+static bool sync_filter_rejected(json_t *errorcode) {
+	const char *e = json_string_value(errorcode);
+	if (!sync_filter_id && !initial_sync_filter_id)
+		return false;
+	if (!e || !(streq(e, "M_NOT_FOUND") || streq(e, "M_INVALID_PARAM")
+	|| streq(e, "M_BAD_JSON")))
+		return false;
+	fprintf(stderr, "sync filter rejected (%s), sending it inline\n", e);
+	free(sync_filter_id);
+	free(initial_sync_filter_id);
+	sync_filter_id = NULL;
+	initial_sync_filter_id = NULL;
+	cache_set(SYNC_FILTER_KEY, "");
+	cache_set(INITIAL_SYNC_FILTER_KEY, "");
+	sync_filter_dropped = true;
+	return true;
+}
+
 /*
  * Perform the initial sync, to retrieve initial state from the matrix server.
  * No message is retrieved in this phase.
  */
 bool matrix_initial_sync(void) {
+	if (!sync_filter_dropped) {
+		user_id_get();
+		sync_filters_init();
+	}
 	Str *url = str_new();
 	str_append_cstr(url, "/_matrix/client/r0/sync");
 	str_append_cstr(url, "?");
-	str_append_cstr(url, SYNC_REQUEST_FILTER("\"limit\":0,"));
+	append_sync_filter(url, initial_sync_filter_id,
+		SYNC_REQUEST_FILTER("\"limit\":0,"));
 	str_append_cstr(url, "&access_token=");
 	str_append_cstr(url, token);
-	Str *res = matrix_send_sync_alloc(HTTP_GET, str_buf(url), NULL);
-	if (!res)
+	Str *res = matrix_send_sync_alloc(HTTP_GET, str_buf(url), NULL,
+		sync_stream_new());
+	str_decref(url);
+	/* We are not in the event loop yet: dispatch everything right now */
+	dispatch_run(-1);
+	if (!res) {
+		sync_batch_end(NULL);
 		return false;
+	}
 
 	/*
 	 * next_batch is stored with cache_set() in process_sync_response(), so
@@ -917,18 +1978,10 @@ bool matrix_initial_sync(void) {
 	 * next_batch from the cache, so the next sync will fetch information
 	 * not received since last time janechat ran.
 	 *
-	 * The approach we have here fetch all information from the server,
-	 * making it unnecessary to serialize and persist information (such as
-	 * rooms, etc.) between different janechat executions. We achieve some
-	 * level of preemption without too much complication!
-	 *
-	 * TODO: This approach surely has problems: what to do with users if
-	 * lazy_load_members is enabled? Nowadays it is not a problem because we
-	 * are not keeping a data structure to translate user ids to user names,
-	 * but we'll do it soon. In case 2 above, we does not receive user
-	 * information (because we received it somewhere in the past, before the
-	 * stored next_batch), so some level of serialization might be
-	 * necessary.
+	 * This approach fetches all information from the server, so it works
+	 * without anything persisted but next_batch.  When the caller kept
+	 * rooms and users from the last run (see rooms_save()), it calls
+	 * matrix_sync_from() instead and skips this full sync.
 	 *
 	 * TODO: next_batch handling is still very spaghetti code using a
 	 * global variable scattered among different functions. How can we make
@@ -938,25 +1991,52 @@ bool matrix_initial_sync(void) {
 	char *n = cache_get_alloc("next_batch");
 
 	process_sync_response(str_buf(res), str_bytelen(res), NULL);
+	str_decref(res);
+
+	/* The server didn't like our filter ID: try again with it inline */
+	if (sync_filter_dropped && !next_batch) {
+		free(n);
+		return matrix_initial_sync();
+	}
 
 	if (n)
 		next_batch = n;
 
-	str_decref(res);
 	return true;
 }
 
+/*
+ * Instead of matrix_initial_sync(), sync from `since`, the next_batch of an
+ * EVENT_SYNC_END of a previous run, whose state the caller kept.  Nothing is
+ * requested until matrix_sync().
+ */
+void matrix_sync_from(const char *since) {
+	user_id_get();
+	sync_filters_init();
+	free(next_batch);
+	next_batch = strdup(since);
+}
+
 void matrix_sync(void) {
+	if (threaded)
+		post_request((struct matrix_request){ .type = REQUEST_SYNC });
+	else
+		sync_start();
+}
+
+static void sync_start(void) {
 	if (insync)
 		return;
 	insync = true;
 	Str *url = str_new();
 	str_append_cstr(url, "/_matrix/client/r0/sync");
 	str_append_cstr(url, "?");
-	str_append_cstr(url, SYNC_REQUEST_FILTER(""));
+	append_sync_filter(url, sync_filter_id, SYNC_REQUEST_FILTER(""));
 	str_append_cstr(url, "&since=");
 	assert(next_batch);
 	str_append_cstr(url, next_batch);
+	if (!dispatched_since || !streq(dispatched_since, next_batch))
+		dispatched_reset(next_batch);
 	str_append_cstr(url, "&timeout=");
 #define INT2STR_(x) #x
 #define INT2STR(x) INT2STR_(x)
@@ -991,7 +2071,7 @@ const char *matrix_login_alloc(
 	const char *s = json2str_alloc(root);
 	json_decref(root);
 	Str *res = matrix_send_sync_alloc(HTTP_POST,
-		"/_matrix/client/v3/login", s);
+		"/_matrix/client/v3/login", s, NULL);
 	if (!res)
 		return NULL;
 	free((void *)s);
@@ -1005,65 +2085,468 @@ const char *matrix_login_alloc(
 	return token;
 }
 
-void matrix_resume(void) {
-	curl_multi_perform(mhandle, &still_running);
-	
-	/* TODO: check return value of curl_multi_perform() for errors */
-	int msgs_in_queue;
-	CURLMsg *msg;
-	msg = curl_multi_info_read(mhandle, &msgs_in_queue);
-
-	if (!msg)
-		/*
-		 * TODO: in what cases it can be NULL? Should we handle it as an
-		 * error?
-		 */
-		return;
-
-	CURL *handle;
-	handle = msg->easy_handle;
+/* Handle a single finished transfer and release its resources. */
+static void finish_transfer(CURL *handle, CURLcode result) {
 	struct callback_info *c;
 	curl_easy_getinfo(handle, CURLINFO_PRIVATE, &c); /* TODO: Check return code */
 
-	if (msg->data.result != CURLE_OK) {
+	if (connection_lost(result)) {
+		if (http2 && c->share == current_share)
+			transfers_recover(c->share, c, result);
+		if (transfer_replayable(c)) {
+			fprintf(stderr, "curl error: %d: %s, trying again\n",
+				(int)result, curl_easy_strerror(result));
+			transfer_stop(c, result);
+			transfer_replay(c);
+			return;
+		}
+	}
+
+	/* For streamed responses, what we pass to c->callback is the skeleton */
+	if (c->stream)
+		c->data = jsonstream_finish(c->stream);
+
+	if (result != CURLE_OK) {
 		/*
 		 * TODO: handle possible values for curl error and send them as
 		 * an enum to upper layers, so they can show something in the UI
 		 * beautifuly.
 		 */
 		fprintf(stderr, "curl error: %d: %s\n",
-			(int)msg->data.result,
-			curl_easy_strerror(msg->data.result));
+			(int)result,
+			curl_easy_strerror(result));
 		MatrixEvent event;
 		event.type = EVENT_CONN_ERROR;
-		event_handler_callback(event);
+		emit_event(event);
 
 		switch (c->type) {
 		case CALLBACK_INFO_TYPE_SYNC:
-			insync = false;
+			/* After the rooms already queued */
+			dispatch_push_callback(process_sync_failure, c->data,
+				NULL);
 			break;
 		case CALLBACK_INFO_TYPE_OTHER:
-			/* TODO: requeue */
+			if (c->callback)
+				c->callback(NULL, 0, c->params);
 			break;
 		}
-
-
-		goto cleanup;
-	}
-
-	if (msg && msg->msg == CURLMSG_DONE) {
+	} else {
 #if DEBUG_RESPONSE
 		printf("DEBUG_RESPONSE: output: %s\n", str_buf(c->data));
 #endif
-		if (c->callback)
+		if (c->callback && c->type == CALLBACK_INFO_TYPE_SYNC)
+			dispatch_push_callback(c->callback, c->data, c->params);
+		else if (c->callback)
 			c->callback(str_buf(c->data),
 				str_bytelen(c->data),
 				c->params);
-		str_decref(c->data);
-		free(c);
 	}
 
-cleanup:
-	curl_multi_remove_handle(mhandle, handle);
-	curl_easy_cleanup(handle);
+	transfer_stop(c, result);
+	str_decref(c->data);
+	str_decref(c->url);
+	free(c->json);
+	free(c);
+}
+
+/*
+ * Called after libcurl had the chance to make progress on its transfers
+ * (through curl_multi_socket_action()), to handle every transfer that has
+ * finished since.
+ *
+ * Several transfers can finish at once (e.g. a sync and a few sends, or the
+ * joins sent by process_rooms_invite()), so we drain them all, but no more
+ * than MAX_COMPLETIONS_PER_WAKEUP at a time: handling a transfer can be
+ * expensive (e.g. a large sync response) and we don't want to starve stdin.
+ * Whatever is left is handled in the next event loop iteration.  There is no
+ * such limit in the network thread, which doesn't read stdin.
+ */
+static void matrix_resume(void) {
+	int msgs_in_queue;
+	CURLMsg *msg;
+	int handled = 0;
+
+	while ((threaded || handled < MAX_COMPLETIONS_PER_WAKEUP)
+	    && (msg = curl_multi_info_read(mhandle, &msgs_in_queue))) {
+		if (handled == 0) {
+			/* msgs_in_queue doesn't count the message just read */
+			int depth = msgs_in_queue + 1;
+			stats.wakeups++;
+			stats.queue_depth_sum += depth;
+			if (depth > stats.queue_depth_max)
+				stats.queue_depth_max = depth;
+		}
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		/* msg is freed by curl_multi_remove_handle(). Copy what we need */
+		CURL *handle = msg->easy_handle;
+		CURLcode result = msg->data.result;
+		finish_transfer(handle, result);
+		handled++;
+		stats.completions++;
+	}
+
+	if (!threaded && handled == MAX_COMPLETIONS_PER_WAKEUP
+	    && msgs_in_queue > 0) {
+		stats.budget_exhausted++;
+		loop_timer_set(resume_timer, 0);
+	}
+}
+
+static void resume_timer_expired(void *params) {
+	(void)params;
+	matrix_resume();
+}
+
+/*
+ * After the initial sync, the transfers and the decoding of the responses are
+ * moved to a thread of their own, so the main thread only applies events and
+ * draws the UI.  The two threads talk through two lock-free single-producer
+ * single-consumer rings (see ring.c):
+ *
+ *                       events_ring (MatrixEvent)
+ *              +-----------------------------------------+
+ *              |                                         v
+ *     +----------------+                        +----------------+
+ *     | network thread |                        |  main thread   |
+ *     +----------------+                        +----------------+
+ *              ^                                         |
+ *              +-----------------------------------------+
+ *               requests_ring (struct matrix_request)
+ *
+ * The network thread sleeps in curl_multi_poll(), and the main thread wakes it
+ * up with curl_multi_wakeup().  The main thread sleeps in the event loop, and
+ * the network thread wakes it up writing to wakeup_fds[1], whose other end is
+ * watched by the loop.  wakeup_pending avoids writing a byte for each event.
+ *
+ * Events borrow their strings from whoever emits them, so the ones put in the
+ * ring own copies of them instead (see event_copy() and matrix_free_event()).
+ *
+ * If events arrive faster than the main thread applies them, events_ring fills
+ * up and the network thread waits.  The main thread never waits: if
+ * requests_ring is full, requests are kept in requests_backlog until there is
+ * room.
+ */
+
+/* IDs are interned, so copying them is usually just a lookup */
+static Str *copy_id(const Str *s) {
+	return s ? intern_cstr(str_buf(s)) : NULL;
+}
+
+static Str *copy_str(const Str *s) {
+	return s ? str_dup(s) : NULL;
+}
+
+/*
+ * Make event own copies of everything it points to, since what it borrows is
+ * gone by the time the main thread gets it.
+ */
+static void event_copy(MatrixEvent *event) {
+	switch (event->type) {
+	case EVENT_MSG:
+	case EVENT_MSG_PENDING:
+	case EVENT_MSG_FAILED:
+		event->msg.roomid = copy_id(event->msg.roomid);
+		event->msg.txnid = copy_str(event->msg.txnid);
+		event->msg.eventid = copy_str(event->msg.eventid);
+		event->msg.msg.sender = copy_id(event->msg.msg.sender);
+		if (event->msg.msg.type == MSGTYPE_FILE) {
+			event->msg.msg.fileinfo.mimetype =
+				copy_id(event->msg.msg.fileinfo.mimetype);
+			event->msg.msg.fileinfo.uri =
+				copy_str(event->msg.msg.fileinfo.uri);
+		} else
+			event->msg.msg.text.content =
+				copy_str(event->msg.msg.text.content);
+		break;
+	case EVENT_FILE: {
+		char *payload = malloc(event->file.size);
+		memcpy(payload, event->file.payload, event->file.size);
+		event->file.payload = payload;
+		event->file.fileinfo.mimetype =
+			copy_id(event->file.fileinfo.mimetype);
+		event->file.fileinfo.uri = copy_str(event->file.fileinfo.uri);
+		break; }
+	case EVENT_ROOM_CREATE:
+		event->roomcreate.id = copy_id(event->roomcreate.id);
+		break;
+	case EVENT_ROOM_INFO:
+		event->roominfo.id = copy_id(event->roominfo.id);
+		event->roominfo.sender = copy_id(event->roominfo.sender);
+		event->roominfo.name = copy_str(event->roominfo.name);
+		break;
+	case EVENT_ROOM_JOIN:
+		event->roomjoin.roomid = copy_id(event->roomjoin.roomid);
+		event->roomjoin.senderid = copy_id(event->roomjoin.senderid);
+		event->roomjoin.sendername =
+			copy_str(event->roomjoin.sendername);
+		event->roomjoin.senderavatar =
+			copy_str(event->roomjoin.senderavatar);
+		break;
+	case EVENT_ROOM_NOTIFY_STATUS:
+		event->roomnotifystatus.roomid =
+			copy_id(event->roomnotifystatus.roomid);
+		break;
+	case EVENT_MATRIX_ERROR:
+		event->error.errorcode = copy_str(event->error.errorcode);
+		event->error.error = copy_str(event->error.error);
+		break;
+	case EVENT_SYNC_END:
+		event->syncend.next_batch = copy_str(event->syncend.next_batch);
+		break;
+	case EVENT_CONN_ERROR:
+	case EVENT_SYNC_BEGIN:
+		break;
+	}
+}
+
+/* Release what event_copy() made. */
+void matrix_free_event(MatrixEvent *event) {
+	switch (event->type) {
+	case EVENT_MSG:
+	case EVENT_MSG_PENDING:
+	case EVENT_MSG_FAILED:
+		str_decref(event->msg.roomid);
+		str_decref(event->msg.txnid);
+		str_decref(event->msg.eventid);
+		str_decref(event->msg.msg.sender);
+		if (event->msg.msg.type == MSGTYPE_FILE) {
+			str_decref(event->msg.msg.fileinfo.mimetype);
+			str_decref(event->msg.msg.fileinfo.uri);
+		} else
+			str_decref(event->msg.msg.text.content);
+		break;
+	case EVENT_FILE:
+		free((void *)event->file.payload);
+		str_decref(event->file.fileinfo.mimetype);
+		str_decref(event->file.fileinfo.uri);
+		break;
+	case EVENT_ROOM_CREATE:
+		str_decref(event->roomcreate.id);
+		break;
+	case EVENT_ROOM_INFO:
+		str_decref(event->roominfo.id);
+		str_decref(event->roominfo.sender);
+		str_decref(event->roominfo.name);
+		break;
+	case EVENT_ROOM_JOIN:
+		str_decref(event->roomjoin.roomid);
+		str_decref(event->roomjoin.senderid);
+		str_decref(event->roomjoin.sendername);
+		str_decref(event->roomjoin.senderavatar);
+		break;
+	case EVENT_ROOM_NOTIFY_STATUS:
+		str_decref(event->roomnotifystatus.roomid);
+		break;
+	case EVENT_MATRIX_ERROR:
+		str_decref(event->error.errorcode);
+		str_decref(event->error.error);
+		break;
+	case EVENT_SYNC_END:
+		str_decref(event->syncend.next_batch);
+		break;
+	case EVENT_CONN_ERROR:
+	case EVENT_SYNC_BEGIN:
+		break;
+	}
+}
+
+static void sleep_ms(long ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+/* Network thread.  Wake the main thread up, if it is not awake already. */
+static void wakeup_main(void) {
+	if (!__atomic_exchange_n(&wakeup_pending, true, __ATOMIC_ACQ_REL)) {
+		/* The pipe may be full, but then the main loop is awake */
+		ssize_t n = write(wakeup_fds[1], "", 1);
+		(void)n;
+	}
+}
+
+/*
+ * Pass event to the upper layers: directly if we are in the main thread, or
+ * through the events ring if we are in the network thread.
+ */
+static void emit_event(MatrixEvent event) {
+	if (!threaded) {
+		event_handler_callback(event);
+		return;
+	}
+	event_copy(&event);
+	stats.events_posted++;
+	while (!ring_push(events_ring, &event)) {
+		stats.events_ring_full++;
+		wakeup_main();
+		sleep_ms(RING_RETRY_MS);
+	}
+	wakeup_main();
+}
+
+/*
+ * Main thread.  Apply the events received from the network thread for at most
+ * `budget` ms.  If there are events left, events_timer is armed to go on in the
+ * next event loop iteration, so stdin is not starved.
+ */
+static void events_run(long long budget) {
+	long long start = loop_now();
+	MatrixEvent event;
+
+	if (ring_empty(events_ring))
+		return;
+	stats.dispatch_slices++;
+	while (ring_pop(events_ring, &event)) {
+		event_handler_callback(event);
+		matrix_free_event(&event);
+		if (loop_now() - start >= budget && !ring_empty(events_ring)) {
+			stats.dispatch_preempted++;
+			loop_timer_set(events_timer, 0);
+			return;
+		}
+	}
+}
+
+static void events_timer_expired(void *params) {
+	(void)params;
+	events_run(DISPATCH_SLICE_MS);
+}
+
+static void wakeup_fd_ready(int fd, int revents, void *params) {
+	(void)revents;
+	(void)params;
+	char buf[64];
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	/*
+	 * An exchange, not a store: if the network thread pushed an event
+	 * without writing to the pipe, this synchronizes with it and we see the
+	 * event below.
+	 */
+	(void)__atomic_exchange_n(&wakeup_pending, false, __ATOMIC_ACQ_REL);
+	events_run(DISPATCH_SLICE_MS);
+}
+
+/* Main thread.  Move what we can from requests_backlog to the ring. */
+static void requests_flush(void) {
+	struct matrix_request *r;
+	while (requests_backlog->head) {
+		r = requests_backlog->head->val;
+		if (!ring_push(requests_ring, r)) {
+			loop_timer_set(requests_timer, RING_RETRY_MS);
+			return;
+		}
+		list_pop_head(requests_backlog);
+		free(r);
+	}
+}
+
+/* Main thread.  Ask the network thread to carry out req. */
+static void post_request(struct matrix_request req) {
+	/* Nothing goes into the ring before what is in the backlog */
+	requests_flush();
+	if (requests_backlog->head || !ring_push(requests_ring, &req)) {
+		struct matrix_request *r = malloc(sizeof(*r));
+		*r = req;
+		list_append(requests_backlog, r);
+		loop_timer_set(requests_timer, RING_RETRY_MS);
+	}
+	curl_multi_wakeup(mhandle);
+}
+
+static void requests_timer_expired(void *params) {
+	(void)params;
+	requests_flush();
+	curl_multi_wakeup(mhandle);
+}
+
+/* Network thread.  Carry out req and release it. */
+static void request_run(struct matrix_request *req) {
+	switch (req->type) {
+	case REQUEST_SYNC:
+		sync_start();
+		break;
+	case REQUEST_SEND_MESSAGE:
+		send_message(req->roomid, req->text, req->txnid);
+		break;
+	case REQUEST_ROOM_NOTIFY_STATUS:
+		set_room_notifystatus(req->roomid, req->enabled);
+		break;
+	case REQUEST_FILE:
+		request_file(req->fileinfo);
+		break;
+	}
+	str_decref(req->roomid);
+	str_decref(req->text);
+	str_decref(req->txnid);
+}
+
+static void *network_thread(void *params) {
+	(void)params;
+	struct matrix_request req;
+	for (;;) {
+		while (ring_pop(requests_ring, &req))
+			request_run(&req);
+		curl_multi_perform(mhandle, &still_running);
+		matrix_resume();
+		dispatch_run(-1);
+		outbox_flush();
+		long timeout = outbox_timeout();
+		if (timeout < 0 || timeout > SOCKET_TIMEOUT_MS)
+			timeout = SOCKET_TIMEOUT_MS;
+		/* Returns earlier if libcurl has something to do */
+		curl_multi_poll(mhandle, NULL, 0, (int)timeout, NULL);
+	}
+	return NULL;
+}
+
+/*
+ * Move the transfers and the decoding of the responses to a thread of their
+ * own.  From now on, events are passed to the callback set with
+ * matrix_set_event_handler() from the event loop, in the main thread.
+ */
+void matrix_start_thread(void) {
+	if (threaded)
+		return;
+
+	if (!mhandle)
+		multi_init();
+	/*
+	 * Transfers started so far (e.g. joins sent by the initial sync) are
+	 * driven by the network thread too, with curl_multi_perform() instead
+	 * of the event loop.
+	 */
+	curl_multi_setopt(mhandle, CURLMOPT_SOCKETFUNCTION, NULL);
+	curl_multi_setopt(mhandle, CURLMOPT_TIMERFUNCTION, NULL);
+	if (curl_timer)
+		loop_timer_set(curl_timer, -1);
+	if (dispatch_timer)
+		loop_timer_set(dispatch_timer, -1);
+	if (outbox_timer)
+		loop_timer_set(outbox_timer, -1);
+	dispatch_run(-1);
+
+	events_ring = ring_new(EVENTS_RING_LEN, sizeof(MatrixEvent));
+	requests_ring = ring_new(REQUESTS_RING_LEN, sizeof(struct matrix_request));
+	requests_backlog = list_new();
+	events_timer = loop_timer_new(events_timer_expired, NULL);
+	requests_timer = loop_timer_new(requests_timer_expired, NULL);
+
+	if (pipe(wakeup_fds) == -1) {
+		perror("pipe()");
+		abort(); /* TODO */
+	}
+	fcntl(wakeup_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakeup_fds[1], F_SETFL, O_NONBLOCK);
+	loop_watch_fd(wakeup_fds[0], LOOP_READ, wakeup_fd_ready, NULL);
+
+	threaded = true;
+	if (pthread_create(&thread, NULL, network_thread, NULL) != 0) {
+		perror("pthread_create()");
+		abort(); /* TODO */
+	}
+}
+
+const MatrixStats *matrix_stats(void) {
+	return &stats;
 }
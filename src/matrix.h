@@ -2,13 +2,14 @@
 #define JANECHAT_MATRIX_H
 
 #include <fcntl.h>
-#include <sys/select.h>
 
 #include "common.h"
 #include "str.h"
 
 enum MatrixEventType {
 	EVENT_MSG,
+	EVENT_MSG_PENDING,
+	EVENT_MSG_FAILED,
 	EVENT_FILE,
 	EVENT_ROOM_CREATE,
 	EVENT_ROOM_INFO,
@@ -16,14 +17,30 @@ enum MatrixEventType {
 	EVENT_ROOM_NOTIFY_STATUS,
 	EVENT_MATRIX_ERROR,
 	EVENT_CONN_ERROR,
+	EVENT_SYNC_BEGIN,
+	EVENT_SYNC_END,
 };
 
+/*
+ * An event passed to the callback set with matrix_set_event_handler().  Its Str
+ * objects are borrowed (see str_view()): they are only valid until the callback
+ * returns and must not be increfed.  The callback copies what it keeps.
+ */
 struct MatrixEvent {
 	enum MatrixEventType type;
 	union {
 		// TODO: why fields above are not const?
+		/*
+		 * Also for EVENT_MSG_PENDING, a message we sent that is not
+		 * acknowledged yet, and EVENT_MSG_FAILED, a notice that it
+		 * was refused.  txnid identifies our messages (see
+		 * matrix_send_message()): when the EVENT_MSG of a pending one
+		 * arrives, it has the same txnid.  It is NULL for others.
+		 */
 		struct MatrixEventMsg {
 			Str *roomid;
+			Str *txnid;
+			Str *eventid;	/* NULL for EVENT_MSG_PENDING/FAILED */
 			struct Msg msg;
 		} msg;
 		struct MatrixEventRoomCreate {
@@ -43,6 +60,7 @@ struct MatrixEvent {
 			Str *roomid;
 			Str *senderid;
 			Str *sendername;
+			Str *senderavatar;	/* An mxc:// URI */
 		} roomjoin;
 		struct MatrixEventMatrixError {
 			Str *errorcode;
@@ -53,32 +71,60 @@ struct MatrixEvent {
 			size_t size;
 			FileInfo fileinfo;
 		} file;
-		// MatrixEventConnError - empty struct
+		/*
+		 * next_batch of the response, so everything built from the
+		 * events so far can be resumed from it (see matrix_sync_from()).
+		 * NULL if the sync failed.
+		 */
+		struct MatrixEventSyncEnd {
+			Str *next_batch;
+		} syncend;
+		/*
+		 * MatrixEventConnError and MatrixEventSyncBegin - empty
+		 * structs.  The events of a sync response are sent between
+		 * EVENT_SYNC_BEGIN and EVENT_SYNC_END.
+		 */
 	};
 };
 
 typedef struct MatrixEvent MatrixEvent;
 
-enum SelectStatus {
-	SELECTSTATUS_STDINREADY,
-	SELECTSTATUS_MATRIXRESUME,
+/* Counters about the transport, for debugging and tuning. */
+struct MatrixStats {
+	unsigned long wakeups;		/* Wakeups with finished transfers */
+	unsigned long completions;	/* Finished transfers handled */
+	unsigned long queue_depth_sum;	/* Sum of queue depths at wakeup */
+	int queue_depth_max;		/* Max queue depth seen at a wakeup */
+	unsigned long budget_exhausted;	/* Wakeups that left work behind */
+	unsigned long dispatch_slices;	/* Time slices spent dispatching syncs */
+	unsigned long dispatch_preempted; /* Slices that left work behind */
+	size_t dispatch_queue_max;	/* Max rooms (and callbacks) queued */
+	unsigned long sync_pauses;	/* Times a sync waited for dispatching */
+	unsigned long events_posted;	/* Events sent by the network thread */
+	unsigned long events_ring_full;	/* Times it waited for the main one */
+	unsigned long handles_created;	/* curl easy handles created */
+	unsigned long handles_reused;	/* Requests that took one from the pool */
+	unsigned long connections_evicted; /* Times connections were dropped */
+	unsigned long transfers_replayed; /* Requests sent again after that */
+	unsigned long messages_retried;	/* Failed attempts to send messages */
 };
+typedef struct MatrixStats MatrixStats;
 
 void matrix_set_event_handler(void (*callback)(MatrixEvent));
 bool matrix_initial_sync(void);
+void matrix_sync_from(const char *since);
 void matrix_sync(void);
 void matrix_send_message(const Str *roomid, const Str *msg);
+void matrix_resend_pending(void);
 void matrix_set_room_notifystatus(const Str *roomid, bool);
 void matrix_request_file(FileInfo);
 MatrixEvent * matrix_next_event();
 void matrix_set_server(char *token);
 void matrix_set_token(char *token);
+void matrix_set_http2(bool);
 const char *matrix_login_alloc(const char *server, const char *user, const char *password);
 void matrix_free_event(MatrixEvent *);
-bool matrix_select(void);
-void matrix_resume(void);
-enum SelectStatus select_matrix_stdin();
-
-extern fd_set fdread;
+const MatrixStats *matrix_stats(void);
+void matrix_start_thread(void);
 
 #endif /* !JANECHAT_MATRIX_H */
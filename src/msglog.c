@@ -0,0 +1,759 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "intern.h"
+#include "msglog.h"
+#include "str.h"
+
+/**
+ * This file implements the storage of the messages of a room.
+ *
+ * Rooms can have a lot of messages, that are never modified once received, so
+ * instead of allocating each one (and its strings) separately, we store them
+ * in blocks:
+ *
+ * - Each block holds MSGLOG_BLOCK_LEN Msg records contiguously.  The i-th
+ *   message is in block (i - first) / MSGLOG_BLOCK_LEN, so iterating over
+ *   messages walks memory sequentially and random access (e.g. "/open 42") is
+ *   still O(1).
+ *
+ * - Each block has an append-only arena where the bodies of its messages (text
+ *   content and file URIs) are copied, as Str objects built in place with
+ *   str_new_cstr_at().  So they can be used as any other Str, but they are
+ *   never freed by str_decref().  Freeing a block just frees its arena,
+ *   without visiting messages.
+ *
+ * Senders and mimetypes are interned (see intern.c), which keeps them alive
+ * forever, so messages don't even need to hold references to them.
+ *
+ * Every message is also appended to the timeline of the room, a file in the
+ * cache directory that lives across runs.  So only the most recent messages
+ * are kept in memory, and a janechat left running for weeks in busy rooms
+ * doesn't grow forever: when a room has more than max_msgs messages or its
+ * blocks use more than max_bytes, its oldest blocks are freed:
+ *
+ *	   0       first                              len
+ *	   |         |                                 |
+ *	   +---------+---------------------------------+
+ *	   |          timeline file                    |
+ *	   +---------+---------------------------------+
+ *	             |           memory                |
+ *	             +---------------------------------+
+ *
+ * msglog_load_older() loads the block before `first` back from the file when
+ * the user scrolls past the oldest message in memory.  While such blocks are in
+ * memory (pinned) we don't trim the room, so history the user is reading
+ * doesn't vanish when a message arrives.  msglog_trim() trims it again, e.g.
+ * when the user leaves the room.
+ *
+ * When a room is created, the tail of its timeline is loaded (see
+ * timeline_load()), so the history of the last run is there right away.
+ *
+ * A sync may be received again after a crash (see main.c) or when it is
+ * retried, so msglog_append() drops messages whose event ID is one of the
+ * last MSGLOG_DEDUP_LEN ones.  Blocks keep a hash of the event ID of each
+ * message for that, and the timeline keeps the IDs themselves.
+ */
+
+#define CHUNK_MIN (4 * 1024)
+#define CHUNK_MAX (64 * 1024)
+
+#define TIMELINE_MAGIC "janechat-timeline-1\n"
+
+/* How many timeline logs are kept open at most.  See timeline_write(). */
+#define TIMELINE_MAX_FDS 32
+
+struct msglog_chunk {
+	struct msglog_chunk *next;
+	size_t used;
+	size_t size;
+	_Alignas(Str) char data[];
+};
+
+/* See msglog_set_limits() */
+static size_t max_msgs = MSGLOG_DEFAULT_MAX_MSGS;
+static size_t max_bytes = MSGLOG_DEFAULT_MAX_BYTES;
+
+/* The MsgLogs whose log is open, least recently appended to first */
+static MsgLog *open_logs[TIMELINE_MAX_FDS];
+static size_t nopen_logs = 0;
+
+static void timeline_load(MsgLog *);
+static void trim(MsgLog *);
+
+/*
+ * Set how many messages and bytes each room keeps in memory.  0 means no
+ * limit.
+ */
+void msglog_set_limits(size_t msgs, size_t bytes) {
+	max_msgs = msgs;
+	max_bytes = bytes;
+}
+
+/*
+ * Create a MsgLog whose messages are stored in the timeline under the cache
+ * key `key` (a directory), with the messages already there.  If `key` is NULL,
+ * messages are kept in memory only, and those over the limits are lost.
+ */
+MsgLog *msglog_new(const char *key) {
+	MsgLog *log = malloc(sizeof(MsgLog));
+	log->blocks = NULL;
+	log->nblocks = 0;
+	log->maxblocks = 0;
+	log->first = 0;
+	log->len = 0;
+	log->bytes = 0;
+	log->key = key ? strdup(key) : NULL;
+	log->size = 0;
+	log->fd = -1;
+	log->pending = NULL;
+	log->npending = 0;
+	log->offsets = NULL;
+	log->noffsets = 0;
+	log->pinned = false;
+	if (log->key)
+		timeline_load(log);
+	return log;
+}
+
+static struct msglog_block *block_new(void) {
+	struct msglog_block *b = malloc(sizeof(struct msglog_block));
+	b->chunks = NULL;
+	b->bytes = sizeof(struct msglog_block);
+	return b;
+}
+
+static void block_free(struct msglog_block *b) {
+	struct msglog_chunk *c = b->chunks;
+	while (c) {
+		struct msglog_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	free(b);
+}
+
+/* Allocate `size` bytes, suitable to hold a Str, from the arena of `b`. */
+static void *block_alloc(struct msglog_block *b, size_t size) {
+	/* Keep every allocation aligned for the next one */
+	size = (size + _Alignof(Str) - 1) & ~(_Alignof(Str) - 1);
+	struct msglog_chunk *c = b->chunks;
+	if (!c || c->size - c->used < size) {
+		/*
+		 * Start small, so rooms with few messages don't waste memory,
+		 * and double up to CHUNK_MAX.  Bodies larger than that get a
+		 * chunk of their own.
+		 */
+		size_t csize = c ? c->size * 2 : CHUNK_MIN;
+		if (csize > CHUNK_MAX)
+			csize = CHUNK_MAX;
+		if (csize < size)
+			csize = size;
+		c = malloc(sizeof(struct msglog_chunk) + csize);
+		c->used = 0;
+		c->size = csize;
+		c->next = b->chunks;
+		b->chunks = c;
+		b->bytes += sizeof(struct msglog_chunk) + csize;
+	}
+	void *p = &c->data[c->used];
+	c->used += size;
+	return p;
+}
+
+static Str *block_copy_cstr(struct msglog_block *b, const char *s, size_t len) {
+	return str_new_cstr_at(block_alloc(b, str_size_for(len)), s, len);
+}
+
+/* Hash of event ID `s`, `len` bytes long.  Never 0, that stands for none. */
+static uint64_t id_hash(const char *s, size_t len) {
+	uint64_t h = 14695981039346656037ULL; /* FNV-1a */
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 1099511628211ULL;
+	}
+	return h ? h : 1;
+}
+
+/* Copy `m` to `msg`, that lives in block `b`. */
+static void block_set_msg(struct msglog_block *b, Msg *msg, Msg m) {
+	msg->type = m.type;
+	/* The intern pool keeps them alive.  No need to hold references. */
+	msg->sender = intern_str(m.sender);
+	str_decref(msg->sender);
+	if (m.type == MSGTYPE_TEXT) {
+		msg->text.content = block_copy_cstr(b,
+			str_buf(m.text.content), str_bytelen(m.text.content));
+	} else if (m.type == MSGTYPE_FILE) {
+		msg->fileinfo.mimetype = intern_str(m.fileinfo.mimetype);
+		str_decref(msg->fileinfo.mimetype);
+		msg->fileinfo.uri = block_copy_cstr(b,
+			str_buf(m.fileinfo.uri), str_bytelen(m.fileinfo.uri));
+	}
+}
+
+static void ensure_maxblocks(MsgLog *log) {
+	if (log->nblocks < log->maxblocks)
+		return;
+	log->maxblocks = log->maxblocks ? log->maxblocks * 2 : 4;
+	log->blocks = realloc(log->blocks,
+		sizeof(struct msglog_block *) * log->maxblocks);
+}
+
+/* Return the slot for message log->len, in the last block, adding it if full */
+static Msg *append_slot(MsgLog *log) {
+	if (((log->len - log->first) >> MSGLOG_BLOCK_SHIFT) == log->nblocks) {
+		ensure_maxblocks(log);
+		struct msglog_block *b = block_new();
+		log->blocks[log->nblocks++] = b;
+		log->bytes += b->bytes;
+	}
+	return msglog_at(log, log->len);
+}
+
+/*
+ * The timeline of a room is made of two files under its key: "log" and
+ * "index".
+ *
+ * The log starts with TIMELINE_MAGIC, followed by every message of the room.
+ * A message is its type (one byte) followed by its strings, each one a
+ * uint32_t length followed by its bytes: the sender, the event ID (empty for
+ * messages of ours not echoed by the server) and the text content
+ * (MSGTYPE_TEXT) or the mimetype and uri (MSGTYPE_FILE).
+ *
+ * The index is a sparse one: the log offset (uint64_t) of every
+ * MSGLOG_BLOCK_LEN-th message, that is, of the first message of each block.
+ * So the block of any message is found without reading the messages before it.
+ *
+ * The files are only read by the janechat that wrote them, so we use the native
+ * byte order.  Messages are appended as they arrive, without waiting for them
+ * to reach the disk: a crash may cut the last one short, or lose the last
+ * entries of the index.  timeline_load() drops the former and rebuilds the
+ * latter.
+ *
+ * The log is kept open (log->fd) from the first message appended, and each
+ * message is a single pwrite(2) at log->size, so appending doesn't cost an
+ * open(2).  Only the TIMELINE_MAX_FDS rooms appended to most recently hold a
+ * descriptor, so accounts with thousands of rooms don't run out of them: the
+ * log of the least recently appended one is closed, and opened again on its
+ * next message.
+ *
+ * If the log can't be opened or written, the records are kept in log->pending
+ * and written with the next message, so a full disk or a transient error
+ * doesn't leave holes in the timeline.  Blocks not written yet are not trimmed,
+ * as they couldn't be loaded back: if the log keeps failing for longer than
+ * the limits, trim() gives up on it (see timeline_drop()).
+ */
+
+static FILE *timeline_open(MsgLog *log, const char *file, const char *mode) {
+	char key[PATH_MAX];
+	snprintf(key, sizeof(key), "%s/%s", log->key, file);
+	return cache_open(key, mode);
+}
+
+/* Close the log of `log`, if open. */
+static void timeline_close(MsgLog *log) {
+	if (log->fd == -1)
+		return;
+	close(log->fd);
+	log->fd = -1;
+	for (size_t i = 0; i < nopen_logs; i++) {
+		if (open_logs[i] == log) {
+			nopen_logs--;
+			memmove(&open_logs[i], &open_logs[i + 1],
+				sizeof(MsgLog *) * (nopen_logs - i));
+			break;
+		}
+	}
+}
+
+/*
+ * Make sure log->fd is open, closing the least recently used log if there are
+ * TIMELINE_MAX_FDS open already.  Return false on errors.
+ */
+static bool timeline_open_log(MsgLog *log) {
+	if (log->fd != -1) {
+		/* Move it to the end, as the most recently used */
+		for (size_t i = 0; i < nopen_logs; i++) {
+			if (open_logs[i] == log) {
+				memmove(&open_logs[i], &open_logs[i + 1],
+					sizeof(MsgLog *) * (nopen_logs - i - 1));
+				open_logs[nopen_logs - 1] = log;
+				break;
+			}
+		}
+		return true;
+	}
+	if (nopen_logs == TIMELINE_MAX_FDS)
+		timeline_close(open_logs[0]);
+
+	/* A log that is new or was not ours is started again */
+	char key[PATH_MAX];
+	snprintf(key, sizeof(key), "%s/log", log->key);
+	log->fd = cache_open_fd(key, O_RDWR | O_CREAT
+		| (log->size ? 0 : O_TRUNC));
+	if (log->fd == -1)
+		return false;
+	open_logs[nopen_logs++] = log;
+	return true;
+}
+
+/* Put `s` at *p and move *p past it.  NULL is put as an empty string. */
+static void put_str(char **p, const Str *s) {
+	uint32_t len = s ? str_bytelen(s) : 0;
+	memcpy(*p, &len, sizeof(len));
+	if (s)
+		memcpy(*p + sizeof(len), str_buf(s), len);
+	*p += sizeof(len) + len;
+}
+
+/* Take a string from [*p, end) and move *p past it.  False if cut short. */
+static bool get_str(const char **p, const char *end, const char **s,
+	size_t *len)
+{
+	uint32_t l;
+	if ((size_t)(end - *p) < sizeof(l))
+		return false;
+	memcpy(&l, *p, sizeof(l));
+	if ((size_t)(end - *p) - sizeof(l) < l)
+		return false;
+	*s = *p + sizeof(l);
+	*len = l;
+	*p += sizeof(l) + l;
+	return true;
+}
+
+/* Intern `len` bytes of `s`, that are not null-terminated. */
+static Str *intern_bytes(const char *s, size_t len) {
+	static char *buf = NULL;
+	static size_t bufsize = 0;
+	if (len + 1 > bufsize) {
+		bufsize = len + 1;
+		buf = realloc(buf, bufsize);
+	}
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	/* The intern pool keeps them alive.  No need to hold references. */
+	Str *is = intern_cstr(buf);
+	str_decref(is);
+	return is;
+}
+
+/*
+ * Read the message at *p, in a log that ends at `end`, into `msg`, that lives
+ * in block `b`, and the hash of its event ID into *id.  Move *p past it.
+ * Return false if it is cut short or not a message, leaving *p alone.
+ */
+static bool parse_msg(const char **p, const char *end, struct msglog_block *b,
+	Msg *msg, uint64_t *id)
+{
+	const char *q = *p, *s;
+	size_t len;
+	if (q == end)
+		return false;
+	int type = (unsigned char)*q++;
+	if (type != MSGTYPE_TEXT && type != MSGTYPE_FILE
+	&& type != MSGTYPE_UNSUPPORTED)
+		return false;
+	if (!get_str(&q, end, &s, &len))
+		return false;
+	msg->type = type;
+	msg->sender = intern_bytes(s, len);
+	if (!get_str(&q, end, &s, &len))
+		return false;
+	*id = len ? id_hash(s, len) : 0;
+	if (type == MSGTYPE_TEXT) {
+		if (!get_str(&q, end, &s, &len))
+			return false;
+		msg->text.content = block_copy_cstr(b, s, len);
+	} else if (type == MSGTYPE_FILE) {
+		const char *uri;
+		size_t urilen;
+		if (!get_str(&q, end, &s, &len)
+		|| !get_str(&q, end, &uri, &urilen))
+			return false;
+		msg->fileinfo.mimetype = intern_bytes(s, len);
+		msg->fileinfo.uri = block_copy_cstr(b, uri, urilen);
+	}
+	*p = q;
+	return true;
+}
+
+/*
+ * Map bytes [from, to) of the log.  Return a pointer to byte `from`, or NULL
+ * on errors.  What to munmap(2) afterwards is stored in *map and *maplen.
+ */
+static const char *timeline_map(MsgLog *log, size_t from, size_t to,
+	void **map, size_t *maplen)
+{
+	assert(from < to);
+	FILE *f = NULL;
+	int fd = log->fd;
+	if (fd == -1) {
+		f = timeline_open(log, "log", "r");
+		if (!f)
+			return NULL;
+		fd = fileno(f);
+	}
+	size_t start = from & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+	*maplen = to - start;
+	*map = mmap(NULL, *maplen, PROT_READ, MAP_PRIVATE, fd, start);
+	if (f)
+		fclose(f);
+	if (*map == MAP_FAILED)
+		return NULL;
+	return (const char *)*map + (from - start);
+}
+
+/* Append offset `off` to the index, in memory and in the index file. */
+static void index_append(MsgLog *log, size_t off) {
+	log->offsets = realloc(log->offsets,
+		sizeof(size_t) * (log->noffsets + 1));
+	log->offsets[log->noffsets++] = off;
+
+	/* If this fails, the entry is rebuilt by the next timeline_load() */
+	FILE *f = timeline_open(log, "index", log->noffsets == 1 ? "w" : "a");
+	if (!f)
+		return;
+	uint64_t entry = off;
+	fwrite(&entry, sizeof(entry), 1, f);
+	fclose(f);
+}
+
+/* Write the whole index again, after timeline_load() fixed it. */
+static void index_rewrite(MsgLog *log) {
+	FILE *f = timeline_open(log, "index", "w");
+	if (!f)
+		return;
+	for (size_t i = 0; i < log->noffsets; i++) {
+		uint64_t entry = log->offsets[i];
+		fwrite(&entry, sizeof(entry), 1, f);
+	}
+	fclose(f);
+}
+
+/*
+ * Read the index file.  Keep the entries that make sense for a log of `size`
+ * bytes, and return how many entries the file had.
+ */
+static size_t index_load(MsgLog *log, size_t size) {
+	FILE *f = timeline_open(log, "index", "r");
+	if (!f)
+		return 0;
+	struct stat st;
+	size_t n = 0;
+	if (fstat(fileno(f), &st) == 0)
+		n = st.st_size / sizeof(uint64_t);
+	uint64_t *entries = malloc(sizeof(uint64_t) * (n + 1));
+	n = fread(entries, sizeof(uint64_t), n, f);
+	fclose(f);
+
+	log->offsets = malloc(sizeof(size_t) * (n + 1));
+	size_t prev = strlen(TIMELINE_MAGIC);
+	for (size_t i = 0; i < n; i++) {
+		if (entries[i] >= size || (i == 0 && entries[i] != prev)
+		|| (i > 0 && entries[i] <= prev))
+			break;
+		prev = log->offsets[log->noffsets++] = entries[i];
+	}
+	free(entries);
+	return n;
+}
+
+/*
+ * Load the tail of the timeline: the last block, and the one before it if the
+ * last one has few messages.  Older blocks are loaded on demand by
+ * msglog_load_older().
+ */
+static void timeline_load(MsgLog *log) {
+	size_t hdr = strlen(TIMELINE_MAGIC);
+	FILE *f = timeline_open(log, "log", "r");
+	if (!f)
+		return; /* A new room */
+	struct stat st;
+	char magic[sizeof(TIMELINE_MAGIC)];
+	bool ok = fstat(fileno(f), &st) == 0 && (size_t)st.st_size > hdr
+		&& fread(magic, 1, hdr, f) == hdr
+		&& memcmp(magic, TIMELINE_MAGIC, hdr) == 0;
+	fclose(f);
+	if (!ok)
+		return; /* Empty or not ours: it is written again from scratch */
+	size_t size = st.st_size;
+
+	size_t inindex = index_load(log, size);
+	if (log->noffsets == 0) {
+		log->offsets = realloc(log->offsets, sizeof(size_t));
+		log->offsets[log->noffsets++] = hdr;
+	}
+
+	/* Everything from the last block we know of */
+	size_t from = log->offsets[log->noffsets - 1];
+	void *map;
+	size_t maplen;
+	const char *start = timeline_map(log, from, size, &map, &maplen);
+	if (!start) {
+		/*
+		 * Nothing tells it is damaged, so leave it alone for the next
+		 * run, and keep this room in memory only
+		 */
+		free(log->key);
+		log->key = NULL;
+		return;
+	}
+	log->first = log->len = (log->noffsets - 1) << MSGLOG_BLOCK_SHIFT;
+	const char *p = start, *end = start + (size - from);
+	for (;;) {
+		/* Blocks the index missed */
+		if (log->len > log->first
+		&& (log->len & (MSGLOG_BLOCK_LEN - 1)) == 0
+		&& p < end) {
+			log->offsets = realloc(log->offsets,
+				sizeof(size_t) * (log->noffsets + 1));
+			log->offsets[log->noffsets++] = from + (p - start);
+		}
+		Msg *msg = append_slot(log);
+		struct msglog_block *b = log->blocks[log->nblocks - 1];
+		size_t bytes = b->bytes;
+		if (!parse_msg(&p, end, b, msg,
+		    &b->ids[log->len & (MSGLOG_BLOCK_LEN - 1)]))
+			break;
+		log->bytes += b->bytes - bytes;
+		log->len++;
+	}
+	size_t off = from + (p - start);
+	munmap(map, maplen);
+
+	if (off < size) {
+		/* Cut short by a crash: drop the torn record */
+		f = timeline_open(log, "log", "r+");
+		if (!f || ftruncate(fileno(f), off) != 0) {
+			/* Don't append after garbage.  Keep it in memory only */
+			free(log->key);
+			log->key = NULL;
+		}
+		if (f)
+			fclose(f);
+		if (log->len == log->first && log->noffsets > 0
+		&& log->offsets[log->noffsets - 1] == off)
+			log->noffsets--; /* Its block has no messages left */
+	}
+	log->size = off;
+	if (log->key && inindex != log->noffsets)
+		index_rewrite(log);
+
+	if (log->len - log->first < MSGLOG_BLOCK_LEN / 2) {
+		msglog_load_older(log);
+		log->pinned = false;
+	}
+	trim(log);
+}
+
+/*
+ * Append `msg`, message log->len - 1, whose event ID is `eventid` (NULL if
+ * none), to the log.  Return false on errors: the message is kept in
+ * log->pending and written with the next one.
+ */
+static bool timeline_write(MsgLog *log, const Msg *msg, const Str *eventid) {
+	/* The magic goes with the first message */
+	size_t hdr = log->size + log->npending ? 0 : strlen(TIMELINE_MAGIC);
+	size_t len = hdr + 1 + sizeof(uint32_t) + str_bytelen(msg->sender)
+		+ sizeof(uint32_t) + (eventid ? str_bytelen(eventid) : 0);
+	if (msg->type == MSGTYPE_TEXT)
+		len += sizeof(uint32_t) + str_bytelen(msg->text.content);
+	else if (msg->type == MSGTYPE_FILE)
+		len += 2 * sizeof(uint32_t) + str_bytelen(msg->fileinfo.mimetype)
+			+ str_bytelen(msg->fileinfo.uri);
+	log->pending = realloc(log->pending, log->npending + len);
+	char *p = log->pending + log->npending;
+	memcpy(p, TIMELINE_MAGIC, hdr);
+	p += hdr;
+	*p++ = msg->type;
+	put_str(&p, msg->sender);
+	put_str(&p, eventid);
+	if (msg->type == MSGTYPE_TEXT) {
+		put_str(&p, msg->text.content);
+	} else if (msg->type == MSGTYPE_FILE) {
+		put_str(&p, msg->fileinfo.mimetype);
+		put_str(&p, msg->fileinfo.uri);
+	}
+
+	/* Where it will be once written */
+	size_t off = log->size + log->npending + hdr;
+	log->npending += len;
+	if (((log->len - 1) & (MSGLOG_BLOCK_LEN - 1)) == 0)
+		index_append(log, off);
+
+	if (!timeline_open_log(log)
+	|| pwrite(log->fd, log->pending, log->npending, log->size)
+	   != (ssize_t)log->npending)
+		return false;
+	log->size += log->npending;
+	log->npending = 0;
+	free(log->pending);
+	log->pending = NULL;
+	return true;
+}
+
+/*
+ * Stop using the timeline of `log`, after it couldn't be written for too
+ * long.  Its messages are kept in memory only from now on.
+ */
+static void timeline_drop(MsgLog *log) {
+	fprintf(stderr, "%s: %zu bytes of messages not written, giving up\n",
+		log->key, log->npending);
+	free(log->key);
+	log->key = NULL;
+	timeline_close(log);
+	free(log->pending);
+	log->pending = NULL;
+	log->npending = 0;
+}
+
+static struct msglog_block *load_block(MsgLog *log, size_t n) {
+	size_t from = log->offsets[n];
+	size_t to = n + 1 < log->noffsets ? log->offsets[n + 1] : log->size;
+	void *map;
+	size_t maplen;
+	const char *start = timeline_map(log, from, to, &map, &maplen);
+	if (!start)
+		return NULL;
+	const char *p = start, *end = start + (to - from);
+	struct msglog_block *b = block_new();
+	bool ok = true;
+	for (size_t i = 0; ok && i < MSGLOG_BLOCK_LEN; i++)
+		ok = parse_msg(&p, end, b, &b->msgs[i], &b->ids[i]);
+	munmap(map, maplen);
+	if (!ok) {
+		block_free(b);
+		return NULL;
+	}
+	return b;
+}
+
+static bool over_limits(MsgLog *log) {
+	/* Keep at least max_msgs messages */
+	if (max_msgs && log->len - log->first >= max_msgs + MSGLOG_BLOCK_LEN)
+		return true;
+	if (max_bytes && log->bytes > max_bytes)
+		return true;
+	return false;
+}
+
+/*
+ * Free the oldest blocks while over the limits.  They are in the timeline
+ * already, unless it has no key.  The block we are appending to is never freed.
+ */
+static void trim(MsgLog *log) {
+	while (log->nblocks > 1 && over_limits(log)) {
+		/*
+		 * Blocks not written yet couldn't be loaded back.  The log has
+		 * been failing for over max_msgs messages (or max_bytes) then:
+		 * give up on it rather than growing forever.
+		 */
+		if (log->key
+		&& log->offsets[(log->first >> MSGLOG_BLOCK_SHIFT) + 1]
+		   > log->size)
+			timeline_drop(log);
+		struct msglog_block *b = log->blocks[0];
+		log->bytes -= b->bytes;
+		block_free(b);
+		log->nblocks--;
+		memmove(&log->blocks[0], &log->blocks[1],
+			sizeof(struct msglog_block *) * log->nblocks);
+		log->first += MSGLOG_BLOCK_LEN;
+	}
+}
+
+/* Trim `log`, even if older messages were loaded by msglog_load_older(). */
+void msglog_trim(MsgLog *log) {
+	log->pinned = false;
+	trim(log);
+}
+
+/* Return whether one of the last messages in memory has event ID hash `id`. */
+static bool recent_id(MsgLog *log, uint64_t id) {
+	size_t stop = log->len - log->first > MSGLOG_DEDUP_LEN
+		? log->len - MSGLOG_DEDUP_LEN : log->first;
+	for (size_t i = log->len; i > stop; i--) {
+		struct msglog_block *b =
+			log->blocks[(i - 1 - log->first) >> MSGLOG_BLOCK_SHIFT];
+		if (b->ids[(i - 1) & (MSGLOG_BLOCK_LEN - 1)] == id)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Append a copy of `m`, whose event ID is `eventid` (NULL if none), to `log`.
+ * Caller keeps the ownership of the strings in `m`.  Return the stored
+ * message, or NULL if it is one of the last ones already.
+ */
+Msg *msglog_append(MsgLog *log, Msg m, const Str *eventid) {
+	uint64_t id = 0;
+	if (eventid) {
+		id = id_hash(str_buf(eventid), str_bytelen(eventid));
+		if (recent_id(log, id))
+			return NULL;
+	}
+
+	Msg *msg = append_slot(log);
+	struct msglog_block *b = log->blocks[log->nblocks - 1];
+	size_t bytes = b->bytes;
+	block_set_msg(b, msg, m);
+	b->ids[log->len & (MSGLOG_BLOCK_LEN - 1)] = id;
+	log->bytes += b->bytes - bytes;
+	log->len++;
+
+	/* Report the first failure only.  It is retried with every message. */
+	bool failing = log->npending > 0;
+	if (log->key && !timeline_write(log, msg, eventid) && !failing)
+		perror("msglog_append()");
+
+	/* Don't drop history loaded by msglog_load_older().  See above. */
+	if (!log->pinned)
+		trim(log);
+	return msglog_at(log, log->len - 1);
+}
+
+/*
+ * Load the block of messages before msglog_first() back from the timeline.
+ * Return false if there are no older messages or they couldn't be loaded.
+ */
+bool msglog_load_older(MsgLog *log) {
+	if (log->first == 0 || !log->key)
+		return false;
+	size_t n = (log->first >> MSGLOG_BLOCK_SHIFT) - 1;
+	assert(n < log->noffsets);
+	struct msglog_block *b = load_block(log, n);
+	if (!b)
+		return false;
+	ensure_maxblocks(log);
+	memmove(&log->blocks[1], &log->blocks[0],
+		sizeof(struct msglog_block *) * log->nblocks);
+	log->blocks[0] = b;
+	log->nblocks++;
+	log->first -= MSGLOG_BLOCK_LEN;
+	log->bytes += b->bytes;
+	log->pinned = true;
+	return true;
+}
+
+void msglog_free(MsgLog *log) {
+	for (size_t i = 0; i < log->nblocks; i++)
+		block_free(log->blocks[i]);
+	free(log->blocks);
+	free(log->offsets);
+	free(log->pending);
+	free(log->key);
+	timeline_close(log);
+	free(log);
+}
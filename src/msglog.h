@@ -0,0 +1,74 @@
+#ifndef JANECHAT_MSGLOG_H
+#define JANECHAT_MSGLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define MSGLOG_BLOCK_SHIFT 8
+#define MSGLOG_BLOCK_LEN (1 << MSGLOG_BLOCK_SHIFT) /* Msgs per block */
+
+/* How many messages and bytes each room keeps in memory by default */
+#define MSGLOG_DEFAULT_MAX_MSGS 4096
+#define MSGLOG_DEFAULT_MAX_BYTES (16 * 1024 * 1024)
+
+/* How many of the last messages msglog_append() looks at for duplicates */
+#define MSGLOG_DEDUP_LEN (2 * MSGLOG_BLOCK_LEN)
+
+struct msglog_chunk;
+
+struct msglog_block {
+	Msg msgs[MSGLOG_BLOCK_LEN];
+	uint64_t ids[MSGLOG_BLOCK_LEN];	/* Hash of their event IDs, or 0 */
+	struct msglog_chunk *chunks;	/* Arena for the bodies of msgs */
+	size_t bytes;			/* Memory used by this block */
+};
+
+/*
+ * The messages of a room.  Only the most recent ones are kept in memory.  See
+ * msglog.c.
+ */
+struct MsgLog {
+	struct msglog_block **blocks; /* Blocks in memory, oldest first */
+	size_t nblocks;
+	size_t maxblocks;
+	size_t first;	/* Index of the first message in memory */
+	size_t len;	/* Number of messages, in memory or not */
+	size_t bytes;	/* Memory used by the blocks in memory */
+
+	char *key;	/* Cache key of the timeline. NULL to keep it in memory */
+	size_t size;	/* Bytes of the timeline log.  0 if not written yet */
+	int fd;		/* The timeline log, while open.  See msglog.c */
+	char *pending;	/* Records that couldn't be written to the log yet */
+	size_t npending;
+	size_t *offsets; /* Log offset of each block (the sparse index) */
+	size_t noffsets;
+	bool pinned;	/* Holds blocks of msglog_load_older(): don't trim */
+};
+
+typedef struct MsgLog MsgLog;
+
+void msglog_set_limits(size_t, size_t);
+MsgLog *msglog_new(const char *);
+Msg *msglog_append(MsgLog *, Msg, const Str *);
+bool msglog_load_older(MsgLog *);
+void msglog_trim(MsgLog *);
+void msglog_free(MsgLog *);
+
+static inline size_t msglog_len(const MsgLog *log) { return log->len; }
+static inline size_t msglog_first(const MsgLog *log) { return log->first; }
+
+/* The i-th message.  It must be in memory: msglog_first() <= i < len */
+static inline Msg *msglog_at(const MsgLog *log, size_t i) {
+	return &log->blocks[(i - log->first) >> MSGLOG_BLOCK_SHIFT]
+		->msgs[i & (MSGLOG_BLOCK_LEN - 1)];
+}
+
+/* Traverse the messages in memory. */
+#define MSGLOG_FOREACH(log, iter, i) \
+	for (i = msglog_first(log); \
+	     (i < msglog_len(log)) && (iter = msglog_at(log, i)); i++)
+
+#endif /* !JANECHAT_MSGLOG_H */
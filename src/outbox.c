@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "list.h"
+#include "outbox.h"
+#include "str.h"
+
+/**
+ * This file implements the outbox: the messages the user sent that the server
+ * has not acknowledged yet, oldest first.  matrix.c sends the one at the head,
+ * and only pops it when the server answers with its event ID.  If sending it
+ * fails, it is tried again later, waiting longer each time (see
+ * outbox_backoff()), and the messages after it wait for it, so they arrive in
+ * order.
+ *
+ * Each message has a transaction ID that is sent with it (PUT
+ * /rooms/{roomId}/send/m.room.message/{txnId}), so the server ignores the
+ * attempts after one that succeeded without us knowing, and so we recognize
+ * our message when the sync brings it back (its unsigned.transaction_id).
+ *
+ * The outbox is saved in the cache on every change, so what was not sent when
+ * janechat exits is sent on the next run.  Its format is, for each message:
+ *
+ *	<txnid> <roomid> <length of text in bytes>\n
+ *	<text>\n
+ */
+
+#define OUTBOX_CACHE_KEY "outbox"
+
+List *outbox_list = NULL; /* List<OutboxEntry> */
+
+static void outbox_save(void);
+
+/*
+ * Return a new transaction ID.  It has the time we started so IDs are not
+ * reused in later runs.
+ */
+Str *outbox_txnid_new(void) {
+	static time_t started = 0;
+	static unsigned long counter = 0;
+	char buf[64];
+	if (started == 0)
+		started = time(NULL);
+	snprintf(buf, sizeof(buf), "janechat.%lld.%lu", (long long)started,
+		counter++);
+	return str_new_cstr(buf);
+}
+
+static OutboxEntry *entry_new(const Str *txnid, const Str *roomid,
+	const Str *text)
+{
+	OutboxEntry *e = malloc(sizeof(OutboxEntry));
+	e->txnid = str_dup(txnid);
+	e->roomid = str_dup(roomid);
+	e->text = str_dup(text);
+	e->attempts = 0;
+	e->next_try = 0;
+	return e;
+}
+
+/* Load what was left in the outbox by previous runs.  Call it only once. */
+void outbox_load(void) {
+	if (!outbox_list)
+		outbox_list = list_new();
+
+	char *contents = cache_get_alloc(OUTBOX_CACHE_KEY);
+	if (!contents)
+		return;
+
+	char *p = contents;
+	char txnid[256], roomid[256];
+	size_t len;
+	int n;
+	while (sscanf(p, "%255s %255s %zu%n", txnid, roomid, &len, &n) == 3) {
+		p += n;
+		if (*p++ != '\n' || strlen(p) < len + 1 || p[len] != '\n')
+			break; /* Truncated */
+		Str *id = str_new_cstr(txnid);
+		Str *room = str_new_cstr(roomid);
+		Str *text = str_new();
+		str_append_cstr_bytelen(text, p, len);
+		list_append(outbox_list, entry_new(id, room, text));
+		str_decref(id);
+		str_decref(room);
+		str_decref(text);
+		p += len + 1;
+	}
+	free(contents);
+}
+
+/* Append a message to the outbox. */
+OutboxEntry *outbox_push(const Str *txnid, const Str *roomid, const Str *text) {
+	if (!outbox_list)
+		outbox_list = list_new();
+	OutboxEntry *e = entry_new(txnid, roomid, text);
+	list_append(outbox_list, e);
+	outbox_save();
+	return e;
+}
+
+/* The oldest message, or NULL if the outbox is empty. */
+OutboxEntry *outbox_head(void) {
+	if (!outbox_list || !outbox_list->head)
+		return NULL;
+	return outbox_list->head->val;
+}
+
+/* Remove the oldest message, once it was sent (or given up). */
+void outbox_pop(void) {
+	OutboxEntry *e = list_pop_head(outbox_list);
+	assert(e != NULL);
+	str_decref(e->txnid);
+	str_decref(e->roomid);
+	str_decref(e->text);
+	free(e);
+	outbox_save();
+}
+
+/*
+ * Account for a failed attempt to send `e` and return when (in loop_now()
+ * time, given as `now`) to try again.
+ */
+long long outbox_backoff(OutboxEntry *e, long long now) {
+	long long delay = OUTBOX_BACKOFF_MIN_MS;
+	for (unsigned i = 0; i < e->attempts && delay < OUTBOX_BACKOFF_MAX_MS;
+	    i++)
+		delay *= 2;
+	if (delay > OUTBOX_BACKOFF_MAX_MS)
+		delay = OUTBOX_BACKOFF_MAX_MS;
+	e->attempts++;
+	e->next_try = now + delay;
+	return e->next_try;
+}
+
+static void outbox_save(void) {
+	Str *s = str_new();
+	OutboxEntry *e;
+	LIST_FOREACH(outbox_list, e) {
+		char buf[32];
+		str_append_str(s, e->txnid);
+		str_append_cstr(s, " ");
+		str_append_str(s, e->roomid);
+		snprintf(buf, sizeof(buf), " %zu\n", str_bytelen(e->text));
+		str_append_cstr(s, buf);
+		str_append_str(s, e->text);
+		str_append_cstr(s, "\n");
+	}
+	cache_set(OUTBOX_CACHE_KEY, str_buf(s));
+	str_decref(s);
+}
@@ -0,0 +1,33 @@
+#ifndef JANECHAT_OUTBOX_H
+#define JANECHAT_OUTBOX_H
+
+#include "list.h"
+#include "str.h"
+
+/* Delays between attempts to send a message double from min up to max */
+#define OUTBOX_BACKOFF_MIN_MS 1000
+#define OUTBOX_BACKOFF_MAX_MS (60 * 1000)
+
+/* A message that the server has not acknowledged yet.  See outbox.c. */
+struct OutboxEntry {
+	Str *txnid;
+	Str *roomid;
+	Str *text;
+	unsigned attempts;	/* Failed attempts so far */
+	long long next_try;	/* Monotonic time in ms.  0 to send it now */
+};
+typedef struct OutboxEntry OutboxEntry;
+
+Str *outbox_txnid_new(void);
+void outbox_load(void);
+OutboxEntry *outbox_push(const Str *txnid, const Str *roomid, const Str *text);
+OutboxEntry *outbox_head(void);
+void outbox_pop(void);
+long long outbox_backoff(OutboxEntry *, long long now);
+
+extern List *outbox_list;
+
+/* Traverse the outbox, oldest first.  Only after outbox_load(). */
+#define OUTBOX_FOREACH(iter) LIST_FOREACH(outbox_list, iter)
+
+#endif /* !JANECHAT_OUTBOX_H */
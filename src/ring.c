@@ -0,0 +1,84 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+/* Assumed size of a cache line, to keep head and tail apart */
+#define RING_CACHELINE 64
+
+/**
+ * This file implements a lock-free single-producer single-consumer queue of
+ * fixed-size elements, used to pass events between the network thread and the
+ * main thread (see matrix.c).
+ *
+ * Elements are copied into a circular array of len slots, len being a power of
+ * two.  head and tail grow forever (they are only reduced modulo len when used
+ * as indexes), so the ring is empty when they are equal and full when they are
+ * len apart:
+ *
+ *          head              tail
+ *            v                 v
+ * +-----+-----+-----+-----+-----+-----+
+ * |     |  A  |  B  |  C  |     |     |
+ * +-----+-----+-----+-----+-----+-----+
+ *
+ * Only the consumer writes head and only the producer writes tail.  The
+ * producer copies the element into its slot before publishing the new tail
+ * with release semantics, and the consumer reads tail with acquire semantics
+ * before copying the element out, so it never sees a half-written slot.  The
+ * same goes for head in the opposite direction, so a slot is not reused before
+ * the consumer is done with it.
+ */
+
+struct Ring {
+	size_t len;
+	size_t elemsize;
+	size_t head;	/* Next slot to pop.  Written by the consumer */
+	char pad[RING_CACHELINE];
+	size_t tail;	/* Next slot to push.  Written by the producer */
+	char pad2[RING_CACHELINE];
+	char slots[];
+};
+
+/* Create a ring of `len` (a power of two) elements of `elemsize` bytes. */
+Ring *ring_new(size_t len, size_t elemsize) {
+	assert(len > 0 && (len & (len - 1)) == 0);
+	Ring *r = malloc(sizeof(Ring) + len * elemsize);
+	r->len = len;
+	r->elemsize = elemsize;
+	r->head = 0;
+	r->tail = 0;
+	return r;
+}
+
+/* Copy `elem` into the ring.  Return false if it is full.  Producer only. */
+bool ring_push(Ring *r, const void *elem) {
+	size_t tail = r->tail;
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->len)
+		return false;
+	memcpy(&r->slots[(tail & (r->len - 1)) * r->elemsize], elem,
+		r->elemsize);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Move the oldest element to `elem`.  Return false if empty.  Consumer only. */
+bool ring_pop(Ring *r, void *elem) {
+	size_t head = r->head;
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return false;
+	memcpy(elem, &r->slots[(head & (r->len - 1)) * r->elemsize],
+		r->elemsize);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Consumer only. */
+bool ring_empty(Ring *r) {
+	return r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+void ring_free(Ring *r) {
+	free(r);
+}
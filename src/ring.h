@@ -0,0 +1,15 @@
+#ifndef JANECHAT_RING_H
+#define JANECHAT_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct Ring Ring;
+
+Ring *ring_new(size_t len, size_t elemsize);
+bool ring_push(Ring *, const void *);
+bool ring_pop(Ring *, void *);
+bool ring_empty(Ring *);
+void ring_free(Ring *);
+
+#endif /* !JANECHAT_RING_H */
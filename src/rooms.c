@@ -1,20 +1,25 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "cache.h"
 #include "hash.h"
+#include "intern.h"
 #include "rooms.h"
+#include "users.h"
 
 Hash *rooms_hash;	/* Hash<const char *id, Room> */
 Vector *rooms_vector;	/* Vector<Room> */
 size_t count;		/* Number of rooms */
-Hash *users_hash;	/* Hash<const char *id, Str *> */
 
 void rooms_init(void) {
 	rooms_hash = hash_new();
 	rooms_vector = vector_new();
-	users_hash = hash_new();
 }
 
 /*
@@ -34,7 +39,15 @@ Room *room_new(Str *id, bool is_space) {
 		return room;
 	}
 	room = malloc(sizeof(Room));
-	room->id = str_incref(id);
+	room->id = intern_str(id);
+
+	/*
+	 * Messages are stored in "timeline/<room id>" in the cache.  Room IDs
+	 * are opaque and could have slashes, so replace them.
+	 */
+	Str *msgs_key = str_new_cstr("timeline/");
+	for (const char *c = str_buf(id); *c; c++)
+		str_append_cstr_bytelen(msgs_key, *c == '/' ? "_" : c, 1);
 	room->name = NULL;
 	room->displayname = NULL;
 	room->calculatedname = NULL;
@@ -42,10 +55,11 @@ Room *room_new(Str *id, bool is_space) {
 	room->is_space = is_space;
 	
 	room->users = vector_new();
-	room->msgs = vector_new();
+	room->msgs = msglog_new(str_buf(msgs_key));
+	str_decref(msgs_key);
 	room->unread_msgs = 0;
 	room->notify = true;
-	hash_insert(rooms_hash, str_buf(id), room);
+	hash_insert(rooms_hash, str_buf(room->id), room);
 	vector_append(rooms_vector, room);
 	return room;
 }
@@ -90,22 +104,26 @@ void room_set_info(Room *r, Str *sender, Str *name) {
 	if (!r)
 		return;
 
-	if (sender)
-		r->sender = str_incref(sender);
-	if (name)
-		r->name = str_incref(name);
+	/* They may be borrowed from a MatrixEvent, so keep copies */
+	if (sender) {
+		str_decref(r->sender);
+		r->sender = intern_str(sender);
+	}
+	if (name) {
+		str_decref(r->name);
+		r->name = str_dup(name);
+	}
 }
 
-void room_append_msg(Room *room, Msg m) {
-	Msg *msg = malloc(sizeof(Msg));
-	memcpy(msg, &m, sizeof(Msg));
-	str_incref(msg->sender);
-	if (msg->type == MSGTYPE_TEXT)
-		str_incref(msg->text.content);
-	else
-		str_incref(msg->fileinfo.uri);
-	vector_append(room->msgs, msg);
+/*
+ * Append `m`, whose event ID is `eventid` (NULL if none).  Return false if it
+ * was appended already (see msglog_append()).
+ */
+bool room_append_msg(Room *room, Msg m, const Str *eventid) {
+	if (!msglog_append(room->msgs, m, eventid))
+		return false;
 	room->unread_msgs++;
+	return true;
 }
 
 void room_append_user(Room *room, Str *sender) {
@@ -116,11 +134,11 @@ void room_append_user(Room *room, Str *sender) {
 	Str *iter;
 	size_t i;
 	VECTOR_FOREACH(room->users, iter, i) {
-		if (str_ss_eq(iter, sender))
+		if (iter == sender || str_ss_eq(iter, sender))
 			return;
 	}
 
-	vector_append(room->users, str_incref(sender));
+	vector_append(room->users, intern_str(sender));
 
 	/*
 	 * TODO: force the calculatedname to be recalculated when a user joins.
@@ -130,20 +148,223 @@ void room_append_user(Room *room, Str *sender) {
 	room->calculatedname = NULL;
 }
 
-void user_add(Str *id, Str *name) {
-	/*
-	 * Maybe the user didn't specify its human readable name. Store NULL in
-	 * users_hash anyway, so user_name() function returns the id for this
-	 * case.
-	 */
-	if (name)
-		str_incref(name);
-	hash_insert(users_hash, str_buf(id), name);
+/*
+ * Rooms can be saved to a snapshot with rooms_save() and loaded again with
+ * rooms_load(), so the next run doesn't need a full initial sync to know them
+ * (see matrix_sync_from()).  Messages and users are not part of it: they are
+ * kept by msglog.c and users.c.
+ *
+ * The snapshot is a file in the cache, made of fixed-size records that refer to
+ * a table of null-terminated strings by their offsets, so it is used right from
+ * the mmap(2)ed file instead of being parsed:
+ *
+ *	+--------+-------------+-------------+---------+
+ *	| header | rooms       | members     | strings |
+ *	|        | (rooms x    | (members x  |         |
+ *	|        | snap_room)  | uint32_t)   |         |
+ *	+--------+-------------+-------------+---------+
+ *
+ * A room's members are a range of the members array, whose items are offsets
+ * of user IDs.  Strings are stored once, however many records refer to them
+ * (e.g. users in many rooms).  Offset 0 is always an empty string and stands
+ * for NULL.  Everything is in native byte order: it is a cache, not a format
+ * to exchange.
+ *
+ * It is written to a temporary file first, that replaces the snapshot once it
+ * is on disk, so a crash leaves either the old or the new snapshot.
+ */
+
+#define SNAPSHOT_KEY "state/rooms"
+#define SNAPSHOT_TMP_KEY "state/rooms.tmp"
+#define SNAPSHOT_MAGIC "jcrooms2"
+
+struct snap_header {
+	char magic[8];		/* SNAPSHOT_MAGIC, without the null */
+	uint32_t rooms;		/* Number of struct snap_room */
+	uint32_t members;	/* Number of member offsets */
+	uint32_t strings;	/* Bytes of the string table */
+};
+
+/* Fields named after strings are offsets in the string table */
+struct snap_room {
+	uint32_t id;
+	uint32_t name;
+	uint32_t sender;
+	uint32_t displayname;
+	uint32_t first_member;	/* Index in the members array */
+	uint32_t nmembers;
+	uint8_t notify;
+	uint8_t is_space;
+	uint8_t pad[2];
+};
+
+/* A growing buffer for the sections of a snapshot being written */
+struct snap_buf {
+	char *buf;
+	size_t len;
+	size_t max;
+};
+
+static bool snap_write(FILE *f, const struct snap_buf *b) {
+	return b->len == 0 || fwrite(b->buf, 1, b->len, f) == b->len;
 }
 
-Str *user_name(Str *id) {
-	Str *name = hash_get(users_hash, str_buf(id));
-	if (!name)
-		return id;
-	return name;
+static void snap_append(struct snap_buf *b, const void *p, size_t len) {
+	if (b->len + len > b->max) {
+		b->max = (b->len + len) * 2;
+		b->buf = realloc(b->buf, b->max);
+	}
+	memcpy(b->buf + b->len, p, len);
+	b->len += len;
+}
+
+/* Return the offset of `s` in `strings`, appending it if it is not there. */
+static uint32_t snap_string(struct snap_buf *strings, Hash *offsets,
+	const Str *s)
+{
+	if (!s)
+		return 0;
+	uintptr_t off = (uintptr_t)hash_get(offsets, str_buf(s));
+	if (off)
+		return off;
+	off = strings->len;
+	snap_append(strings, str_buf(s), str_bytelen(s) + 1);
+	hash_insert(offsets, str_buf(s), (void *)off);
+	return off;
+}
+
+/* Write all rooms to the snapshot.  Return false on errors. */
+bool rooms_save(void) {
+	struct snap_buf recs = { NULL, 0, 0 }, members = { NULL, 0, 0 },
+		strings = { NULL, 0, 0 };
+	Hash *offsets = hash_new();
+	snap_append(&strings, "", 1);
+
+	Room *room;
+	size_t i, j;
+	uint32_t nmembers = 0;
+	ROOMS_FOREACH(room, i) {
+		struct snap_room r = {
+			.id = snap_string(&strings, offsets, room->id),
+			.name = snap_string(&strings, offsets, room->name),
+			.sender = snap_string(&strings, offsets, room->sender),
+			.displayname = snap_string(&strings, offsets,
+				room->displayname),
+			.first_member = nmembers,
+			.nmembers = vector_len(room->users),
+			.notify = room->notify,
+			.is_space = room->is_space,
+		};
+		snap_append(&recs, &r, sizeof(r));
+		Str *user;
+		ROOM_USERS_FOREACH(room, user, j) {
+			uint32_t off = snap_string(&strings, offsets, user);
+			snap_append(&members, &off, sizeof(off));
+		}
+		nmembers += r.nmembers;
+	}
+
+	hash_free(offsets);
+
+	struct snap_header h = {
+		.rooms = vector_len(rooms_vector),
+		.members = nmembers,
+		.strings = strings.len,
+	};
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+
+	bool ok = false;
+	FILE *f = cache_open(SNAPSHOT_TMP_KEY, "w");
+	if (f) {
+		ok = fwrite(&h, sizeof(h), 1, f) == 1 && snap_write(f, &recs)
+			&& snap_write(f, &members) && snap_write(f, &strings)
+			&& fflush(f) == 0 && fsync(fileno(f)) == 0;
+		ok = fclose(f) == 0 && ok;
+		ok = ok && cache_rename(SNAPSHOT_TMP_KEY, SNAPSHOT_KEY);
+	}
+	free(recs.buf);
+	free(members.buf);
+	free(strings.buf);
+	return ok;
+}
+
+/* Check that a snapshot of `len` bytes at `p` refers to nothing outside it. */
+static bool snapshot_valid(const char *p, size_t len) {
+	struct snap_header h;
+	if (len < sizeof(h))
+		return false;
+	memcpy(&h, p, sizeof(h));
+	if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0)
+		return false;
+	if (len != sizeof(h) + (size_t)h.rooms * sizeof(struct snap_room)
+	    + (size_t)h.members * sizeof(uint32_t) + h.strings)
+		return false;
+	const char *strings = p + len - h.strings;
+	if (h.strings == 0 || strings[0] != '\0'
+	    || strings[h.strings - 1] != '\0')
+		return false;
+
+	const struct snap_room *rooms = (const void *)(p + sizeof(h));
+	const uint32_t *members = (const void *)(rooms + h.rooms);
+	for (uint32_t i = 0; i < h.rooms; i++) {
+		const struct snap_room *r = &rooms[i];
+		if (r->id == 0 || r->id >= h.strings || r->name >= h.strings
+		    || r->sender >= h.strings || r->displayname >= h.strings
+		    || r->first_member > h.members
+		    || r->nmembers > h.members - r->first_member)
+			return false;
+	}
+	for (uint32_t i = 0; i < h.members; i++)
+		if (members[i] == 0 || members[i] >= h.strings)
+			return false;
+	return true;
+}
+
+/*
+ * Create the rooms of the snapshot.  Return false, having created
+ * nothing, if there is none or it is not valid.
+ */
+bool rooms_load(void) {
+	FILE *f = cache_open(SNAPSHOT_KEY, "r");
+	if (!f)
+		return false;
+	struct stat st;
+	char *p = MAP_FAILED;
+	if (fstat(fileno(f), &st) == 0 && st.st_size > 0)
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	fclose(f);
+	if (p == MAP_FAILED)
+		return false;
+	if (!snapshot_valid(p, st.st_size)) {
+		munmap(p, st.st_size);
+		return false;
+	}
+
+	struct snap_header h;
+	memcpy(&h, p, sizeof(h));
+	const struct snap_room *rooms = (const void *)(p + sizeof(h));
+	const uint32_t *members = (const void *)(rooms + h.rooms);
+	const char *strings = p + st.st_size - h.strings;
+#define SNAP_STR(view, off) ((off) ? str_view(view, strings + (off)) : NULL)
+
+	Str v1, v2;
+	for (uint32_t i = 0; i < h.rooms; i++) {
+		const struct snap_room *r = &rooms[i];
+		Room *room = room_new(SNAP_STR(&v1, r->id), r->is_space);
+		room_set_info(room, SNAP_STR(&v1, r->sender),
+			SNAP_STR(&v2, r->name));
+		if (r->displayname) {
+			Str *displayname = str_new_cstr(strings + r->displayname);
+			room_set_displayname(room, displayname);
+			str_decref(displayname);
+		}
+		room->notify = r->notify;
+		for (uint32_t j = 0; j < r->nmembers; j++)
+			room_append_user(room,
+				SNAP_STR(&v1, members[r->first_member + j]));
+	}
+#undef SNAP_STR
+
+	munmap(p, st.st_size);
+	return true;
 }
@@ -2,6 +2,7 @@
 #define JANECHAT_ROOMS_H
 
 #include "common.h"
+#include "msglog.h"
 #include "vector.h"
 #include "str.h"
 
@@ -34,7 +35,7 @@ struct Room {
         Str *calculatedname;
 
 	Vector *users;		/* Vector of joined users: Vector<Str*> */
-	Vector *msgs;
+	MsgLog *msgs;
 	size_t unread_msgs;	/* Should be reset by the caller */
 	bool notify;
 	bool is_space;
@@ -47,15 +48,15 @@ Room *room_byid(const Str *);
 Str *room_displayname(Room *);
 void room_set_displayname(Room *, Str *);
 void room_set_info(Room *, Str *, Str *);
-void room_append_msg(Room *, Msg msg);
+bool room_append_msg(Room *, Msg msg, const Str *eventid);
 void room_append_user(Room *, Str *);
 
-void user_add(Str *, Str *);
-Str *user_name(Str *);
+bool rooms_save(void);
+bool rooms_load(void);
 
 extern Vector *rooms_vector;
 
-#define ROOM_MESSAGES_FOREACH(r, iter, i) VECTOR_FOREACH(r->msgs, iter, i)
+#define ROOM_MESSAGES_FOREACH(r, iter, i) MSGLOG_FOREACH(r->msgs, iter, i)
 #define ROOM_USERS_FOREACH(r, iter, i) VECTOR_FOREACH(r->users, iter, i)
 #define ROOMS_FOREACH(iter, i) VECTOR_FOREACH(rooms_vector, iter, i)
 
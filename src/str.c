@@ -6,40 +6,54 @@
 #include "str.h"
 #include "utils.h"
 
-#define INITSIZE 256
+/*
+ * Initial size for strings created with str_new(), that are expected to grow
+ * (e.g. input buffers).  Small, so Str objects that are never filled don't
+ * waste memory.
+ */
+#define STR_INITSIZE 15
 
 /* Grow a Str internal buffer object at least `delta` bytes. */
 static void grow(Str *s, size_t delta) {
 	size_t min = s->bytelen + delta;
+	if (s->max >= min)
+		return;
+	if (s->max == 0)
+		s->max = 1;
 	while (s->max < min)
 		s->max *= 2;
 	/* +1 for null byte */
-	s->buf = realloc(s->buf, (sizeof(char) * s->max) + 1);
+	if (s->buf == s->inl) {
+		/* Move out of the initial buffer */
+		s->buf = malloc((sizeof(char) * s->max) + 1);
+		memcpy(s->buf, s->inl, s->bytelen + 1);
+	} else {
+		s->buf = realloc(s->buf, (sizeof(char) * s->max) + 1);
+	}
 }
 
 Str *str_new(void) {
-	return str_new_bytelen(INITSIZE);
+	return str_new_bytelen(STR_INITSIZE);
 }
 
 Str *str_new_cstr(const char *s) {
-	Str *ss = str_new();
+	Str *ss = str_new_bytelen(strlen(s));
 	str_append_cstr(ss, s);
 	return ss;
 }
 
 Str *str_new_cstr_fixed(const char *s) {
-	Str *ss = malloc(sizeof(struct Str));
-	ss->buf = strdup(s); 
-	ss->bytelen = strlen(s);
-	ss->max = ss->bytelen;
-	ss->rc = 1;
+	size_t len = strlen(s);
+	Str *ss = str_new_bytelen(len);
+	memcpy(ss->buf, s, len + 1);
+	ss->bytelen = len;
 	return ss;
 }
 
 Str *str_new_bytelen(size_t len) {
 	Str *ss;
-	ss = malloc(sizeof(struct Str));
-	ss->buf = malloc(sizeof(char) * len + 1); /* +1 for null byte */
+	ss = malloc(str_size_for(len));
+	ss->buf = ss->inl;
 	ss->buf[0] = '\0';
 	ss->bytelen = 0;
 	ss->max = len;
@@ -47,6 +61,30 @@ Str *str_new_bytelen(size_t len) {
 	return ss;
 }
 
+/* Bytes needed for a Str object holding a string of `len` bytes. */
+size_t str_size_for(size_t len) {
+	return sizeof(struct Str) + sizeof(char) * len + 1; /* +1 for null byte */
+}
+
+/*
+ * Construct a Str holding the first `len` bytes of `s` in `mem`, that must be
+ * at least str_size_for(len) bytes long and suitably aligned.  This is used by
+ * allocators that manage their own memory (e.g. msglog.c).  The memory belongs
+ * to the caller, so the Str starts with a reference that is never released:
+ * str_decref() never frees it, as long as the callers' incref and decref calls
+ * are balanced.  It must not be modified.
+ */
+Str *str_new_cstr_at(void *mem, const char *s, size_t len) {
+	Str *ss = mem;
+	ss->buf = ss->inl;
+	memcpy(ss->buf, s, len);
+	ss->buf[len] = '\0';
+	ss->bytelen = len;
+	ss->max = len;
+	ss->rc = 1;
+	return ss;
+}
+
 size_t str_utf8len(const Str *s) {
 	size_t sz;
 	size_t len = 0;
@@ -87,18 +125,25 @@ void str_append_cstr_bytelen(Str *ss, const char *s, size_t len) {
 	*sb = '\0';
 }
 
+/*
+ * Str objects are passed between the network thread and the main thread (see
+ * matrix.c), so the reference count is updated atomically.  The thread that
+ * drops the last reference frees the Str, so it must see every write the
+ * other threads made to it before dropping theirs: hence the acquire-release
+ * ordering of the decrement.  Taking a reference needs no ordering at all.
+ */
 Str *str_incref(Str *ss) {
-	ss->rc++;
+	__atomic_fetch_add(&ss->rc, 1, __ATOMIC_RELAXED);
 	return ss;
 }
 
 void str_decref(Str *ss) {
 	if (!ss)
 		return;
-	ss->rc--;
-	if (ss->rc > 0)
+	if (__atomic_sub_fetch(&ss->rc, 1, __ATOMIC_ACQ_REL) > 0)
 		return;
-	free(ss->buf);
+	if (ss->buf != ss->inl)
+		free(ss->buf);
 	free(ss);
 }
 
@@ -9,12 +9,18 @@
  * Fat pointer to our String type.  buf length is max+1, because we always make
  * room for the nullbyte, but don't count it in len and max.  Str objects are
  * always guaranteed to have null-terminated strings.
+ *
+ * The initial buffer is allocated together with the Str object itself (inl),
+ * sized to what the constructor was asked for.  buf points to it until the
+ * string outgrows it, when it is moved to a separate heap buffer.  So most Str
+ * objects, which are never modified after created, cost a single allocation.
  */
 struct Str {
 	char *buf;	/* Buffer that store string (always with null byte) */
 	size_t bytelen;	/* Length of string in buf (don't count null byte )*/
 	size_t max;	/* Length of buf - 1 (cause we don't count null byte */
-	int rc;		/* Reference count */
+	int rc;		/* Reference count.  Updated atomically */
+	char inl[];	/* Initial buffer */
 };
 typedef struct Str Str;
 
@@ -41,6 +47,8 @@ Str *str_new(void);
 Str *str_new_cstr(const char *);
 Str *str_new_cstr_fixed(const char *);
 Str *str_new_bytelen(size_t len);
+size_t str_size_for(size_t len);
+Str *str_new_cstr_at(void *, const char *, size_t len);
 size_t str_utf8len(const Str *);
 void str_append_str(Str *ss, const Str *s);
 void str_append_cstr(Str *ss, const char *s);
@@ -56,6 +64,20 @@ Utf8Char str_utf8char_at(const Str *, struct str_utf8_index);
 void str_remove_utf8char_at(Str *, struct str_utf8_index);
 bool str_starts_with_cstr(Str *, const char *);
 
+/*
+ * Make `view` a Str that borrows the null-terminated string `s` instead of
+ * copying it, so it costs no allocation.  It is valid as long as `s` is.  It
+ * must not be modified, increfed or decrefed: whoever wants to keep it makes a
+ * copy (e.g. with str_dup() or intern_str()).  See MatrixEvent.
+ */
+static inline Str *str_view(Str *view, const char *s) {
+	view->buf = (char *)s;
+	view->bytelen = strlen(s);
+	view->max = view->bytelen;
+	view->rc = 1;
+	return view;
+}
+
 static inline const char *str_buf(const Str *s) {
 	return s->buf;
 }
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "users.h"
 #include "utils.h"
 #include "ui-cli.h"
 
@@ -9,6 +10,7 @@ Room *current_room = NULL;
 
 static void process_input(char *);
 static void print_messages(Room *room);
+static void print_range(Room *room, size_t from, size_t to);
 static void print_msg(Str *roomname, Str *sender, Str *text);
 
 void ui_cli_iter(void) {
@@ -32,6 +34,16 @@ void ui_cli_msg_new(Room *room, Msg msg) {
 	room->unread_msgs = 0;
 }
 
+void ui_cli_msgs_batch(const UiBatch *batch) {
+	for (size_t i = 0; i < batch->len; i++) {
+		struct UiBatchRoom *r = &batch->rooms[i];
+		if (r->room != current_room)
+			continue;
+		print_range(r->room, r->first, r->first + r->count);
+		r->room->unread_msgs = 0;
+	}
+}
+
 /*
  * For now, possible commands are:
  *
@@ -122,9 +134,16 @@ void process_input(char *s) {
 }
 
 static void print_messages(Room *room) {
-	Msg *msg;
-	size_t i;
-	ROOM_MESSAGES_FOREACH(room, msg, i) {
+	print_range(room, 0, msglog_len(room->msgs));
+	room->unread_msgs = 0;
+}
+
+/* Print messages [from, to) of room, skipping the ones not in memory */
+static void print_range(Room *room, size_t from, size_t to) {
+	if (from < msglog_first(room->msgs))
+		from = msglog_first(room->msgs);
+	for (size_t i = from; i < to; i++) {
+		Msg *msg = msglog_at(room->msgs, i);
 		if (msg->type == MSGTYPE_TEXT)
 			print_msg(room_displayname(room),
 				msg->sender, msg->text.content);
@@ -132,7 +151,6 @@ static void print_messages(Room *room) {
 			print_msg(room_displayname(room),
 				msg->sender, msg->fileinfo.uri);
 	}
-	room->unread_msgs = 0;
 }
 
 static void print_msg(Str *roomname, Str *sender, Str *text) {
@@ -6,5 +6,6 @@
 
 void ui_cli_iter(void);
 void ui_cli_msg_new(Room *room, Msg msg);
+void ui_cli_msgs_batch(const UiBatch *batch);
 
 #endif
@@ -5,14 +5,19 @@
 #include <locale.h>
 #include <regex.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wchar.h>
 #include <curses.h>
 
+#include "loop.h"
 #include "ui.h"
 #include "ui-curses.h"
 #include "rooms.h"
 #include "str.h"
+#include "users.h"
 #include "vector.h"
 #include "utils.h"
 
@@ -20,11 +25,23 @@
 #define CTRL(x) (x & 037)
 
 /*
- * TODO: ncurses under NetBSD seem to support 32767 lines for a pad. Is it
- * possible to increase it? Can it be smaller on other platforms?  What do we do
- * if we reach this limit? (currently it fails when calling prefresh().
+ * ncurses under NetBSD seem to support 32767 lines for a pad.  The wmsgs pad
+ * only holds the messages around the visible part of the room (see
+ * chat_pad_draw()), so we only get close to it with huge messages, that are
+ * cut.
  */
-#define MAXY 32767 /* Max lines we allow to be shown in the terminal */
+#define MAXY 32767 /* Max lines of the wmsgs pad */
+#define PAD_SCREENS 4 /* wmsgs pad height, in screens */
+
+/*
+ * How a message is wrapped in wmsgs.  Its text (see chat_msg_text()) takes
+ * `lines` lines, line r starting at byte breaks[r].  breaks is NULL if it takes
+ * a single line.
+ */
+struct msg_layout {
+	int lines;
+	uint32_t *breaks;
+};
 
 /*
  * We call the data structure that holds the room information for the UI as
@@ -51,6 +68,19 @@ struct buffer {
 	 * disabled.
 	 */
 	int user_separator;
+
+	/*
+	 * Layout cache of the messages of the room in memory, for a wmsgs
+	 * window layout_width columns wide (0 if empty) and the display names
+	 * of users_generation() == layout_names: layout[i - layout_first] is
+	 * the layout of message i.  See chat_layout_sync().
+	 */
+	struct msg_layout *layout;
+	size_t layout_first;
+	size_t layout_len;
+	size_t layout_max;
+	int layout_width;
+	unsigned long layout_names;
 };
 
 bool curses_init = false; /* Did we started curses? */
@@ -88,25 +118,68 @@ size_t top = 0;
 size_t bottom = 0;
 
 /*
- * First line to be displayed in wmsgs pad when calling prefresh() function. -1
- * if we should display the last message.
+ * The chat window only lays out and draws the messages it shows, so its cost
+ * doesn't depend on how many messages the room has.  To know which messages
+ * are visible without drawing them, each buffer caches the layout of its
+ * messages.
  */
-int top_line;
 
 /*
- * Position of the cursor after drawing the last line of wmsgs. I.e., the height
- * of the wmsgs window, considering the last valid character.
+ * The first line shown is line top_off of message top_msg.  If follow is true,
+ * we show the last lines of the room instead, i.e., "autoscroll" or "update
+ * history scroll automatically on new messages".
  */
-int last_line_y;
+bool follow = true;
+size_t top_msg;
+int top_off;
+
+/*
+ * What wmsgs pad holds: messages [pad_top, pad_next) drawn from its first
+ * line, taking pad_lines lines.  The pad is only a few screens tall.  New
+ * messages are appended while they fit.  pad_valid is false if the pad needs
+ * to be drawn again.
+ */
+bool pad_valid = false;
+size_t pad_top;
+size_t pad_next;
+int pad_lines;
+int pad_height;
+
+/*
+ * Windows are not refreshed as soon as they change.  Instead, they are marked
+ * dirty with ui_dirty() and render() refreshes all of them at once, with
+ * wnoutrefresh() and a single doupdate(), at most once every FRAME_MS.  So a
+ * keystroke or a burst of messages from a /sync costs one terminal update, not
+ * one per window and message.
+ */
+#define FRAME_MS 33
+
+enum {
+	DIRTY_INDEX = 1 << 0,
+	DIRTY_MSGS = 1 << 1,
+	DIRTY_STATUS = 1 << 2,
+	DIRTY_INPUT = 1 << 3,
+};
+
+int dirty = 0;
+LoopTimer *render_timer;
+bool render_scheduled = false;
+long long last_render = 0;
+
+/* Line of wmsgs shown at the top of the screen.  See chat_msgs_show(). */
+int pad_show_row;
 
 void input_redraw(void);
 void set_focus(enum Focus);
+void ui_dirty(int);
 void index_draw(void);
 void resize(void);
 void index_update_top_bottom(void);
 void input_clear(void);
 void chat_draw_statusbar(void);
 void chat_msgs_fill(void);
+void chat_msgs_append(void);
+void chat_msgs_show(void);
 
 /*
  * A SIGINT handler. We use Ctrl-C to cleanup buffer input, so we need to
@@ -157,13 +230,16 @@ void set_cur_buffer(struct buffer *buffers) {
 	cur_buffer->left = 0;
 	if (cur_buffer->room)
 		cur_buffer->room->unread_msgs = 0;
-	top_line = -1;
+	follow = true;
 }
 
 void set_focus(enum Focus f) {
 	focus = f;
 	switch (focus) {
 	case FOCUS_INDEX:
+		/* Forget the history we loaded while scrolling back */
+		if (cur_buffer && cur_buffer->room)
+			msglog_trim(cur_buffer->room->msgs);
 		if (autopilot) {
 			/* Find the first buffer with unread messages */
 			struct buffer *b;
@@ -181,11 +257,10 @@ void set_focus(enum Focus f) {
 		cur_buffer = &index_input_buffer;
 		focus = FOCUS_INDEX;
 		index_draw();
-		wrefresh(windex);
 		break;
 	case FOCUS_INDEX_INPUT:
 		wmove(winput, 0, 0);
-		wrefresh(winput);
+		ui_dirty(DIRTY_INPUT);
 		break;
 	case FOCUS_CHAT_INPUT:
 		chat_msgs_fill();
@@ -201,8 +276,12 @@ void resize(void) {
 	clear();
 	getmaxyx(stdscr, maxy, maxx);
 
+	/* Messages are wrapped again (see chat_layout_sync()) */
+	pad_valid = false;
+
 	wresize(windex, maxy-1, maxx);
-	wresize(wmsgs, MAXY, maxx);
+	pad_height = PAD_SCREENS * (maxy-2);
+	wresize(wmsgs, pad_height, maxx);
 	mvwin(wstatus, maxy-2, 0);
 	wresize(wstatus, 1, maxx);
 
@@ -320,7 +399,7 @@ void index_draw(void) {
 		if (tb->room->unread_msgs > 0 && tb->room->notify)
 			wattroff(windex, A_BOLD);
 	}
-	wrefresh(windex);
+	ui_dirty(DIRTY_INDEX);
 }
 
 regex_t re;
@@ -423,125 +502,421 @@ void chat_draw_statusbar(void) {
 	Str *roomname = room_displayname(cur_buffer->room);
 	mvwprintw(wstatus, 0, 0, "%s", str_buf(roomname));
 	mvwhline(wstatus, 0, str_bytelen(roomname), ' ', maxx);
-	wrefresh(wstatus);
+	ui_dirty(DIRTY_STATUS);
 }
 
-void chat_msgs_fill(void) {
-	werase(wmsgs);
-	wrefresh(wmsgs);
+/* Number of columns the character at `s` takes.  See chat_draw_text(). */
+int char_width(const char *s, size_t len) {
+	wchar_t wc;
+	unsigned char c = *s;
+	if (c < 0x20 || c == 0x7f)
+		return 2; /* Shown as ^X */
+	if (mbtowc(&wc, s, len) <= 0)
+		return 1;
+	int w = wcwidth(wc);
+	return w < 0 ? 1 : w;
+}
 
-	Msg *msg;
-	size_t i;
-	ROOM_MESSAGES_FOREACH(cur_buffer->room, msg, i) {
-		/*
-		 * TODO: it currently doesn't render separators after last
-		 * message
-		 */
-		if (cur_buffer->read_separator == i
-		&&  cur_buffer->read_separator != (int)vector_len(cur_buffer->room->msgs)) {
+/*
+ * Return the text of message `i` as shown in wmsgs, in a buffer reused between
+ * calls.  The first `*hlen` bytes are its header, "[i] sender".
+ */
+const char *chat_msg_text(size_t i, Msg *msg, size_t *len, size_t *hlen) {
+	static Str *text = NULL;
+	char index[32];
+	if (!text)
+		text = str_new();
+	str_reset(text);
+	snprintf(index, sizeof(index), "[%zu] ", i);
+	str_append_cstr(text, index);
+	str_append_str(text, user_name(msg->sender));
+	*hlen = str_bytelen(text);
+	str_append_cstr(text, ": ");
+	if (msg->type == MSGTYPE_TEXT) {
+		str_append_str(text, msg->text.content);
+	} else {
+		str_append_str(text, msg->fileinfo.mimetype);
+		str_append_cstr(text, ": ");
+		str_append_str(text, msg->fileinfo.uri);
+	}
+	*len = str_bytelen(text);
+	return str_buf(text);
+}
+
+/*
+ * Wrap `text` in lines `width` columns wide and store where lines start in
+ * `l`.  Lines end at '\n' or before the character that doesn't fit.
+ */
+void chat_msg_layout(struct msg_layout *l, const char *text, size_t len,
+	int width)
+{
+	static uint32_t *starts = NULL;
+	static size_t maxstarts = 0;
+	size_t n = 0;
+	int x = 0;
+
+#define ADD_START(pos) do { \
+	if (n == maxstarts) { \
+		maxstarts = maxstarts ? maxstarts * 2 : 16; \
+		starts = realloc(starts, sizeof(uint32_t) * maxstarts); \
+	} \
+	starts[n++] = (pos); \
+} while (0)
+
+	ADD_START(0);
+	for (size_t p = 0; p < len; ) {
+		size_t sz = utf8_char_size(text[p]);
+		if (p + sz > len)
+			sz = len - p;
+		if (text[p] == '\n') {
+			p += sz;
+			ADD_START(p);
+			x = 0;
+			continue;
+		}
+		int w = text[p] == '\t' ? 1 : char_width(&text[p], sz);
+		if (x >= width || (x > 0 && x + w > width)) {
+			ADD_START(p);
+			x = 0;
+		}
+		if (text[p] == '\t') {
+			/* Tabs stop at the end of the line */
+			w = 8 - x % 8;
+			if (x + w > width)
+				w = width - x;
+		}
+		x += w;
+		p += sz;
+	}
+#undef ADD_START
+
+	l->lines = n;
+	l->breaks = NULL;
+	if (n > 1) {
+		l->breaks = malloc(sizeof(uint32_t) * n);
+		memcpy(l->breaks, starts, sizeof(uint32_t) * n);
+	}
+}
+
+/*
+ * Draw `len` bytes of `text` at the cursor position, that must fit in the
+ * line.  Tabs and control characters are drawn here, so they take the columns
+ * chat_msg_layout() expects, whatever curses does with them.
+ */
+void chat_draw_text(const char *text, size_t len) {
+	const char *run = text;
+	const char *end = text + len;
+	for (const char *p = text; p < end; p++) {
+		unsigned char c = *p;
+		if (c >= 0x20 && c != 0x7f)
+			continue;
+		waddnstr(wmsgs, run, p - run);
+		if (c == '\t') {
+			int x = getcurx(wmsgs);
+			int w = 8 - x % 8;
+			if (x + w > getmaxx(wmsgs))
+				w = getmaxx(wmsgs) - x;
+			while (w-- > 0)
+				waddch(wmsgs, ' ');
+		} else {
+			waddch(wmsgs, '^');
+			waddch(wmsgs, c ^ 0x40);
+		}
+		run = p + 1;
+	}
+	waddnstr(wmsgs, run, end - run);
+}
+
+/* Number of separator lines drawn above message `i`. */
+int chat_msg_separators(size_t i) {
+	/*
+	 * TODO: it currently doesn't render separators after last
+	 * message
+	 */
+	int lines = 0;
+	if (cur_buffer->read_separator == (int)i
+	&&  cur_buffer->read_separator != (int)msglog_len(cur_buffer->room->msgs))
+		lines++;
+	if (cur_buffer->user_separator == (int)i)
+		lines++;
+	return lines;
+}
+
+struct msg_layout *chat_layout(size_t i) {
+	return &cur_buffer->layout[i - cur_buffer->layout_first];
+}
+
+/* Number of lines message `i` takes in wmsgs, including separators. */
+int chat_height(size_t i) {
+	return chat_msg_separators(i) + chat_layout(i)->lines;
+}
+
+/* Draw message `i` in wmsgs, starting at line `y`. */
+void chat_msg_draw(size_t i, Msg *msg, int y) {
+	if (cur_buffer->read_separator == (int)i
+	&&  cur_buffer->read_separator != (int)msglog_len(cur_buffer->room->msgs)) {
+		wattron(wmsgs, COLOR_PAIR(1));
+		mvwaddstr(wmsgs, y++, 0, "-----");
+		wattroff(wmsgs, COLOR_PAIR(1));
+	}
+	if (cur_buffer->user_separator == (int)i) {
+		wattron(wmsgs, COLOR_PAIR(2));
+		mvwaddstr(wmsgs, y++, 0, "-----");
+		wattroff(wmsgs, COLOR_PAIR(2));
+	}
+
+	size_t len, hlen;
+	const char *text = chat_msg_text(i, msg, &len, &hlen);
+	struct msg_layout *l = chat_layout(i);
+	for (int r = 0; r < l->lines; r++) {
+		size_t start = l->breaks ? l->breaks[r] : 0;
+		size_t end = r + 1 < l->lines ? l->breaks[r+1] : len;
+		if (end > start && text[end-1] == '\n')
+			end--;
+		if (wmove(wmsgs, y + r, 0) == ERR)
+			break;
+		if (start < hlen) {
+			size_t hend = end < hlen ? end : hlen;
 			wattron(wmsgs, COLOR_PAIR(1));
-			waddstr(wmsgs, "-----\n");
+			chat_draw_text(text + start, hend - start);
+			/* TODO: why does it set background to COLOR_BLACK? */
 			wattroff(wmsgs, COLOR_PAIR(1));
+			start = hend;
 		}
-		if (cur_buffer->user_separator == i) {
-			wattron(wmsgs, COLOR_PAIR(2));
-			waddstr(wmsgs, "-----\n");
-			wattroff(wmsgs, COLOR_PAIR(2));
+		chat_draw_text(text + start, end - start);
+	}
+}
+
+void chat_layout_msg(struct msg_layout *l, size_t i, Msg *msg, int width) {
+	size_t len, hlen;
+	const char *text = chat_msg_text(i, msg, &len, &hlen);
+	chat_msg_layout(l, text, len, width);
+}
+
+/*
+ * Bring the layout cache of the current buffer up to date with the messages of
+ * its room in memory: messages can be appended, dropped from memory or loaded
+ * back (see msglog.c).  Layouts are only computed again if the width of the
+ * terminal changes or a display name does, since headers show them.
+ */
+void chat_layout_sync(void) {
+	struct buffer *b = cur_buffer;
+	MsgLog *msgs = b->room->msgs;
+	size_t first = msglog_first(msgs);
+	size_t len = msglog_len(msgs);
+	int width = getmaxx(stdscr);
+	size_t i;
+
+	if (b->layout_width != width || b->layout_names != users_generation()) {
+		for (i = 0; i < b->layout_len; i++)
+			free(b->layout[i].breaks);
+		b->layout_len = 0;
+		b->layout_first = first;
+		b->layout_width = width;
+		b->layout_names = users_generation();
+		pad_valid = false;
+	}
+
+	if (first > b->layout_first) {
+		size_t drop = first - b->layout_first;
+		if (drop > b->layout_len)
+			drop = b->layout_len;
+		for (i = 0; i < drop; i++)
+			free(b->layout[i].breaks);
+		b->layout_len -= drop;
+		memmove(b->layout, b->layout + drop,
+			sizeof(struct msg_layout) * b->layout_len);
+		b->layout_first = first;
+		pad_valid = false;
+		if (top_msg < first) {
+			top_msg = first;
+			top_off = 0;
 		}
+	}
 
-		wattron(wmsgs, COLOR_PAIR(1));
-		wprintw(wmsgs, "[%zu] %s", i,
-			str_buf(user_name(msg->sender)));
+	if (len - first > b->layout_max) {
+		b->layout_max = len - first > b->layout_max * 2 ?
+			len - first : b->layout_max * 2;
+		b->layout = realloc(b->layout,
+			sizeof(struct msg_layout) * b->layout_max);
+	}
 
-		/* TODO: why does it set background to COLOR_BLACK? */
-		wattroff(wmsgs, COLOR_PAIR(1));
+	if (first < b->layout_first) {
+		size_t add = b->layout_first - first;
+		memmove(b->layout + add, b->layout,
+			sizeof(struct msg_layout) * b->layout_len);
+		for (i = first; i < b->layout_first; i++)
+			chat_layout_msg(&b->layout[i - first], i,
+				msglog_at(msgs, i), width);
+		b->layout_len += add;
+		b->layout_first = first;
+	}
 
-		if (msg->type == MSGTYPE_TEXT)
-			wprintw(wmsgs, ": %s\n", str_buf(msg->text.content));
-		else
-			wprintw(wmsgs, ": %s: %s\n",
-				str_buf(msg->fileinfo.mimetype),
-				str_buf(msg->fileinfo.uri));
+	for (i = b->layout_first + b->layout_len; i < len; i++)
+		chat_layout_msg(&b->layout[b->layout_len++], i,
+			msglog_at(msgs, i), width);
+}
 
+/* Set top_msg and top_off to show the last `maxy` lines of the room. */
+void chat_view_bottom(int maxy) {
+	size_t i = cur_buffer->layout_first + cur_buffer->layout_len;
+	int lines = 0;
+	while (i > cur_buffer->layout_first && lines < maxy) {
+		i--;
+		lines += chat_height(i);
 	}
+	top_msg = i;
+	top_off = lines > maxy ? lines - maxy : 0;
+}
 
-	/*
-	 * After drawing wmsgs window, get cursor vertical position within the
-	 * wmsgs window, so we know the wmsgs window height exactly.
-	 *
-	 * This seems the correctly place to call getcury(). Before that, we
-	 * were calling it in chat_msgs_scroll() when we needed the value, but
-	 * we couldn't make sure of the cursor position at that point. Worse:
-	 * Linux and NetBSD curses seem to return different values for that
-	 * situation because one put the cursor at the top and the other at
-	 * the bottom of the screen, after prefresh()'ing. Now, by placing
-	 * getcury() just after filling wmsgs with text, we expect to have the
-	 * same behaviour in both systems.
-	 *
-	 * Maybe there is a better way to query "last character" position in a
-	 * curses window?
-	 */
-	last_line_y = getcury(wmsgs);
+/*
+ * Draw messages in wmsgs, from message `from` on, until they take at least
+ * `lines` lines or there are no more messages.
+ */
+void chat_pad_draw(size_t from, int lines) {
+	MsgLog *msgs = cur_buffer->room->msgs;
+	if (lines > MAXY)
+		lines = MAXY;
+	if (lines > pad_height) {
+		pad_height = lines;
+		wresize(wmsgs, pad_height, getmaxx(stdscr));
+	}
 
-	int top;
-	int maxy, maxx;
-	getmaxyx(stdscr, maxy, maxx);
-	maxy -= 2; /* subtract winput and status bar height */
+	werase(wmsgs);
+	pad_top = from;
+	pad_lines = 0;
+	for (pad_next = from;
+	     pad_next < msglog_len(msgs) && pad_lines < lines; pad_next++) {
+		chat_msg_draw(pad_next, msglog_at(msgs, pad_next), pad_lines);
+		pad_lines += chat_height(pad_next);
+	}
+	pad_valid = true;
+}
 
-	/*
-	 * top holds the real value of top_line if top_line happens to be -1,
-	 * which means "always show the last line".
-	 */
-	top = top_line;
-	if (top == -1)
-		top = last_line_y - maxy;
+/* Show the messages in the viewport, drawing them if needed. */
+void chat_msgs_show(void) {
+	int maxy = getmaxy(stdscr) - 2; /* subtract winput and status bar */
+
+	chat_layout_sync();
+	if (follow)
+		chat_view_bottom(maxy);
+	if (top_off > MAXY - maxy)
+		top_off = MAXY - maxy;
+
+	/* Can we show it from what the pad already holds? */
+	int row = -1;
+	if (pad_valid && top_msg >= pad_top && top_msg <= pad_next) {
+		row = top_off;
+		for (size_t i = pad_top; i < top_msg; i++)
+			row += chat_height(i);
+		bool complete = pad_next == msglog_len(cur_buffer->room->msgs);
+		if (row + maxy > pad_height
+		|| (row + maxy > pad_lines && !complete))
+			row = -1;
+	}
+	if (row == -1) {
+		chat_pad_draw(top_msg, top_off + maxy);
+		row = top_off;
+	}
 
-	assert(prefresh(wmsgs, top, 0, 0, 0, maxy-1, maxx-1) == OK);
+	pad_show_row = row;
+	ui_dirty(DIRTY_MSGS);
+}
+
+/*
+ * Redraw the current room from scratch.  Only needed when what is already
+ * drawn changes: on room switch or when separators move.  Otherwise, use
+ * chat_msgs_append().
+ */
+void chat_msgs_fill(void) {
+	pad_valid = false;
+	chat_msgs_show();
+}
+
+/*
+ * Show messages appended to the current room.  They are appended to wmsgs
+ * while they fit, so the cost of a new message doesn't depend on how many
+ * messages the room has.
+ */
+void chat_msgs_append(void) {
+	size_t old_len = cur_buffer->layout_first + cur_buffer->layout_len;
+	chat_layout_sync();
+	if (pad_valid && pad_next == old_len) {
+		MsgLog *msgs = cur_buffer->room->msgs;
+		for (; pad_next < msglog_len(msgs)
+		    && pad_lines + chat_height(pad_next) <= pad_height;
+		    pad_next++) {
+			chat_msg_draw(pad_next, msglog_at(msgs, pad_next),
+				pad_lines);
+			pad_lines += chat_height(pad_next);
+		}
+	}
+	chat_msgs_show();
+}
+
+/* Number of lines from the top of the viewport to the end of the room. */
+int chat_lines_below(int max) {
+	int lines = -top_off;
+	size_t len = msglog_len(cur_buffer->room->msgs);
+	for (size_t i = top_msg; i < len && lines <= max; i++)
+		lines += chat_height(i);
+	return lines;
 }
 
 void chat_msgs_scroll(int direction) {
 	assert(direction == 1 || direction == -1);
 	int maxy = getmaxy(stdscr) - 2;
 
-	/*
-	 * Save us some instructions if we are on the very top or very bottom of
-	 * the wmsgs pad.
-	 */
-	if (direction == 1 && top_line == -1)
-		return;
-	if (direction == -1 && top_line == 0)
-		return;
-
-	/*
-	 * If we are following the last line (top_line == -1) but want to go
-	 * back in the message history, we cannot just make calculations on
-	 * top_line, since -1 is a special value that means "always show the
-	 * last line. So, before doing calculation, we need to set top_line to
-	 * its real value.
-	 */
-	if (direction == -1 && top_line == -1)
-		top_line = last_line_y - maxy;
+	chat_layout_sync();
 
-	/* Sum (or subtract) half of the screen. */
-	int lines = direction * (maxy / 2);
-	top_line += lines;
+	/* Save us some instructions if we are on the very bottom */
+	if (direction == 1 && follow)
+		return;
 
 	/*
-	 * Check it again: after calculation, if top_line is a negative value,
-	 * we are at the top of the history. Just show the first line
+	 * If we are following the last line but want to go back in the message
+	 * history, first find out where the last lines start.
 	 */
-	if (top_line < 0)
-		top_line = 0;
+	if (follow) {
+		chat_view_bottom(maxy);
+		follow = false;
+	}
 
-	/*
-	 * Likewise, if we are past the last line, set top_line = -1, which
-	 * means, "always show the last line", i.e., "enable autoscroll" or
-	 * "update history scroll automatically on new messages".
-	 */
-	if (top_line + maxy >= last_line_y)
-		top_line = -1;
+	/* Scroll half of the screen. */
+	int lines = maxy / 2;
+	if (direction == -1) {
+		top_off -= lines;
+		while (top_off < 0) {
+			/*
+			 * If we scrolled past the oldest message in memory,
+			 * load older ones from the disk.
+			 */
+			if (top_msg == cur_buffer->layout_first) {
+				if (!msglog_load_older(cur_buffer->room->msgs)) {
+					top_off = 0;
+					break;
+				}
+				chat_layout_sync();
+			}
+			top_msg--;
+			top_off += chat_height(top_msg);
+		}
+	} else {
+		top_off += lines;
+		while (top_msg + 1 < msglog_len(cur_buffer->room->msgs)
+		&& top_off >= chat_height(top_msg)) {
+			top_off -= chat_height(top_msg);
+			top_msg++;
+		}
+		/*
+		 * If we are past the last line, start following the last line
+		 * again.
+		 */
+		if (chat_lines_below(maxy) <= maxy)
+			follow = true;
+	}
 
-	chat_msgs_fill();
+	chat_msgs_show();
 }
 
 void input_clear(void) {
@@ -627,7 +1002,7 @@ void input_redraw(void) {
 	}
 	wmove(winput, 0, screenpos);
 
-	wrefresh(winput);
+	ui_dirty(DIRTY_INPUT);
 }
 
 void input_cursor_inc(int offset) {
@@ -689,7 +1064,7 @@ bool input_key_index(int c) {
 bool input_key_chat(int c) {
 	switch (c) {
 	case CTRL('g'):
-		cur_buffer->read_separator = vector_len(cur_buffer->room->msgs);
+		cur_buffer->read_separator = msglog_len(cur_buffer->room->msgs);
 		set_focus(FOCUS_INDEX);
 		return true;
 		break;
@@ -706,7 +1081,7 @@ bool input_key_chat(int c) {
 		if (str_sc_eq(cur_buffer->buf, "/quit")) {
 			set_focus(FOCUS_INDEX);
 		} else if (str_sc_eq(cur_buffer->buf, "/line")) {
-			cur_buffer->user_separator = vector_len(cur_buffer->room->msgs);
+			cur_buffer->user_separator = msglog_len(cur_buffer->room->msgs);
 			chat_msgs_fill();
 		} else if (str_sc_eq(cur_buffer->buf, "/disableautopilot")) {
 			autopilot = false;
@@ -714,8 +1089,10 @@ bool input_key_chat(int c) {
 			const char *number = str_buf(cur_buffer->buf) + strlen("/open ");
 			long int id;
 			if (str2li(number, &id) &&
-			   id >= 0 && (size_t)id < vector_len(cur_buffer->room->msgs)) {
-				Msg *msg = vector_at(cur_buffer->room->msgs, id);
+			   id >= 0 &&
+			   (size_t)id >= msglog_first(cur_buffer->room->msgs) &&
+			   (size_t)id < msglog_len(cur_buffer->room->msgs)) {
+				Msg *msg = msglog_at(cur_buffer->room->msgs, id);
 				assert(msg);
 				if (msg->type == MSGTYPE_FILE) {
 					struct UiEvent ev;
@@ -796,6 +1173,58 @@ void input_key(void) {
 	input_redraw();
 }
 
+/*
+ * Render scheduler
+ */
+
+void render(void *params) {
+	(void)params;
+	render_scheduled = false;
+	if (!dirty)
+		return;
+
+	if (dirty & DIRTY_MSGS && focus == FOCUS_CHAT_INPUT) {
+		int maxy, maxx;
+		getmaxyx(stdscr, maxy, maxx);
+		maxy -= 2; /* subtract winput and status bar height */
+		assert(pnoutrefresh(wmsgs, pad_show_row, 0,
+			0, 0, maxy-1, maxx-1) == OK);
+	}
+	if (dirty & DIRTY_STATUS)
+		wnoutrefresh(wstatus);
+
+	/*
+	 * The terminal cursor is left where the last window refreshed has
+	 * its cursor, so refresh the focused one last.
+	 */
+	if (focus == FOCUS_INDEX) {
+		if (dirty & DIRTY_INPUT)
+			wnoutrefresh(winput);
+		wnoutrefresh(windex);
+	} else {
+		if (dirty & DIRTY_INDEX)
+			wnoutrefresh(windex);
+		wnoutrefresh(winput);
+	}
+	doupdate();
+	dirty = 0;
+	last_render = loop_now();
+}
+
+/*
+ * Mark `what` (DIRTY_* flags) as changed and schedule a render(), in the
+ * current loop iteration or, if we rendered less than FRAME_MS ago, when
+ * FRAME_MS have passed.
+ */
+void ui_dirty(int what) {
+	dirty |= what;
+	if (render_scheduled)
+		return;
+	long long wait = last_render + FRAME_MS - loop_now();
+	loop_timer_set(render_timer, wait > 0 ? wait : 0);
+	render_scheduled = true;
+}
+
 /*
  * Public functions
  */
@@ -827,8 +1256,11 @@ void ui_curses_init(void) {
 	int maxy, maxx;
 	getmaxyx(stdscr, maxy, maxx);
 
+	render_timer = loop_timer_new(render, NULL);
+
 	windex = newwin(maxy-1, maxx, 0, 0);
-	wmsgs = newpad(MAXY, maxx);
+	pad_height = PAD_SCREENS * (maxy-2);
+	wmsgs = newpad(pad_height, maxx);
 	wstatus = newwin(1, maxx, maxy-2, 0);
 	winput = newwin(1, maxx, maxy-1, 0);
 	keypad(windex, TRUE);
@@ -884,6 +1316,12 @@ void ui_curses_room_new(Str *roomid) {
 	b->left = 0;
 	b->read_separator = -1;
 	b->user_separator = -1;
+	b->layout = NULL;
+	b->layout_first = 0;
+	b->layout_len = 0;
+	b->layout_max = 0;
+	b->layout_width = 0;
+	b->layout_names = 0;
 	vector_append(buffers, b);
 	if (curses_init) {
 		vector_sort(buffers, buffer_comparison);
@@ -893,26 +1331,46 @@ void ui_curses_room_new(Str *roomid) {
 
 void ui_curses_msg_new(Room *room, Msg msg) {
 	(void)msg; /* TODO: why is it unused? */
+	struct UiBatchRoom r = { room, msglog_len(room->msgs) - 1, 1, 1 };
+	UiBatch batch = { &r, 1, 1 };
+	ui_curses_msgs_batch(&batch);
+}
+
+/*
+ * Called once per sync with the rooms that received messages.  Whatever has to
+ * be drawn again is only marked as dirty, so this costs a single redraw.
+ */
+void ui_curses_msgs_batch(const UiBatch *batch) {
 	if (!curses_init)
 		return;
 	if (focus == FOCUS_INDEX) {
 		index_draw(); /* Update window */
 		if (autopilot) {
-			/* Find the buffer `b` that holds `room` */
+			/* Switch to the first room to notify about */
 			struct buffer *b;
-			size_t i;
-			VECTOR_FOREACH(buffers, b, i)
-				if (b->room == room && room->notify) {
-					index_idx = i;
-					set_cur_buffer(b);
-					set_focus(FOCUS_CHAT_INPUT);
-					break;
-				}
+			size_t i, j;
+			for (j = 0; j < batch->len && focus == FOCUS_INDEX; j++) {
+				Room *room = batch->rooms[j].room;
+				if (!room->notify)
+					continue;
+				/* Find the buffer `b` that holds `room` */
+				VECTOR_FOREACH(buffers, b, i)
+					if (b->room == room) {
+						index_idx = i;
+						set_cur_buffer(b);
+						set_focus(FOCUS_CHAT_INPUT);
+						break;
+					}
+			}
 		}
 	}
 	/* TODO: what about other parameters? */
-	if (cur_buffer && cur_buffer->room == room) {
-		cur_buffer->room->unread_msgs = 0;
-		chat_msgs_fill();
-	}
+	if (!cur_buffer)
+		return;
+	for (size_t i = 0; i < batch->len; i++)
+		if (batch->rooms[i].room == cur_buffer->room) {
+			cur_buffer->room->unread_msgs = 0;
+			chat_msgs_append();
+			break;
+		}
 }
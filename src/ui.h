@@ -39,6 +39,29 @@ struct UiEvent {
 
 typedef struct UiEvent UiEvent;
 
+/*
+ * What a sync changed in a room: messages [first, first + count) were appended
+ * to it and its unread_msgs grew by unread.
+ */
+struct UiBatchRoom {
+	struct Room *room;
+	size_t first;
+	size_t count;
+	size_t unread;
+};
+
+/*
+ * Summary of a sync, given to the UI once all of its events were processed, so
+ * it is redrawn once per sync instead of once per message.
+ */
+struct UiBatch {
+	struct UiBatchRoom *rooms;	/* Rooms touched, in order */
+	size_t len;
+	size_t msgs;			/* Messages appended to all rooms */
+};
+
+typedef struct UiBatch UiBatch;
+
 extern void (*ui_event_handler_callback)(UiEvent);
 
 void ui_set_event_handler(void (*callback)(UiEvent));
@@ -0,0 +1,260 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash.h"
+#include "intern.h"
+#include "users.h"
+
+/**
+ * This file implements the user directory: the display name and avatar of
+ * every user we have seen, in this run or a previous one, by user ID.  With
+ * lazy-loaded members, a sync only tells about the users it needs to, so names
+ * learnt earlier must be remembered.
+ *
+ * The directory is kept in the cache file USERS_KEY, an append-only log of
+ * records:
+ *
+ *	+----------+----------+-----------+----+------+--------+
+ *	| idlen    | namelen  | avatarlen | id | name | avatar |
+ *	| (uint32) | (uint32) | (uint32)  |    |      |        |
+ *	+----------+----------+-----------+----+------+--------+
+ *
+ * An empty name or avatar (an mxc:// URI) stands for none.  The last record of
+ * a user wins.  The log is read the first time a user is looked up or added,
+ * not at startup.  Changes are only appended by users_flush() (see main.c), one
+ * record per changed user however many times it changed.
+ *
+ * When loading, a log cut short by a crash, or with more than twice as many
+ * records as users, is written again to a temporary file that replaces it.
+ */
+
+#define USERS_KEY "users/directory"
+#define USERS_TMP_KEY "users/directory.tmp"
+
+/* Don't rewrite logs with fewer records than this, however wasteful */
+#define USERS_COMPACT_MIN 1024
+
+struct user {
+	Str *name;	/* NULL if none */
+	Str *avatar;	/* NULL if none */
+	bool dirty;	/* Changed since the last users_flush() */
+};
+
+struct user_record {
+	uint32_t idlen;
+	uint32_t namelen;
+	uint32_t avatarlen;
+};
+
+static Hash *users = NULL;	/* Hash<const char *id, struct user> (interned) */
+static size_t dirty_users = 0;	/* Users with dirty set */
+static unsigned long generation = 0; /* See users_generation() */
+
+static void users_load(void);
+
+static bool str_eq_maybe(const Str *a, const Str *b) {
+	if (!a || !b)
+		return a == b;
+	return str_bytelen(a) == str_bytelen(b)
+		&& memcmp(str_buf(a), str_buf(b), str_bytelen(a)) == 0;
+}
+
+/* Set name and avatar of `id`.  Return the user if they changed, else NULL. */
+static struct user *user_set(Str *id, Str *name, Str *avatar) {
+	struct user *u = hash_get(users, str_buf(id));
+	if (!u) {
+		u = malloc(sizeof(struct user));
+		u->name = NULL;
+		u->avatar = NULL;
+		u->dirty = false;
+		/* The key must live as long as the item: the interned id does */
+		Str *iid = intern_str(id);
+		hash_insert(users, str_buf(iid), u);
+		str_decref(iid);
+	} else if (str_eq_maybe(u->name, name)
+	&& str_eq_maybe(u->avatar, avatar))
+		return NULL;
+	if (!str_eq_maybe(u->name, name))
+		generation++;
+	str_decref(u->name);
+	str_decref(u->avatar);
+	u->name = name ? str_dup(name) : NULL;
+	u->avatar = avatar ? str_dup(avatar) : NULL;
+	return u;
+}
+
+/*
+ * Remember `name` and `avatar` of user `id`.  They may be NULL if the user
+ * didn't set them, and are copied.
+ */
+void user_add(Str *id, Str *name, Str *avatar) {
+	users_load();
+	struct user *u = user_set(id, name, avatar);
+	if (u && !u->dirty) {
+		u->dirty = true;
+		dirty_users++;
+	}
+}
+
+/* The display name of `id`, or `id` itself if it has none. */
+Str *user_name(Str *id) {
+	users_load();
+	struct user *u = hash_get(users, str_buf(id));
+	if (!u || !u->name)
+		return id;
+	return u->name;
+}
+
+/* The avatar (an mxc:// URI) of `id`.  NULL if it has none. */
+Str *user_avatar(Str *id) {
+	users_load();
+	struct user *u = hash_get(users, str_buf(id));
+	return u ? u->avatar : NULL;
+}
+
+/*
+ * A number that changes whenever the display name of a user does, so what was
+ * computed from names (e.g. the layout of messages) can be computed again.
+ */
+unsigned long users_generation(void) {
+	users_load();
+	return generation;
+}
+
+static size_t str_len_maybe(const Str *s) {
+	return s ? str_bytelen(s) : 0;
+}
+
+/* Append the record of `u` to `f`.  Return false on errors. */
+static bool user_record_write(FILE *f, const char *id,
+	const struct user *u)
+{
+	struct user_record r = {
+		strlen(id), str_len_maybe(u->name), str_len_maybe(u->avatar)
+	};
+	return fwrite(&r, sizeof(r), 1, f) == 1
+		&& fwrite(id, 1, r.idlen, f) == r.idlen
+		&& (!u->name
+		|| fwrite(str_buf(u->name), 1, r.namelen, f) == r.namelen)
+		&& (!u->avatar
+		|| fwrite(str_buf(u->avatar), 1, r.avatarlen, f) == r.avatarlen);
+}
+
+/*
+ * Write the users that changed since the last call to the log.  If that fails,
+ * the log is left as it was and they are written by the next call.
+ */
+void users_flush(void) {
+	if (dirty_users == 0)
+		return;
+	FILE *f = cache_open(USERS_KEY, "a");
+	if (!f) {
+		perror("users_flush()");
+		return;
+	}
+	struct stat st;
+	bool ok = fstat(fileno(f), &st) == 0;
+	if (!ok) {
+		perror("users_flush()");
+		fclose(f);
+		return;
+	}
+	const char *id;
+	struct user *u;
+	size_t i;
+	HASH_FOREACH(users, id, u, i)
+		if (u->dirty)
+			ok = ok && user_record_write(f, id, u);
+	ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		perror("users_flush()");
+		/* Don't leave a record cut short: the next ones would be lost */
+		f = cache_open(USERS_KEY, "r+");
+		if (!f || ftruncate(fileno(f), st.st_size) != 0)
+			perror("users_flush()");
+		if (f)
+			fclose(f);
+		return;
+	}
+	HASH_FOREACH(users, id, u, i)
+		u->dirty = false;
+	dirty_users = 0;
+}
+
+/* Write all users to a new log that replaces the old one. */
+static void users_rewrite(void) {
+	FILE *f = cache_open(USERS_TMP_KEY, "w");
+	if (!f)
+		return;
+	bool ok = true;
+	const char *id;
+	struct user *u;
+	size_t i;
+	HASH_FOREACH(users, id, u, i)
+		ok = ok && user_record_write(f, id, u);
+	ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+	ok = fclose(f) == 0 && ok;
+	if (ok)
+		cache_rename(USERS_TMP_KEY, USERS_KEY);
+}
+
+/* Return the `len` bytes at `p` as a Str, or NULL if len is 0. */
+static Str *user_record_str(const char *p, size_t len) {
+	if (len == 0)
+		return NULL;
+	char *s = strndup(p, len);
+	Str *ss = str_new_cstr(s);
+	free(s);
+	return ss;
+}
+
+/* Read the log into the directory, if not done yet. */
+static void users_load(void) {
+	if (users)
+		return;
+	users = hash_new();
+
+	FILE *f = cache_open(USERS_KEY, "r");
+	if (!f)
+		return;
+	struct stat st;
+	char *buf = NULL;
+	size_t len = 0;
+	if (fstat(fileno(f), &st) == 0) {
+		buf = malloc(st.st_size);
+		len = fread(buf, 1, st.st_size, f);
+	}
+	fclose(f);
+
+	size_t off = 0, records = 0;
+	struct user_record r;
+	while (len - off >= sizeof(r)) {
+		memcpy(&r, buf + off, sizeof(r));
+		size_t size = sizeof(r) + (size_t)r.idlen + r.namelen
+			+ r.avatarlen;
+		if (r.idlen == 0 || size > len - off)
+			break;
+		const char *p = buf + off + sizeof(r);
+		Str *id = user_record_str(p, r.idlen);
+		Str *name = user_record_str(p + r.idlen, r.namelen);
+		Str *avatar = user_record_str(p + r.idlen + r.namelen,
+			r.avatarlen);
+		user_set(id, name, avatar);
+		str_decref(id);
+		str_decref(name);
+		str_decref(avatar);
+		off += size;
+		records++;
+	}
+	free(buf);
+
+	/* Cut short or wasteful.  Write it again */
+	if (off < len || (records > USERS_COMPACT_MIN
+	&& records > 2 * hash_len(users)))
+		users_rewrite();
+}
@@ -0,0 +1,12 @@
+#ifndef JANECHAT_USERS_H
+#define JANECHAT_USERS_H
+
+#include "str.h"
+
+void user_add(Str *, Str *, Str *);
+Str *user_name(Str *);
+Str *user_avatar(Str *);
+void users_flush(void);
+unsigned long users_generation(void);
+
+#endif /* !JANECHAT_USERS_H */
@@ -0,0 +1,138 @@
+/*
+ * Compare the current Hash (open addressing) with the 256-bucket chained hash
+ * table janechat used before, by inserting and looking up Matrix-like IDs.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../../src/hash.c"
+#include "../../src/list.c"
+#include "../../src/str.c"
+#include "../../src/utils.c"
+
+/*
+ * The old implementation, verbatim except for names.
+ */
+
+#define OLD_HASH_SIZE 256
+
+struct old_hash_item {
+	const char *key;
+	void *val;
+};
+
+struct OldHash {
+	List *table[OLD_HASH_SIZE];
+};
+typedef struct OldHash OldHash;
+
+static size_t old_hash_calculate_idx(const char *key) {
+	size_t idx;
+	idx = 0;
+	for (size_t i = 0; i < strlen(key); i++)
+		idx += (unsigned char)key[i];
+	idx %= OLD_HASH_SIZE;
+	return idx;
+}
+
+static OldHash *old_hash_new(void) {
+	OldHash *h = malloc(sizeof(OldHash));
+	memset(h->table, 0x0, sizeof(h->table));
+	return h;
+}
+
+static void old_hash_insert(OldHash *h, const char *key, const void *val) {
+	size_t idx = old_hash_calculate_idx(key);
+	if (!h->table[idx])
+		h->table[idx] = list_new();
+	List *l = h->table[idx];
+	struct old_hash_item *iter;
+	LIST_FOREACH(l, iter) {
+		if (streq(iter->key, key))
+			return;
+	}
+	struct old_hash_item *item = malloc(sizeof(struct old_hash_item));
+	item->key = key;
+	item->val = (void *)val;
+	list_append(l, item);
+}
+
+static void *old_hash_get(const OldHash *h, const char *key) {
+	size_t idx = old_hash_calculate_idx(key);
+	List *l = h->table[idx];
+	if (!l)
+		return NULL;
+	struct old_hash_item *item;
+	LIST_FOREACH(l, item) {
+		if (streq(item->key, key))
+			return item->val;
+	}
+	return NULL;
+}
+
+/*
+ * Benchmark
+ */
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Generate `n` room IDs in the form "!<18 random letters>:matrix.org" */
+static char **gen_keys(size_t n) {
+	const char *letters =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	char **keys = malloc(sizeof(char *) * n);
+	srand(1);
+	for (size_t i = 0; i < n; i++) {
+		char id[32] = "!";
+		for (int j = 1; j <= 18; j++)
+			id[j] = letters[rand() % 52];
+		strcpy(&id[19], ":matrix.org");
+		keys[i] = strdup(id);
+	}
+	return keys;
+}
+
+static void bench(size_t n) {
+	char **keys = gen_keys(n);
+	double t0, t1, t2, t3, t4, t5;
+	size_t found = 0;
+
+	t0 = now();
+	OldHash *oh = old_hash_new();
+	for (size_t i = 0; i < n; i++)
+		old_hash_insert(oh, keys[i], keys[i]);
+	t1 = now();
+	for (size_t r = 0; r < 10; r++)
+		for (size_t i = 0; i < n; i++)
+			found += old_hash_get(oh, keys[i]) != NULL;
+	t2 = now();
+
+	t3 = now();
+	Hash *h = hash_new();
+	for (size_t i = 0; i < n; i++)
+		hash_insert(h, keys[i], keys[i]);
+	t4 = now();
+	for (size_t r = 0; r < 10; r++)
+		for (size_t i = 0; i < n; i++)
+			found += hash_get(h, keys[i]) != NULL;
+	t5 = now();
+
+	if (found != 20 * n)
+		abort();
+	printf("%7zu keys: insert old %8.2f ms new %6.2f ms | "
+		"10x lookup old %9.2f ms new %6.2f ms\n", n,
+		(t1 - t0) * 1e3, (t4 - t3) * 1e3,
+		(t2 - t1) * 1e3, (t5 - t4) * 1e3);
+}
+
+int main(void) {
+	bench(1000);
+	bench(10000);
+	bench(50000);
+	return 0;
+}
@@ -1,22 +1,31 @@
 #undef NDEBUG
+#include <unistd.h>
+
+#include "../../src/cache.c"
 #include "../../src/hash.c"
+#include "../../src/intern.c"
 #include "../../src/utils.c"
 #include "../../src/list.c"
+#include "../../src/loop.c"
+#include "../../src/msglog.c"
 #include "../../src/rooms.c"
 #include "../../src/str.c"
 #include "../../src/ui.c"
+#include "../../src/users.c"
 #include "../../src/vector.c"
 #include "../../src/ui-curses.c"
 
 void fake_event_handler(UiEvent ev) {
 	switch (ev.type) {
 	case UIEVENTTYPE_SENDMSG: {
-		Msg *msg = malloc(sizeof(struct Msg));
-		msg->sender = str_new_cstr("test");
-		msg->type = MSGTYPE_TEXT;
-		msg->text.content = str_dup(cur_buffer->buf);
-		vector_append(cur_buffer->room->msgs, msg);
-		chat_msgs_fill();
+		Msg msg;
+		msg.sender = str_new_cstr("test");
+		msg.type = MSGTYPE_TEXT;
+		msg.text.content = str_dup(cur_buffer->buf);
+		room_append_msg(cur_buffer->room, msg, NULL);
+		ui_curses_msg_new(cur_buffer->room, msg);
+		str_decref(msg.sender);
+		str_decref(msg.text.content);
 		}
 		break;
 	default:
@@ -25,7 +34,20 @@ void fake_event_handler(UiEvent ev) {
 	}
 }
 
+void handle_stdin(int fd, int revents, void *params) {
+	(void)fd;
+	(void)revents;
+	(void)params;
+	ui_curses_iter();
+}
+
 int main(int argc, char *argv[]) {
+	/* Start with empty timelines, whatever previous runs stored */
+	char cachedir[] = "/tmp/janechat-ui.XXXXXX";
+	if (!mkdtemp(cachedir))
+		abort();
+	setenv("XDG_CACHE_HOME", cachedir, 1);
+
 	rooms_init();
 	ui_set_event_handler(fake_event_handler);
 	ui_curses_setup();
@@ -52,8 +74,9 @@ int main(int argc, char *argv[]) {
 	str_append_cstr(roomid, roomid_cstr); \
 	room = room_byid(roomid); \
 	msg.sender = sender; \
+	msg.type = MSGTYPE_TEXT; \
 	msg.text.content = str_new_cstr(msg_cstr); \
-	room_append_msg(room, msg);
+	room_append_msg(room, msg, NULL);
 
 	for (int i = 0; i < 100; i++) {
 		new_msg("#test1:matrix.org", "test");
@@ -64,8 +87,9 @@ int main(int argc, char *argv[]) {
 
 	resize();
 
+	loop_watch_fd(STDIN_FILENO, LOOP_READ, handle_stdin, NULL);
 	for (;;)
-		ui_curses_iter();
+		loop_run_once();
 
 	return 0;
 }
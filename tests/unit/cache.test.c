@@ -0,0 +1,210 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../../src/cache.c"
+#include "../../src/hash.c"
+#include "../../src/str.c"
+#include "../../src/utils.c"
+
+static char dir[] = "/tmp/janechat-cache.XXXXXX";
+
+/* Forget what is in memory, as if janechat started again */
+static void reload(void) {
+	close(logfd);
+	logfd = -1;
+	entries = NULL;
+	live = 0;
+	garbage = 0;
+	dirty_entries = 0;
+}
+
+static void assert_value(const char *key, const char *expected) {
+	char *value = cache_get_alloc(key);
+	if (!expected) {
+		assert(value == NULL);
+		return;
+	}
+	assert(value != NULL);
+	assert(strcmp(value, expected) == 0);
+	free(value);
+}
+
+static off_t log_size(void) {
+	char path[PATH_MAX];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/janechat/%s", dir, CACHE_LOG);
+	assert(stat(path, &st) == 0);
+	return st.st_size;
+}
+
+static void test_cache_migration(void) {
+	/* The file-per-key format */
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/janechat", dir);
+	mkdir_r(path);
+	snprintf(path, sizeof(path), "%s/janechat/server", dir);
+	FILE *f = fopen(path, "w");
+	fputs("matrix.org", f);
+	fclose(f);
+	FILE *spill = cache_open("msgs/!room:matrix.org", "w");
+	fclose(spill);
+
+	assert_value("server", "matrix.org");
+	assert(access(path, F_OK) != 0);
+	spill = cache_open("msgs/!room:matrix.org", "r");
+	assert(spill != NULL);
+	fclose(spill);
+
+	reload();
+	assert_value("server", "matrix.org");
+}
+
+static void test_cache_set_get(void) {
+	assert_value("missing", NULL);
+	cache_set("access_token", "secret");
+	cache_set("!room:matrix.org", "Room");
+	cache_set("empty", "");
+	cache_set("access_token", "other secret");
+	assert_value("access_token", "other secret");
+	assert_value("empty", "");
+
+	/* Setting the same value doesn't write anything */
+	off_t size = log_size();
+	cache_set("access_token", "other secret");
+	assert(log_size() == size);
+
+	reload();
+	assert_value("access_token", "other secret");
+	assert_value("!room:matrix.org", "Room");
+	assert_value("empty", "");
+}
+
+static void test_cache_truncated(void) {
+	cache_set("next_batch", "s1");
+	off_t size = log_size();
+	cache_set("next_batch", "s2_very_long_token");
+
+	/* A crash in the middle of the last record */
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/janechat/%s", dir, CACHE_LOG);
+	assert(truncate(path, size + 5) == 0);
+	reload();
+	assert_value("next_batch", "s1");
+	assert(log_size() < size + 5);
+
+	cache_set("next_batch", "s3");
+	reload();
+	assert_value("next_batch", "s3");
+}
+
+static void test_cache_compaction(void) {
+	char value[64];
+	for (int i = 0; i < 10000; i++) {
+		snprintf(value, sizeof(value), "s%d", i);
+		cache_set("next_batch", value);
+	}
+	assert(log_size() < 2 * CACHE_COMPACT_MIN);
+	assert(garbage <= CACHE_COMPACT_MIN);
+	reload();
+	assert_value("next_batch", "s9999");
+	assert_value("access_token", "other secret");
+	assert_value("server", "matrix.org");
+}
+
+static void test_cache_lazy(void) {
+	cache_set_lazy("next_batch", "l1");
+	off_t size = log_size();
+	char value[64];
+	for (int i = 0; i < 100; i++) {
+		snprintf(value, sizeof(value), "l%d", i);
+		cache_set_lazy("next_batch", value);
+	}
+	/* Seen at once, but only in memory */
+	assert_value("next_batch", "l99");
+	assert(log_size() == size);
+
+	/* Many changes, one record */
+	cache_flush();
+	assert(log_size() == size + (off_t)(sizeof(struct cache_record)
+		+ strlen("next_batch") + strlen("l99")));
+	assert(dirty_entries == 0);
+	cache_flush();
+	reload();
+	assert_value("next_batch", "l99");
+
+	/* A crash before flushing keeps the previous value */
+	cache_set_lazy("next_batch", "lost");
+	reload();
+	assert_value("next_batch", "l99");
+
+	/* Storing it right away wins over the lazy value */
+	cache_set_lazy("next_batch", "lazy");
+	cache_set("next_batch", "now");
+	cache_flush();
+	reload();
+	assert_value("next_batch", "now");
+}
+
+static void test_cache_write_error(void) {
+	int fd = logfd;
+	logfd = open("/dev/null", O_RDONLY);
+
+	/* Kept in memory, not forgotten */
+	cache_set("key", "set");
+	cache_set_lazy("next_batch", "lazy");
+	cache_flush();
+	assert(dirty_entries == 2);
+	assert_value("key", "set");
+
+	/* Written once the log works again */
+	close(logfd);
+	logfd = fd;
+	cache_flush();
+	assert(dirty_entries == 0);
+	reload();
+	assert_value("key", "set");
+	assert_value("next_batch", "lazy");
+}
+
+static void test_cache_compaction_error(void) {
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s/janechat/%s.tmp", dir, CACHE_LOG);
+	assert(mkdir(tmp, 0700) == 0);
+
+	/* The old log is kept, as wasteful as it was */
+	int fd = logfd;
+	cache_set_lazy("next_batch", "c1");
+	size_t g = garbage = live + CACHE_COMPACT_MIN + 1;
+	cache_flush();
+	assert(logfd == fd);
+	assert(garbage == g);
+	assert(dirty_entries == 0);
+	cache_set("key", "c2");
+	assert(logfd == fd);
+
+	/* Compacted by the next flush */
+	assert(rmdir(tmp) == 0);
+	cache_flush();
+	assert(logfd != fd);
+	assert(garbage == 0);
+	reload();
+	assert_value("next_batch", "c1");
+	assert_value("key", "c2");
+}
+
+int main(int argc, char *argv[]) {
+	assert(mkdtemp(dir));
+	setenv("XDG_CACHE_HOME", dir, 1);
+
+	test_cache_migration();
+	test_cache_set_get();
+	test_cache_truncated();
+	test_cache_compaction();
+	test_cache_lazy();
+	test_cache_write_error();
+	test_cache_compaction_error();
+	return 0;
+}
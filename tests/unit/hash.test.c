@@ -0,0 +1,82 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+
+#include "../../src/hash.c"
+#include "../../src/str.c"
+#include "../../src/utils.c"
+
+#define N 10000
+
+static char keys[N][32];
+
+static void fill_keys(void) {
+	for (int i = 0; i < N; i++)
+		snprintf(keys[i], sizeof(keys[i]), "!room%d:matrix.org", i);
+}
+
+static void test_hash_insert_get() {
+	Hash *h = hash_new();
+	assert(hash_get(h, "foo") == NULL);
+	for (int i = 0; i < N; i++)
+		hash_insert(h, keys[i], keys[i]);
+	assert(hash_len(h) == N);
+	for (int i = 0; i < N; i++)
+		assert(hash_get(h, keys[i]) == keys[i]);
+	assert(hash_get(h, "!room:matrix.org") == NULL);
+
+	/* Inserting an existing key doesn't overwrite it */
+	char other[] = "!room0:matrix.org";
+	hash_insert(h, other, other);
+	assert(hash_len(h) == N);
+	assert(hash_get(h, other) == keys[0]);
+}
+
+static void test_hash_remove() {
+	Hash *h = hash_new();
+	for (int i = 0; i < N; i++)
+		hash_insert(h, keys[i], keys[i]);
+	for (int i = 0; i < N; i += 2)
+		assert(hash_remove(h, keys[i]) == keys[i]);
+	assert(hash_remove(h, keys[0]) == NULL);
+	assert(hash_len(h) == N / 2);
+	for (int i = 0; i < N; i++) {
+		if (i % 2 == 0)
+			assert(hash_get(h, keys[i]) == NULL);
+		else
+			assert(hash_get(h, keys[i]) == keys[i]);
+	}
+	/* Slots freed by hash_remove() are reused */
+	for (int i = 0; i < N; i += 2)
+		hash_insert(h, keys[i], keys[i]);
+	assert(hash_len(h) == N);
+	for (int i = 0; i < N; i++)
+		assert(hash_get(h, keys[i]) == keys[i]);
+}
+
+static void test_hash_foreach() {
+	Hash *h = hash_new();
+	static bool seen[N];
+	for (int i = 0; i < N; i++)
+		hash_insert(h, keys[i], &seen[i]);
+
+	const char *key;
+	bool *val;
+	size_t i;
+	size_t count = 0;
+	HASH_FOREACH(h, key, val, i) {
+		assert(hash_get(h, key) == val);
+		assert(!*val);
+		*val = true;
+		count++;
+	}
+	assert(count == N);
+}
+
+int main(int argc, char *argv[]) {
+	fill_keys();
+	test_hash_insert_get();
+	test_hash_remove();
+	test_hash_foreach();
+	return 0;
+}
@@ -0,0 +1,35 @@
+#undef NDEBUG
+#include <assert.h>
+
+#include "../../src/hash.c"
+#include "../../src/intern.c"
+#include "../../src/str.c"
+#include "../../src/utils.c"
+
+static void test_intern() {
+	Str *a = intern_cstr("@alice:matrix.org");
+	Str *b = intern_cstr("@bob:matrix.org");
+	Str *s = str_new_cstr("@alice:matrix.org");
+	Str *c = intern_str(s);
+	assert(a != b);
+	assert(a == c);
+	assert(a != s);
+	assert(str_sc_eq(c, "@alice:matrix.org"));
+
+	/* The pool keeps its own reference */
+	str_decref(a);
+	str_decref(c);
+	assert(a->rc == 1);
+
+	const InternStats *st = intern_stats();
+	assert(st->lookups == 3);
+	assert(st->hits == 1);
+	assert(st->strings == 2);
+	assert(st->bytes_saved == sizeof(Str) + str_bytelen(s) + 1);
+	str_decref(s);
+}
+
+int main(int argc, char *argv[]) {
+	test_intern();
+	return 0;
+}
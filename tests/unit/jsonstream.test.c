@@ -0,0 +1,87 @@
+#undef NDEBUG
+#include <assert.h>
+
+#include "../../src/jsonstream.c"
+#include "../../src/str.c"
+#include "../../src/utils.c"
+
+static Str *members;
+
+static void collect(const char *key, const char *json, size_t len, void *p) {
+	(void)p;
+	assert(strlen(json) == len);
+	str_append_cstr(members, key);
+	str_append_cstr(members, "=");
+	str_append_cstr(members, json);
+	str_append_cstr(members, ";");
+}
+
+/* Feed `doc` to a new stream, `chunk` bytes at a time. */
+static Str *split(const char **path, const char *doc, size_t chunk) {
+	str_reset(members);
+	JsonStream *js = jsonstream_new(path, collect, NULL);
+	size_t len = strlen(doc);
+	for (size_t i = 0; i < len; i += chunk) {
+		size_t n = len - i < chunk ? len - i : chunk;
+		jsonstream_feed(js, doc + i, n);
+	}
+	return jsonstream_finish(js);
+}
+
+static void test_jsonstream_doc_example() {
+	const char *path[] = { "a", NULL };
+	const char *doc = "{\"a\": {\"x\": {\"y\": 1}, \"z\": [2, 3]}, \"b\": 4}";
+	for (size_t chunk = 1; chunk <= strlen(doc); chunk++) {
+		Str *skel = split(path, doc, chunk);
+		assert(str_sc_eq(skel, "{\"a\": {\"x\": {}, \"z\": []}, \"b\": 4}"));
+		assert(str_sc_eq(members, "x={\"y\": 1};z=[2, 3];"));
+		str_decref(skel);
+	}
+}
+
+static void test_jsonstream_sync() {
+	const char *path[] = { "rooms", "join", NULL };
+	const char *doc =
+		"{\"next_batch\":\"s1\","
+		"\"account_data\":{\"join\":{\"!no:x\":{\"a\":1}}},"
+		"\"rooms\":{"
+			"\"invite\":{\"!i:x\":{}},"
+			"\"join\":{"
+				"\"!a:x\":{\"timeline\":{\"events\":"
+					"[{\"body\":\"}{\\\"]\"}]}},"
+				"\"!b:x\":{\"state\":{}}"
+			"}"
+		"}}";
+	for (size_t chunk = 1; chunk <= strlen(doc); chunk++) {
+		Str *skel = split(path, doc, chunk);
+		assert(str_sc_eq(skel,
+			"{\"next_batch\":\"s1\","
+			"\"account_data\":{\"join\":{\"!no:x\":{\"a\":1}}},"
+			"\"rooms\":{"
+				"\"invite\":{\"!i:x\":{}},"
+				"\"join\":{\"!a:x\":{},\"!b:x\":{}}"
+			"}}"));
+		assert(str_sc_eq(members,
+			"!a:x={\"timeline\":{\"events\":"
+				"[{\"body\":\"}{\\\"]\"}]}};"
+			"!b:x={\"state\":{}};"));
+		str_decref(skel);
+	}
+}
+
+static void test_jsonstream_no_match() {
+	const char *path[] = { "rooms", "join", NULL };
+	const char *doc = "{\"errcode\":\"M_UNKNOWN\",\"error\":\"{[\"}";
+	Str *skel = split(path, doc, 3);
+	assert(str_sc_eq(skel, doc));
+	assert(str_bytelen(members) == 0);
+	str_decref(skel);
+}
+
+int main(int argc, char *argv[]) {
+	members = str_new();
+	test_jsonstream_doc_example();
+	test_jsonstream_sync();
+	test_jsonstream_no_match();
+	return 0;
+}
@@ -0,0 +1,277 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../../src/cache.c"
+#include "../../src/hash.c"
+#include "../../src/intern.c"
+#include "../../src/msglog.c"
+#include "../../src/str.c"
+#include "../../src/utils.c"
+
+static void append_text(MsgLog *log, size_t i) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "message %zu", i);
+	Msg m;
+	m.type = MSGTYPE_TEXT;
+	m.sender = str_new_cstr("@alice:matrix.org");
+	m.text.content = str_new_cstr(buf);
+	msglog_append(log, m, NULL);
+	str_decref(m.sender);
+	str_decref(m.text.content);
+}
+
+/* Append message i, with event ID "$i".  Return whether it was appended. */
+static bool append_event(MsgLog *log, size_t i) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "$%zu", i);
+	Str *eventid = str_new_cstr(buf);
+	snprintf(buf, sizeof(buf), "message %zu", i);
+	Msg m;
+	m.type = MSGTYPE_TEXT;
+	m.sender = str_new_cstr("@alice:matrix.org");
+	m.text.content = str_new_cstr(buf);
+	bool appended = msglog_append(log, m, eventid) != NULL;
+	str_decref(eventid);
+	str_decref(m.sender);
+	str_decref(m.text.content);
+	return appended;
+}
+
+static void assert_text(MsgLog *log, size_t i) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "message %zu", i);
+	Msg *msg = msglog_at(log, i);
+	assert(msg->type == MSGTYPE_TEXT);
+	assert(str_sc_eq(msg->sender, "@alice:matrix.org"));
+	assert(str_sc_eq(msg->text.content, buf));
+}
+
+static void test_msglog_memory(void) {
+	msglog_set_limits(0, 0);
+	MsgLog *log = msglog_new(NULL);
+	for (size_t i = 0; i < 3 * MSGLOG_BLOCK_LEN + 1; i++)
+		append_text(log, i);
+	assert(msglog_len(log) == 3 * MSGLOG_BLOCK_LEN + 1);
+	assert(msglog_first(log) == 0);
+	for (size_t i = 0; i < msglog_len(log); i++)
+		assert_text(log, i);
+	msglog_free(log);
+}
+
+#define ROOM_KEY "timeline/!room:matrix.org"
+
+static char dir[] = "/tmp/janechat-msglog.XXXXXX";
+
+static void timeline_path(char *path, size_t len, const char *file) {
+	snprintf(path, len, "%s/janechat/%s/%s", dir, ROOM_KEY, file);
+}
+
+static void test_msglog_timeline(void) {
+	msglog_set_limits(MSGLOG_BLOCK_LEN, 0);
+	MsgLog *log = msglog_new(ROOM_KEY);
+	assert(msglog_len(log) == 0);
+
+	/* Keep at least MSGLOG_BLOCK_LEN in memory */
+	for (size_t i = 0; i < 2 * MSGLOG_BLOCK_LEN - 1; i++)
+		append_text(log, i);
+	assert(msglog_first(log) == 0);
+
+	for (size_t i = 2 * MSGLOG_BLOCK_LEN - 1; i < 4 * MSGLOG_BLOCK_LEN; i++)
+		append_text(log, i);
+	assert(msglog_len(log) == 4 * MSGLOG_BLOCK_LEN);
+	assert(msglog_first(log) == 3 * MSGLOG_BLOCK_LEN);
+	assert(log->noffsets == 4);
+
+	Msg *msg;
+	size_t i, n = 0;
+	MSGLOG_FOREACH(log, msg, i) {
+		assert_text(log, i);
+		n++;
+	}
+	assert(n == MSGLOG_BLOCK_LEN);
+
+	/* Load everything back */
+	assert(msglog_load_older(log));
+	assert(msglog_first(log) == 2 * MSGLOG_BLOCK_LEN);
+	assert(msglog_load_older(log));
+	assert(msglog_load_older(log));
+	assert(msglog_first(log) == 0);
+	assert(!msglog_load_older(log));
+	for (i = 0; i < msglog_len(log); i++)
+		assert_text(log, i);
+
+	/* Loaded history is kept until we trim explicitly */
+	append_text(log, 4 * MSGLOG_BLOCK_LEN);
+	assert(msglog_first(log) == 0);
+	msglog_trim(log);
+	assert(msglog_first(log) == 3 * MSGLOG_BLOCK_LEN);
+	assert(msglog_load_older(log));
+	assert_text(log, 2 * MSGLOG_BLOCK_LEN);
+	msglog_free(log);
+}
+
+static void test_msglog_restart(void) {
+	/* The tail is there, with the block before it, as it has few messages */
+	MsgLog *log = msglog_new(ROOM_KEY);
+	assert(msglog_len(log) == 4 * MSGLOG_BLOCK_LEN + 1);
+	assert(msglog_first(log) == 3 * MSGLOG_BLOCK_LEN);
+	for (size_t i = msglog_first(log); i < msglog_len(log); i++)
+		assert_text(log, i);
+	assert(msglog_load_older(log));
+	assert_text(log, 2 * MSGLOG_BLOCK_LEN);
+
+	/* New messages go after the old ones */
+	append_text(log, 4 * MSGLOG_BLOCK_LEN + 1);
+	msglog_free(log);
+	log = msglog_new(ROOM_KEY);
+	assert(msglog_len(log) == 4 * MSGLOG_BLOCK_LEN + 2);
+	assert_text(log, 4 * MSGLOG_BLOCK_LEN + 1);
+	msglog_free(log);
+}
+
+static void test_msglog_crash(void) {
+	char path[PATH_MAX];
+	struct stat st;
+
+	/* The last message was cut short: it is dropped */
+	timeline_path(path, sizeof(path), "log");
+	assert(stat(path, &st) == 0);
+	assert(truncate(path, st.st_size - 3) == 0);
+	MsgLog *log = msglog_new(ROOM_KEY);
+	assert(msglog_len(log) == 4 * MSGLOG_BLOCK_LEN + 1);
+	append_text(log, 4 * MSGLOG_BLOCK_LEN + 1);
+	msglog_free(log);
+
+	/* The index is lost: it is rebuilt */
+	timeline_path(path, sizeof(path), "index");
+	assert(unlink(path) == 0);
+	log = msglog_new(ROOM_KEY);
+	assert(msglog_len(log) == 4 * MSGLOG_BLOCK_LEN + 2);
+	assert(log->noffsets == 5);
+	for (size_t i = msglog_first(log); i < msglog_len(log); i++)
+		assert_text(log, i);
+	msglog_free(log);
+	assert(stat(path, &st) == 0);
+	assert(st.st_size == 5 * sizeof(uint64_t));
+	log = msglog_new(ROOM_KEY);
+	while (msglog_load_older(log))
+		;
+	assert(msglog_first(log) == 0);
+	for (size_t i = 0; i < msglog_len(log); i++)
+		assert_text(log, i);
+	msglog_free(log);
+
+	/* Not a timeline (e.g. an older version): started again */
+	timeline_path(path, sizeof(path), "log");
+	FILE *f = fopen(path, "w");
+	fputs("garbage", f);
+	fclose(f);
+	log = msglog_new(ROOM_KEY);
+	assert(msglog_len(log) == 0);
+	append_text(log, 0);
+	msglog_free(log);
+	log = msglog_new(ROOM_KEY);
+	assert(msglog_len(log) == 1);
+	assert_text(log, 0);
+	msglog_free(log);
+}
+
+static void test_msglog_duplicates(void) {
+	msglog_set_limits(MSGLOG_BLOCK_LEN, 0);
+	MsgLog *log = msglog_new("timeline/!dup:matrix.org");
+	for (size_t i = 0; i < MSGLOG_BLOCK_LEN + 10; i++)
+		assert(append_event(log, i));
+	assert(!append_event(log, MSGLOG_BLOCK_LEN + 9));
+	/* Without event ID, nothing is a duplicate */
+	append_text(log, MSGLOG_BLOCK_LEN + 10);
+	append_text(log, MSGLOG_BLOCK_LEN + 10);
+	assert(msglog_len(log) == MSGLOG_BLOCK_LEN + 12);
+	msglog_free(log);
+
+	/* A sync received again after a crash */
+	log = msglog_new("timeline/!dup:matrix.org");
+	for (size_t i = MSGLOG_BLOCK_LEN; i < MSGLOG_BLOCK_LEN + 10; i++)
+		assert(!append_event(log, i));
+	assert(append_event(log, MSGLOG_BLOCK_LEN + 12));
+	assert(msglog_len(log) == MSGLOG_BLOCK_LEN + 13);
+	msglog_free(log);
+}
+
+static void test_msglog_fds(void) {
+	msglog_set_limits(0, 0);
+	MsgLog *logs[2 * TIMELINE_MAX_FDS];
+	char key[64];
+	for (size_t i = 0; i < 2 * TIMELINE_MAX_FDS; i++) {
+		snprintf(key, sizeof(key), "timeline/!fds%zu:matrix.org", i);
+		logs[i] = msglog_new(key);
+		append_text(logs[i], 0);
+		assert(nopen_logs <= TIMELINE_MAX_FDS);
+	}
+	/* The first ones were closed, and are opened again */
+	assert(logs[0]->fd == -1);
+	assert(logs[2 * TIMELINE_MAX_FDS - 1]->fd != -1);
+	append_text(logs[0], 1);
+	assert(logs[0]->fd != -1);
+	assert(nopen_logs == TIMELINE_MAX_FDS);
+	for (size_t i = 0; i < 2 * TIMELINE_MAX_FDS; i++)
+		msglog_free(logs[i]);
+	assert(nopen_logs == 0);
+
+	MsgLog *log = msglog_new("timeline/!fds0:matrix.org");
+	assert(msglog_len(log) == 2);
+	assert_text(log, 0);
+	assert_text(log, 1);
+	msglog_free(log);
+}
+
+static void test_msglog_failures(void) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/janechat/timeline/!fail:matrix.org",
+		dir);
+	assert(mkdir(path, 0700) == 0);
+	strcat(path, "/log");
+
+	/* The log can't be opened: messages are written with the next one */
+	msglog_set_limits(MSGLOG_BLOCK_LEN, 0);
+	MsgLog *log = msglog_new("timeline/!fail:matrix.org");
+	assert(mkdir(path, 0700) == 0);
+	for (size_t i = 0; i < 10; i++)
+		append_text(log, i);
+	assert(log->key && log->npending > 0);
+	assert(rmdir(path) == 0);
+	append_text(log, 10);
+	assert(log->npending == 0);
+	msglog_free(log);
+	log = msglog_new("timeline/!fail:matrix.org");
+	assert(msglog_len(log) == 11);
+	for (size_t i = 0; i < msglog_len(log); i++)
+		assert_text(log, i);
+
+	/* Failing for too long: given up on, without growing forever */
+	assert(unlink(path) == 0 && mkdir(path, 0700) == 0);
+	for (size_t i = 11; i < 4 * MSGLOG_BLOCK_LEN; i++)
+		append_text(log, i);
+	assert(!log->key && log->npending == 0);
+	assert(msglog_len(log) - msglog_first(log) < 3 * MSGLOG_BLOCK_LEN);
+	for (size_t i = msglog_first(log); i < msglog_len(log); i++)
+		assert_text(log, i);
+	assert(!msglog_load_older(log));
+	msglog_free(log);
+}
+
+int main(int argc, char *argv[]) {
+	assert(mkdtemp(dir));
+	setenv("XDG_CACHE_HOME", dir, 1);
+
+	test_msglog_memory();
+	test_msglog_timeline();
+	test_msglog_restart();
+	test_msglog_crash();
+	test_msglog_duplicates();
+	test_msglog_fds();
+	test_msglog_failures();
+	return 0;
+}
@@ -0,0 +1,101 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../../src/cache.c"
+#include "../../src/hash.c"
+#include "../../src/list.c"
+#include "../../src/outbox.c"
+#include "../../src/str.c"
+#include "../../src/utils.c"
+
+static void push(const char *txnid, const char *roomid, const char *text) {
+	Str *t = str_new_cstr(txnid);
+	Str *r = str_new_cstr(roomid);
+	Str *x = str_new_cstr(text);
+	outbox_push(t, r, x);
+	str_decref(t);
+	str_decref(r);
+	str_decref(x);
+}
+
+/* Forget the outbox in memory, as if janechat exited */
+static void forget(void) {
+	OutboxEntry *e;
+	while ((e = list_pop_head(outbox_list))) {
+		str_decref(e->txnid);
+		str_decref(e->roomid);
+		str_decref(e->text);
+		free(e);
+	}
+	free(outbox_list);
+	outbox_list = NULL;
+}
+
+static void test_outbox_txnid(void) {
+	Str *a = outbox_txnid_new();
+	Str *b = outbox_txnid_new();
+	assert(!str_sc_eq(a, str_buf(b)));
+	str_decref(a);
+	str_decref(b);
+}
+
+static void test_outbox_backoff(void) {
+	push("t0", "!room:matrix.org", "hello");
+	OutboxEntry *e = outbox_head();
+	assert(e->next_try == 0);
+	assert(outbox_backoff(e, 100) == 100 + OUTBOX_BACKOFF_MIN_MS);
+	assert(outbox_backoff(e, 100) == 100 + 2 * OUTBOX_BACKOFF_MIN_MS);
+	assert(outbox_backoff(e, 100) == 100 + 4 * OUTBOX_BACKOFF_MIN_MS);
+	for (int i = 0; i < 100; i++)
+		outbox_backoff(e, 0);
+	assert(e->next_try == OUTBOX_BACKOFF_MAX_MS);
+	outbox_pop();
+	assert(outbox_head() == NULL);
+}
+
+static void test_outbox_persistence(void) {
+	push("t1", "!room:matrix.org", "first");
+	push("t2", "!other:matrix.org", "multi\nline 42 message\n");
+	push("t3", "!room:matrix.org", "");
+
+	/* Start again from what was saved */
+	forget();
+	outbox_load();
+
+	OutboxEntry *e;
+	const char *expected[][3] = {
+		{ "t1", "!room:matrix.org", "first" },
+		{ "t2", "!other:matrix.org", "multi\nline 42 message\n" },
+		{ "t3", "!room:matrix.org", "" },
+	};
+	size_t i = 0;
+	OUTBOX_FOREACH(e) {
+		assert(str_sc_eq(e->txnid, expected[i][0]));
+		assert(str_sc_eq(e->roomid, expected[i][1]));
+		assert(str_sc_eq(e->text, expected[i][2]));
+		assert(e->attempts == 0);
+		i++;
+	}
+	assert(i == 3);
+
+	/* Sent messages are gone for good */
+	outbox_pop();
+	forget();
+	outbox_load();
+	assert(str_sc_eq(outbox_head()->txnid, "t2"));
+	forget();
+}
+
+int main(int argc, char *argv[]) {
+	char dir[] = "/tmp/janechat-outbox.XXXXXX";
+	assert(mkdtemp(dir));
+	setenv("XDG_CACHE_HOME", dir, 1);
+
+	test_outbox_txnid();
+	test_outbox_backoff();
+	test_outbox_persistence();
+	return 0;
+}
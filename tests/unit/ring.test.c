@@ -0,0 +1,61 @@
+#undef NDEBUG
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#include "../../src/ring.c"
+
+#define N 100000
+
+static void test_ring_push_pop() {
+	Ring *r = ring_new(4, sizeof(int));
+	int v;
+	assert(ring_empty(r));
+	assert(!ring_pop(r, &v));
+
+	/* Go around the ring a few times */
+	for (int round = 0; round < 3; round++) {
+		for (int i = 0; i < 4; i++)
+			assert(ring_push(r, &i));
+		int extra = 4;
+		assert(!ring_push(r, &extra));
+		for (int i = 0; i < 4; i++) {
+			assert(ring_pop(r, &v));
+			assert(v == i);
+		}
+		assert(ring_empty(r));
+	}
+	ring_free(r);
+}
+
+static void *producer(void *params) {
+	Ring *r = params;
+	for (long i = 0; i < N; i++)
+		while (!ring_push(r, &i))
+			sched_yield();
+	return NULL;
+}
+
+static void test_ring_threads() {
+	Ring *r = ring_new(64, sizeof(long));
+	pthread_t t;
+	assert(pthread_create(&t, NULL, producer, r) == 0);
+
+	/* Everything arrives, in order */
+	for (long i = 0; i < N; i++) {
+		long v;
+		while (!ring_pop(r, &v))
+			sched_yield();
+		assert(v == i);
+	}
+	assert(pthread_join(t, NULL) == 0);
+	assert(ring_empty(r));
+	ring_free(r);
+}
+
+int main(int argc, char *argv[]) {
+	test_ring_push_pop();
+	test_ring_threads();
+	return 0;
+}
@@ -0,0 +1,100 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../../src/cache.c"
+#include "../../src/hash.c"
+#include "../../src/intern.c"
+#include "../../src/msglog.c"
+#include "../../src/rooms.c"
+#include "../../src/str.c"
+#include "../../src/users.c"
+#include "../../src/utils.c"
+#include "../../src/vector.c"
+
+static char dir[] = "/tmp/janechat-rooms.XXXXXX";
+
+static Str *s(const char *cstr) {
+	return intern_cstr(cstr);
+}
+
+static bool eq(Str *a, const char *b) {
+	if (!a || !b)
+		return !a && !b;
+	return streq(str_buf(a), b);
+}
+
+static void snapshot_path(char *path, size_t len) {
+	snprintf(path, len, "%s/janechat/%s", dir, SNAPSHOT_KEY);
+}
+
+static void test_rooms_snapshot(void) {
+	rooms_init();
+	Room *r = room_new(s("!a:matrix.org"), false);
+	room_set_info(r, s("@alice:matrix.org"), s("Room A"));
+	room_set_displayname(r, s("My room"));
+	room_append_user(r, s("@alice:matrix.org"));
+	room_append_user(r, s("@bob:matrix.org"));
+	r->notify = false;
+	r = room_new(s("!b:matrix.org"), true);
+	room_append_user(r, s("@bob:matrix.org"));
+	assert(rooms_save());
+
+	/* As if janechat started again */
+	rooms_init();
+	assert(rooms_load());
+	assert(vector_len(rooms_vector) == 2);
+
+	r = room_byid(s("!a:matrix.org"));
+	assert(r && !r->is_space && !r->notify);
+	assert(eq(r->name, "Room A"));
+	assert(eq(r->sender, "@alice:matrix.org"));
+	assert(eq(r->displayname, "My room"));
+	assert(vector_len(r->users) == 2);
+	assert(eq(vector_at(r->users, 0), "@alice:matrix.org"));
+	assert(eq(vector_at(r->users, 1), "@bob:matrix.org"));
+
+	r = room_byid(s("!b:matrix.org"));
+	assert(r && r->is_space && r->notify);
+	assert(!r->name && !r->sender && !r->displayname);
+	assert(vector_len(r->users) == 1);
+}
+
+static void test_rooms_snapshot_invalid(void) {
+	char path[PATH_MAX];
+	snapshot_path(path, sizeof(path));
+	struct stat st;
+	assert(stat(path, &st) == 0);
+
+	/* Cut short: nothing is created */
+	assert(truncate(path, st.st_size - 1) == 0);
+	rooms_init();
+	assert(!rooms_load());
+	assert(vector_len(rooms_vector) == 0);
+
+	/* A string offset out of the table */
+	rooms_init();
+	room_new(s("!a:matrix.org"), false);
+	assert(rooms_save());
+	FILE *f = fopen(path, "r+");
+	uint32_t bad = 1 << 30;
+	fseek(f, sizeof(struct snap_header), SEEK_SET);
+	fwrite(&bad, sizeof(bad), 1, f);
+	fclose(f);
+	rooms_init();
+	assert(!rooms_load());
+
+	unlink(path);
+	assert(!rooms_load());
+}
+
+int main(int argc, char *argv[]) {
+	assert(mkdtemp(dir));
+	setenv("XDG_CACHE_HOME", dir, 1);
+
+	test_rooms_snapshot();
+	test_rooms_snapshot_invalid();
+	return 0;
+}
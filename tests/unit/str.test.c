@@ -11,6 +11,26 @@ static void test_str_new() {
 	assert(str_bytelen(s) == s->max);
 }
 
+static void test_str_inline() {
+	Str *s = str_new_cstr_fixed("hello");
+	assert(str_buf(s) == s->inl);
+	assert(s->max == 5);
+
+	/* Outgrow the initial buffer */
+	str_append_cstr(s, ", world");
+	assert(str_buf(s) != s->inl);
+	assert(str_sc_eq(s, "hello, world"));
+	assert(s->max == 20);
+	str_decref(s);
+
+	s = str_new_cstr("");
+	assert(s->max == 0);
+	str_append_cstr(s, "abc");
+	assert(str_sc_eq(s, "abc"));
+	assert(s->max == 4);
+	str_decref(s);
+}
+
 static void test_str_append_cstr() {
 	Str *s = str_new_cstr("abc");
 	assert(str_bytelen(s) == 3);
@@ -143,6 +163,7 @@ void test_str_utf8char_foreach() {
 
 int main(int argc, char *argv[]) {
 	test_str_new();
+	test_str_inline();
 	test_str_append_cstr();
 	test_grow();
 	test_str_insert_utf8char_at();
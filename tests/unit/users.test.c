@@ -0,0 +1,145 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../../src/cache.c"
+#include "../../src/hash.c"
+#include "../../src/intern.c"
+#include "../../src/str.c"
+#include "../../src/users.c"
+#include "../../src/utils.c"
+
+static char dir[] = "/tmp/janechat-users.XXXXXX";
+
+static Str *s(const char *cstr) {
+	return intern_cstr(cstr);
+}
+
+static bool eq(Str *a, const char *b) {
+	if (!a || !b)
+		return !a && !b;
+	return streq(str_buf(a), b);
+}
+
+/* Forget what is in memory, as if janechat started again */
+static void reload(void) {
+	users = NULL;
+	dirty_users = 0;
+}
+
+static off_t log_size(void) {
+	char path[PATH_MAX];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/janechat/%s", dir, USERS_KEY);
+	if (stat(path, &st) != 0)
+		return 0;
+	return st.st_size;
+}
+
+static void test_users_directory(void) {
+	assert(eq(user_name(s("@alice:matrix.org")), "@alice:matrix.org"));
+	user_add(s("@alice:matrix.org"), s("Alice"), s("mxc://matrix.org/a"));
+	user_add(s("@bob:matrix.org"), NULL, NULL);
+	assert(eq(user_name(s("@alice:matrix.org")), "Alice"));
+	assert(eq(user_avatar(s("@alice:matrix.org")), "mxc://matrix.org/a"));
+	assert(eq(user_name(s("@bob:matrix.org")), "@bob:matrix.org"));
+	assert(user_avatar(s("@bob:matrix.org")) == NULL);
+
+	/* Nothing is written until flushed */
+	assert(log_size() == 0);
+	users_flush();
+	off_t size = log_size();
+	assert(size > 0);
+
+	/* Changes are seen, and only what changed is written */
+	unsigned long gen = users_generation();
+	user_add(s("@alice:matrix.org"), s("Alice"), s("mxc://matrix.org/a"));
+	users_flush();
+	assert(log_size() == size);
+	user_add(s("@alice:matrix.org"), s("Alice"), NULL);
+	assert(users_generation() == gen);
+	user_add(s("@alice:matrix.org"), s("Alicia"), NULL);
+	assert(users_generation() != gen);
+	user_add(s("@alice:matrix.org"), s("Alice B."), NULL);
+	assert(eq(user_name(s("@alice:matrix.org")), "Alice B."));
+	users_flush();
+	assert(log_size() == size + (off_t)(sizeof(struct user_record)
+		+ strlen("@alice:matrix.org") + strlen("Alice B.")));
+
+	reload();
+	assert(eq(user_name(s("@alice:matrix.org")), "Alice B."));
+	assert(user_avatar(s("@alice:matrix.org")) == NULL);
+	assert(eq(user_name(s("@bob:matrix.org")), "@bob:matrix.org"));
+	assert(user_avatar(s("@carol:matrix.org")) == NULL);
+}
+
+static void test_users_truncated(void) {
+	off_t size = log_size();
+	user_add(s("@carol:matrix.org"), s("Carol"), NULL);
+	users_flush();
+
+	/* A crash in the middle of the last record */
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/janechat/%s", dir, USERS_KEY);
+	assert(truncate(path, size + 5) == 0);
+	reload();
+	assert(eq(user_name(s("@carol:matrix.org")), "@carol:matrix.org"));
+	assert(eq(user_name(s("@alice:matrix.org")), "Alice B."));
+	assert(log_size() < size + 5);
+
+	/* Appending after it is fine */
+	user_add(s("@carol:matrix.org"), s("Carol"), NULL);
+	users_flush();
+	reload();
+	assert(eq(user_name(s("@carol:matrix.org")), "Carol"));
+}
+
+static void test_users_compaction(void) {
+	char name[32];
+	for (int i = 0; i < 2 * USERS_COMPACT_MIN; i++) {
+		snprintf(name, sizeof(name), "Dave %d", i);
+		user_add(s("@dave:matrix.org"), s(name), NULL);
+		users_flush();
+	}
+	off_t size = log_size();
+	reload();
+	snprintf(name, sizeof(name), "Dave %d", 2 * USERS_COMPACT_MIN - 1);
+	assert(eq(user_name(s("@dave:matrix.org")), name));
+	assert(log_size() < size / 100);
+	reload();
+	assert(eq(user_name(s("@dave:matrix.org")), name));
+	assert(eq(user_name(s("@carol:matrix.org")), "Carol"));
+}
+
+static void test_users_flush_error(void) {
+	char path[PATH_MAX], moved[PATH_MAX + 8];
+	snprintf(path, sizeof(path), "%s/janechat/%s", dir, USERS_KEY);
+	snprintf(moved, sizeof(moved), "%s.moved", path);
+
+	/* The log can't be opened: nothing is forgotten */
+	assert(rename(path, moved) == 0);
+	assert(mkdir(path, 0700) == 0);
+	user_add(s("@erin:matrix.org"), s("Erin"), NULL);
+	users_flush();
+	assert(dirty_users == 1);
+	assert(rmdir(path) == 0);
+	assert(rename(moved, path) == 0);
+
+	users_flush();
+	assert(dirty_users == 0);
+	reload();
+	assert(eq(user_name(s("@erin:matrix.org")), "Erin"));
+}
+
+int main(int argc, char *argv[]) {
+	assert(mkdtemp(dir));
+	setenv("XDG_CACHE_HOME", dir, 1);
+
+	test_users_directory();
+	test_users_truncated();
+	test_users_compaction();
+	test_users_flush_error();
+	return 0;
+}